@@ -21,6 +21,8 @@
 #include <linux/jhash.h>
 #include <linux/random.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include <linux/atomic.h>
 #include <asm/unaligned.h>
 #include "br_private.h"
@@ -33,6 +35,23 @@ static void fdb_notify(struct net_bridge *br,
 
 static u32 fdb_salt __read_mostly;
 
+/* The table doubles once it holds more entries than buckets and halves
+ * once it falls below an eighth of that, never going under BR_HASH_SIZE.
+ */
+#define BR_FDB_HASH_MAX		(1 << 20)
+
+/* Buckets examined by one run of the ageing timer. A full sweep is
+ * spread over as many runs as the table needs, so hash_lock is never
+ * held for longer than one batch.
+ */
+#define BR_FDB_GC_BATCH		256
+
+/* Old buckets moved to the new table per hash_lock hold in a rehash */
+#define BR_FDB_REHASH_BATCH	256
+
+#define fdb_lock_dereference(X, br) \
+	rcu_dereference_protected(X, lockdep_is_held(&(br)->hash_lock))
+
 int __init br_fdb_init(void)
 {
 	br_fdb_cache = kmem_cache_create("bridge_fdb_cache",
@@ -67,11 +86,171 @@ static inline int has_expired(const struct net_bridge *br,
 		time_before_eq(fdb->updated + hold_time(br), jiffies);
 }
 
-static inline int br_mac_hash(const unsigned char *mac)
+static inline int br_mac_hash(const struct net_bridge_fdb_htable *tbl,
+			      const unsigned char *mac, u16 vid)
 {
 	/* use 1 byte of OUI cnd 3 bytes of NIC */
 	u32 key = get_unaligned((u32 *)(mac + 2));
-	return jhash_1word(key, fdb_salt) & (BR_HASH_SIZE - 1);
+	return jhash_2words(key, vid, fdb_salt) & (tbl->max - 1);
+}
+
+static struct net_bridge_fdb_htable *fdb_hash_alloc(u32 max)
+{
+	struct net_bridge_fdb_htable *tbl;
+	size_t size = max * sizeof(struct hlist_head);
+
+	tbl = kmalloc(sizeof(*tbl), GFP_KERNEL);
+	if (!tbl)
+		return NULL;
+
+	if (size <= PAGE_SIZE)
+		tbl->hash = kzalloc(size, GFP_KERNEL);
+	else
+		tbl->hash = vzalloc(size);
+	if (!tbl->hash) {
+		kfree(tbl);
+		return NULL;
+	}
+
+	tbl->size = 0;
+	tbl->max = max;
+	tbl->ver = 0;
+	return tbl;
+}
+
+static void fdb_hash_free(struct net_bridge_fdb_htable *tbl)
+{
+	if (is_vmalloc_addr(tbl->hash))
+		vfree(tbl->hash);
+	else
+		kfree(tbl->hash);
+	kfree(tbl);
+}
+
+/* Bucket count the table should have for its current population */
+static u32 fdb_hash_target(const struct net_bridge_fdb_htable *tbl)
+{
+	u32 max = tbl->max;
+
+	while (tbl->size > max && max < BR_FDB_HASH_MAX)
+		max <<= 1;
+	while (tbl->size < max / 8 && max > BR_HASH_SIZE)
+		max >>= 1;
+
+	return max;
+}
+
+/*
+ * While a rehash fills the new table, entries of the old buckets below
+ * fdb_rehash_pos are already linked there too. fdb_create() and
+ * fdb_delete() keep such entries in step. Called with hash_lock held.
+ */
+static struct net_bridge_fdb_htable *
+fdb_rehash_peer(struct net_bridge *br, struct net_bridge_fdb_htable *tbl,
+		const struct net_bridge_fdb_entry *f)
+{
+	struct net_bridge_fdb_htable *new = br->fdb_rehash_tbl;
+
+	if (new && br_mac_hash(tbl, f->addr.addr, f->vlan_id) <
+		   br->fdb_rehash_pos)
+		return new;
+	return NULL;
+}
+
+/*
+ * Move every entry onto a table of the target size. Entries carry two
+ * list nodes and the new table links the one the old table does not
+ * use, so lookups that still hold the old table keep walking intact
+ * chains. The new table is filled BR_FDB_REHASH_BATCH old buckets per
+ * hold of hash_lock and only published once complete; meanwhile
+ * writers mirror their changes to the buckets already moved. The old
+ * table may only be reused or freed after a grace period, which is why
+ * this runs from process context and nowhere else.
+ */
+static void br_fdb_rehash(struct work_struct *work)
+{
+	struct net_bridge *br = container_of(work, struct net_bridge,
+					     fdb_rehash_work);
+	struct net_bridge_fdb_htable *old, *new;
+	struct net_bridge_fdb_entry *f;
+	struct hlist_node *h;
+	u32 max, end;
+	int i;
+
+	spin_lock_bh(&br->hash_lock);
+	max = fdb_hash_target(fdb_lock_dereference(br->fdb_hash, br));
+	spin_unlock_bh(&br->hash_lock);
+
+	new = fdb_hash_alloc(max);
+	if (!new)
+		return;
+
+	spin_lock_bh(&br->hash_lock);
+	old = fdb_lock_dereference(br->fdb_hash, br);
+	if (old->max == max) {
+		spin_unlock_bh(&br->hash_lock);
+		fdb_hash_free(new);
+		return;
+	}
+
+	new->ver = old->ver ^ 1;
+	br->fdb_rehash_tbl = new;
+	br->fdb_rehash_pos = 0;
+
+	/* Only this work replaces fdb_hash, so old stays current */
+	while (br->fdb_rehash_pos < old->max) {
+		end = min_t(u32, br->fdb_rehash_pos + BR_FDB_REHASH_BATCH,
+			    old->max);
+		for (i = br->fdb_rehash_pos; i < end; i++)
+			hlist_for_each_entry(f, h, &old->hash[i],
+					     hlist[old->ver])
+				hlist_add_head(&f->hlist[new->ver],
+					       &new->hash[br_mac_hash(new,
+							f->addr.addr,
+							f->vlan_id)]);
+		br->fdb_rehash_pos = end;
+
+		if (end < old->max) {
+			spin_unlock_bh(&br->hash_lock);
+			cond_resched();
+			spin_lock_bh(&br->hash_lock);
+		}
+	}
+
+	new->size = old->size;
+	br->fdb_rehash_tbl = NULL;
+
+	/* keep the ageing sweep roughly where it was */
+	br->fdb_gc_pos = (u64)br->fdb_gc_pos * new->max / old->max;
+	rcu_assign_pointer(br->fdb_hash, new);
+	spin_unlock_bh(&br->hash_lock);
+
+	synchronize_rcu();
+	fdb_hash_free(old);
+}
+
+int br_fdb_hash_init(struct net_bridge *br)
+{
+	struct net_bridge_fdb_htable *tbl;
+
+	tbl = fdb_hash_alloc(BR_HASH_SIZE);
+	if (!tbl)
+		return -ENOMEM;
+
+	INIT_WORK(&br->fdb_rehash_work, br_fdb_rehash);
+	br->fdb_rehash_tbl = NULL;
+	br->fdb_rehash_pos = 0;
+	br->fdb_gc_pos = 0;
+	br->fdb_gc_next = jiffies + br->ageing_time;
+	RCU_INIT_POINTER(br->fdb_hash, tbl);
+	return 0;
+}
+
+/* Called from the device destructor, when no one can look up any more */
+void br_fdb_hash_fini(struct net_bridge *br)
+{
+	cancel_work_sync(&br->fdb_rehash_work);
+	fdb_hash_free(rcu_dereference_protected(br->fdb_hash, 1));
 }
 
 static void fdb_rcu_free(struct rcu_head *head)
@@ -83,7 +262,13 @@ static void fdb_rcu_free(struct rcu_head *head)
 
 static void fdb_delete(struct net_bridge *br, struct net_bridge_fdb_entry *f)
 {
-	hlist_del_rcu(&f->hlist);
+	struct net_bridge_fdb_htable *tbl = fdb_lock_dereference(br->fdb_hash, br);
+	struct net_bridge_fdb_htable *new = fdb_rehash_peer(br, tbl, f);
+
+	hlist_del_rcu(&f->hlist[tbl->ver]);
+	if (new)
+		hlist_del(&f->hlist[new->ver]);
+	tbl->size--;
 	fdb_notify(br, f, RTM_DELNEIGH);
 	call_rcu(&f->rcu, fdb_rcu_free);
 }
@@ -91,17 +276,20 @@ static void fdb_delete(struct net_bridge *br, struct net_bridge_fdb_entry *f)
 void br_fdb_changeaddr(struct net_bridge_port *p, const unsigned char *newaddr)
 {
 	struct net_bridge *br = p->br;
+	struct net_bridge_fdb_htable *tbl;
 	int i;
 
 	spin_lock_bh(&br->hash_lock);
+	tbl = fdb_lock_dereference(br->fdb_hash, br);
 
 	/* Search all chains since old address/hash is unknown */
-	for (i = 0; i < BR_HASH_SIZE; i++) {
+	for (i = 0; i < tbl->max; i++) {
 		struct hlist_node *h;
-		hlist_for_each(h, &br->hash[i]) {
+		hlist_for_each(h, &tbl->hash[i]) {
 			struct net_bridge_fdb_entry *f;
 
-			f = hlist_entry(h, struct net_bridge_fdb_entry, hlist);
+			f = hlist_entry(h, struct net_bridge_fdb_entry,
+					hlist[tbl->ver]);
 			if (f->dst == p && f->is_local) {
 				/* maybe another port has same hw addr? */
 				struct net_bridge_port *op;
@@ -131,52 +319,84 @@ void br_fdb_change_mac_address(struct net_bridge *br, const u8 *newaddr)
 {
 	struct net_bridge_fdb_entry *f;
 
+	spin_lock_bh(&br->hash_lock);
+
 	/* If old entry was unassociated with any port, then delete it. */
-	f = __br_fdb_get(br, br->dev->dev_addr);
+	f = __br_fdb_get(br, br->dev->dev_addr, 0);
 	if (f && f->is_local && !f->dst)
 		fdb_delete(br, f);
 
 	fdb_insert(br, NULL, newaddr);
+
+	spin_unlock_bh(&br->hash_lock);
 }
 
+/*
+ * Age the table BR_FDB_GC_BATCH buckets at a time. While a sweep is in
+ * progress the timer is rearmed for the next tick; once the cursor wraps
+ * it sleeps until the earliest expiry seen during the sweep.
+ */
 void br_fdb_cleanup(unsigned long _data)
 {
 	struct net_bridge *br = (struct net_bridge *)_data;
 	unsigned long delay = hold_time(br);
-	unsigned long next_timer = jiffies + br->ageing_time;
-	int i;
+	struct net_bridge_fdb_htable *tbl;
+	unsigned long next_timer;
+	u32 i, end;
 
 	spin_lock(&br->hash_lock);
-	for (i = 0; i < BR_HASH_SIZE; i++) {
+	tbl = fdb_lock_dereference(br->fdb_hash, br);
+
+	if (br->fdb_gc_pos >= tbl->max)
+		br->fdb_gc_pos = 0;
+	if (br->fdb_gc_pos == 0)
+		br->fdb_gc_next = jiffies + br->ageing_time;
+
+	end = min_t(u32, br->fdb_gc_pos + BR_FDB_GC_BATCH, tbl->max);
+	for (i = br->fdb_gc_pos; i < end; i++) {
 		struct net_bridge_fdb_entry *f;
 		struct hlist_node *h, *n;
 
-		hlist_for_each_entry_safe(f, h, n, &br->hash[i], hlist) {
+		hlist_for_each_entry_safe(f, h, n, &tbl->hash[i],
+					  hlist[tbl->ver]) {
 			unsigned long this_timer;
 			if (f->is_static)
 				continue;
 			this_timer = f->updated + delay;
 			if (time_before_eq(this_timer, jiffies))
 				fdb_delete(br, f);
-			else if (time_before(this_timer, next_timer))
-				next_timer = this_timer;
+			else if (time_before(this_timer, br->fdb_gc_next))
+				br->fdb_gc_next = this_timer;
 		}
 	}
+
+	if (end < tbl->max) {
+		br->fdb_gc_pos = end;
+		next_timer = jiffies + 1;
+	} else {
+		br->fdb_gc_pos = 0;
+		next_timer = round_jiffies_up(br->fdb_gc_next);
+		if (fdb_hash_target(tbl) != tbl->max)
+			schedule_work(&br->fdb_rehash_work);
+	}
 	spin_unlock(&br->hash_lock);
 
-	mod_timer(&br->gc_timer, round_jiffies_up(next_timer));
+	mod_timer(&br->gc_timer, next_timer);
 }
 
 /* Completely flush all dynamic entries in forwarding database.*/
 void br_fdb_flush(struct net_bridge *br)
 {
+	struct net_bridge_fdb_htable *tbl;
 	int i;
 
 	spin_lock_bh(&br->hash_lock);
-	for (i = 0; i < BR_HASH_SIZE; i++) {
+	tbl = fdb_lock_dereference(br->fdb_hash, br);
+	for (i = 0; i < tbl->max; i++) {
 		struct net_bridge_fdb_entry *f;
 		struct hlist_node *h, *n;
-		hlist_for_each_entry_safe(f, h, n, &br->hash[i], hlist) {
+		hlist_for_each_entry_safe(f, h, n, &tbl->hash[i],
+					  hlist[tbl->ver]) {
 			if (!f->is_static)
 				fdb_delete(br, f);
 		}
@@ -191,15 +411,18 @@ void br_fdb_delete_by_port(struct net_bridge *br,
 			   const struct net_bridge_port *p,
 			   int do_all)
 {
+	struct net_bridge_fdb_htable *tbl;
 	int i;
 
 	spin_lock_bh(&br->hash_lock);
-	for (i = 0; i < BR_HASH_SIZE; i++) {
+	tbl = fdb_lock_dereference(br->fdb_hash, br);
+	for (i = 0; i < tbl->max; i++) {
 		struct hlist_node *h, *g;
 
-		hlist_for_each_safe(h, g, &br->hash[i]) {
+		hlist_for_each_safe(h, g, &tbl->hash[i]) {
 			struct net_bridge_fdb_entry *f
-				= hlist_entry(h, struct net_bridge_fdb_entry, hlist);
+				= hlist_entry(h, struct net_bridge_fdb_entry,
+					      hlist[tbl->ver]);
 			if (f->dst != p)
 				continue;
 
@@ -229,21 +452,37 @@ void br_fdb_delete_by_port(struct net_bridge *br,
 	spin_unlock_bh(&br->hash_lock);
 }
 
-/* No locking or refcounting, assumes caller has rcu_read_lock */
+/*
+ * No locking or refcounting, assumes caller has rcu_read_lock.
+ * Entries without a VLAN (local addresses and those added by hand)
+ * match any VLAN the address is not otherwise known in.
+ */
 struct net_bridge_fdb_entry *__br_fdb_get(struct net_bridge *br,
-					  const unsigned char *addr)
+					  const unsigned char *addr,
+					  u16 vid)
 {
+	struct net_bridge_fdb_htable *tbl = rcu_dereference_check(br->fdb_hash,
+			lockdep_is_held(&br->hash_lock));
 	struct hlist_node *h;
 	struct net_bridge_fdb_entry *fdb;
 
-	hlist_for_each_entry_rcu(fdb, h, &br->hash[br_mac_hash(addr)], hlist) {
-		if (ether_addr_equal(fdb->addr.addr, addr)) {
+again:
+	hlist_for_each_entry_rcu(fdb, h,
+				 &tbl->hash[br_mac_hash(tbl, addr, vid)],
+				 hlist[tbl->ver]) {
+		if (ether_addr_equal(fdb->addr.addr, addr) &&
+		    fdb->vlan_id == vid) {
 			if (unlikely(has_expired(br, fdb)))
 				break;
 			return fdb;
 		}
 	}
 
+	if (vid) {
+		vid = 0;
+		goto again;
+	}
+
 	return NULL;
 }
 
@@ -261,7 +500,7 @@ int br_fdb_test_addr(struct net_device *dev, unsigned char *addr)
 	if (!port)
 		ret = 0;
 	else {
-		fdb = __br_fdb_get(port->br, addr);
+		fdb = __br_fdb_get(port->br, addr, 0);
 		ret = fdb && fdb->dst && fdb->dst->dev != dev &&
 			fdb->dst->state == BR_STATE_FORWARDING;
 	}
@@ -279,6 +518,7 @@ int br_fdb_fillbuf(struct net_bridge *br, void *buf,
 		   unsigned long maxnum, unsigned long skip)
 {
 	struct __fdb_entry *fe = buf;
+	struct net_bridge_fdb_htable *tbl;
 	int i, num = 0;
 	struct hlist_node *h;
 	struct net_bridge_fdb_entry *f;
@@ -286,8 +526,9 @@ int br_fdb_fillbuf(struct net_bridge *br, void *buf,
 	memset(buf, 0, maxnum*sizeof(struct __fdb_entry));
 
 	rcu_read_lock();
-	for (i = 0; i < BR_HASH_SIZE; i++) {
-		hlist_for_each_entry_rcu(f, h, &br->hash[i], hlist) {
+	tbl = rcu_dereference(br->fdb_hash);
+	for (i = 0; i < tbl->max; i++) {
+		hlist_for_each_entry_rcu(f, h, &tbl->hash[i], hlist[tbl->ver]) {
 			if (num >= maxnum)
 				goto out;
 
@@ -324,46 +565,65 @@ int br_fdb_fillbuf(struct net_bridge *br, void *buf,
 	return num;
 }
 
-static struct net_bridge_fdb_entry *fdb_find(struct hlist_head *head,
-					     const unsigned char *addr)
+static struct net_bridge_fdb_entry *fdb_find(struct net_bridge_fdb_htable *tbl,
+					     const unsigned char *addr,
+					     u16 vid)
 {
+	struct hlist_head *head = &tbl->hash[br_mac_hash(tbl, addr, vid)];
 	struct hlist_node *h;
 	struct net_bridge_fdb_entry *fdb;
 
-	hlist_for_each_entry(fdb, h, head, hlist) {
-		if (ether_addr_equal(fdb->addr.addr, addr))
+	hlist_for_each_entry(fdb, h, head, hlist[tbl->ver]) {
+		if (ether_addr_equal(fdb->addr.addr, addr) &&
+		    fdb->vlan_id == vid)
 			return fdb;
 	}
 	return NULL;
 }
 
-static struct net_bridge_fdb_entry *fdb_find_rcu(struct hlist_head *head,
-						 const unsigned char *addr)
+static struct net_bridge_fdb_entry *fdb_find_rcu(struct net_bridge_fdb_htable *tbl,
+						 const unsigned char *addr,
+						 u16 vid)
 {
+	struct hlist_head *head = &tbl->hash[br_mac_hash(tbl, addr, vid)];
 	struct hlist_node *h;
 	struct net_bridge_fdb_entry *fdb;
 
-	hlist_for_each_entry_rcu(fdb, h, head, hlist) {
-		if (ether_addr_equal(fdb->addr.addr, addr))
+	hlist_for_each_entry_rcu(fdb, h, head, hlist[tbl->ver]) {
+		if (ether_addr_equal(fdb->addr.addr, addr) &&
+		    fdb->vlan_id == vid)
 			return fdb;
 	}
 	return NULL;
 }
 
-static struct net_bridge_fdb_entry *fdb_create(struct hlist_head *head,
+/* Called with hash_lock held */
+static struct net_bridge_fdb_entry *fdb_create(struct net_bridge *br,
 					       struct net_bridge_port *source,
-					       const unsigned char *addr)
+					       const unsigned char *addr,
+					       u16 vid)
 {
+	struct net_bridge_fdb_htable *tbl = fdb_lock_dereference(br->fdb_hash, br);
+	struct net_bridge_fdb_htable *new;
 	struct net_bridge_fdb_entry *fdb;
 
 	fdb = kmem_cache_alloc(br_fdb_cache, GFP_ATOMIC);
 	if (fdb) {
 		memcpy(fdb->addr.addr, addr, ETH_ALEN);
+		fdb->vlan_id = vid;
 		fdb->dst = source;
 		fdb->is_local = 0;
 		fdb->is_static = 0;
 		fdb->updated = fdb->used = jiffies;
-		hlist_add_head_rcu(&fdb->hlist, head);
+		hlist_add_head_rcu(&fdb->hlist[tbl->ver],
+				   &tbl->hash[br_mac_hash(tbl, addr, vid)]);
+		new = fdb_rehash_peer(br, tbl, fdb);
+		if (unlikely(new))
+			hlist_add_head(&fdb->hlist[new->ver],
+				       &new->hash[br_mac_hash(new, addr, vid)]);
+		if (unlikely(++tbl->size > tbl->max) &&
+		    tbl->max < BR_FDB_HASH_MAX)
+			schedule_work(&br->fdb_rehash_work);
 	}
 	return fdb;
 }
@@ -371,13 +631,12 @@ static struct net_bridge_fdb_entry *fdb_create(struct hlist_head *head,
 static int fdb_insert(struct net_bridge *br, struct net_bridge_port *source,
 		  const unsigned char *addr)
 {
-	struct hlist_head *head = &br->hash[br_mac_hash(addr)];
 	struct net_bridge_fdb_entry *fdb;
 
 	if (!is_valid_ether_addr(addr))
 		return -EINVAL;
 
-	fdb = fdb_find(head, addr);
+	fdb = fdb_find(fdb_lock_dereference(br->fdb_hash, br), addr, 0);
 	if (fdb) {
 		/* it is okay to have multiple ports with same
 		 * address, just use the first one.
@@ -390,7 +649,7 @@ static int fdb_insert(struct net_bridge *br, struct net_bridge_port *source,
 		fdb_delete(br, fdb);
 	}
 
-	fdb = fdb_create(head, source, addr);
+	fdb = fdb_create(br, source, addr, 0);
 	if (!fdb)
 		return -ENOMEM;
 
@@ -412,9 +671,9 @@ int br_fdb_insert(struct net_bridge *br, struct net_bridge_port *source,
 }
 
 void br_fdb_update(struct net_bridge *br, struct net_bridge_port *source,
-		   const unsigned char *addr)
+		   const unsigned char *addr, u16 vid)
 {
-	struct hlist_head *head = &br->hash[br_mac_hash(addr)];
+	struct net_bridge_fdb_htable *tbl;
 	struct net_bridge_fdb_entry *fdb;
 
 	/* some users want to always flood. */
@@ -426,7 +685,14 @@ void br_fdb_update(struct net_bridge *br, struct net_bridge_port *source,
 	      source->state == BR_STATE_FORWARDING))
 		return;
 
-	fdb = fdb_find_rcu(head, addr);
+	tbl = rcu_dereference(br->fdb_hash);
+	fdb = fdb_find_rcu(tbl, addr, vid);
+	/* local addresses are kept once, outside of any VLAN */
+	if (unlikely(!fdb && vid)) {
+		fdb = fdb_find_rcu(tbl, addr, 0);
+		if (fdb && !fdb->is_local)
+			fdb = NULL;
+	}
 	if (likely(fdb)) {
 		/* attempt to update an entry for a local interface */
 		if (unlikely(fdb->is_local)) {
@@ -441,8 +707,9 @@ void br_fdb_update(struct net_bridge *br, struct net_bridge_port *source,
 		}
 	} else {
 		spin_lock(&br->hash_lock);
-		if (likely(!fdb_find(head, addr))) {
-			fdb = fdb_create(head, source, addr);
+		if (likely(!fdb_find(fdb_lock_dereference(br->fdb_hash, br),
+				     addr, vid))) {
+			fdb = fdb_create(br, source, addr, vid);
 			if (fdb)
 				fdb_notify(br, fdb, RTM_NEWNEIGH);
 		}
@@ -541,16 +808,19 @@ int br_fdb_dump(struct sk_buff *skb,
 		int idx)
 {
 	struct net_bridge *br = netdev_priv(dev);
+	struct net_bridge_fdb_htable *tbl;
 	int i;
 
 	if (!(dev->priv_flags & IFF_EBRIDGE))
 		goto out;
 
-	for (i = 0; i < BR_HASH_SIZE; i++) {
+	rcu_read_lock();
+	tbl = rcu_dereference(br->fdb_hash);
+	for (i = 0; i < tbl->max; i++) {
 		struct hlist_node *h;
 		struct net_bridge_fdb_entry *f;
 
-		hlist_for_each_entry_rcu(f, h, &br->hash[i], hlist) {
+		hlist_for_each_entry_rcu(f, h, &tbl->hash[i], hlist[tbl->ver]) {
 			if (idx < cb->args[0])
 				goto skip;
 
@@ -564,6 +834,7 @@ skip:
 			++idx;
 		}
 	}
+	rcu_read_unlock();
 
 out:
 	return idx;
@@ -574,15 +845,14 @@ static int fdb_add_entry(struct net_bridge_port *source, const __u8 *addr,
 			 __u16 state, __u16 flags)
 {
 	struct net_bridge *br = source->br;
-	struct hlist_head *head = &br->hash[br_mac_hash(addr)];
 	struct net_bridge_fdb_entry *fdb;
 
-	fdb = fdb_find(head, addr);
+	fdb = fdb_find(fdb_lock_dereference(br->fdb_hash, br), addr, 0);
 	if (fdb == NULL) {
 		if (!(flags & NLM_F_CREATE))
 			return -ENOENT;
 
-		fdb = fdb_create(head, source, addr);
+		fdb = fdb_create(br, source, addr, 0);
 		if (!fdb)
 			return -ENOMEM;
 		fdb_notify(br, fdb, RTM_NEWNEIGH);
@@ -629,7 +899,7 @@ int br_fdb_add(struct ndmsg *ndm, struct nlattr *tb[],
 
 	if (ndm->ndm_flags & NTF_USE) {
 		rcu_read_lock();
-		br_fdb_update(p->br, p, addr);
+		br_fdb_update(p->br, p, addr, 0);
 		rcu_read_unlock();
 	} else {
 		spin_lock_bh(&p->br->hash_lock);
@@ -643,10 +913,9 @@ int br_fdb_add(struct ndmsg *ndm, struct nlattr *tb[],
 static int fdb_delete_by_addr(struct net_bridge_port *p, const u8 *addr)
 {
 	struct net_bridge *br = p->br;
-	struct hlist_head *head = &br->hash[br_mac_hash(addr)];
 	struct net_bridge_fdb_entry *fdb;
 
-	fdb = fdb_find(head, addr);
+	fdb = fdb_find(fdb_lock_dereference(br->fdb_hash, br), addr, 0);
 	if (!fdb)
 		return -ENOENT;
 
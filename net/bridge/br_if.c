@@ -151,6 +151,7 @@ static void del_nbp(struct net_bridge_port *p)
 	netdev_set_master(dev, NULL);
 
 	br_multicast_del_port(p);
+	nbp_vlan_flush(p);
 
 	kobject_uevent(&p->kobj, KOBJ_REMOVE);
 	kobject_del(&p->kobj);
@@ -171,6 +172,7 @@ void br_dev_delete(struct net_device *dev, struct list_head *head)
 	}
 
 	del_timer_sync(&br->gc_timer);
+	br_vlan_flush(br);
 
 	br_sysfs_delbr(br->dev);
 	unregister_netdevice_queue(br->dev, head);
@@ -171,6 +171,74 @@ void br_netfilter_rtable_init(struct net_bridge *br)
 	rt->dst.ops = &fake_dst_ops;
 }
 
+static unsigned int ip_sabotage_in(unsigned int hook, struct sk_buff *skb,
+				   const struct net_device *in,
+				   const struct net_device *out,
+				   int (*okfn)(struct sk_buff *));
+
+/* Is anything but our own sabotage hook registered at pf/hook? */
+static bool br_nf_hook_used(u_int8_t pf, unsigned int hook)
+{
+	const struct nf_hook_ops *elem;
+
+	list_for_each_entry_rcu(elem, &nf_hooks[pf][hook], list) {
+		if (elem->hook != ip_sabotage_in)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Bridged frames are handed to the IP (or ARP) hooks only so that
+ * rules there can see them. When nothing is registered at any of the
+ * hooks the detour would pass through, neither filtering nor conntrack
+ * can act on the frame and it is cheaper to leave it to the bridge.
+ * Called with rcu_read_lock.
+ */
+static bool br_nf_bypass(struct net_bridge *br, u_int8_t pf)
+{
+	struct br_cpu_netstats *brstats;
+
+	if (!br->nf_bypass)
+		return false;
+
+	if (pf == NFPROTO_ARP) {
+		if (br_nf_hook_used(pf, NF_ARP_FORWARD))
+			return false;
+	} else if (br_nf_hook_used(pf, NF_INET_PRE_ROUTING) ||
+		   br_nf_hook_used(pf, NF_INET_FORWARD) ||
+		   br_nf_hook_used(pf, NF_INET_POST_ROUTING)) {
+		return false;
+	}
+
+	brstats = this_cpu_ptr(br->stats);
+	u64_stats_update_begin(&brstats->syncp);
+	brstats->nf_bypassed++;
+	u64_stats_update_end(&brstats->syncp);
+	return true;
+}
+
+u64 br_nf_bypassed(const struct net_bridge *br)
+{
+	u64 sum = 0;
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		const struct br_cpu_netstats *bstats
+			= per_cpu_ptr(br->stats, cpu);
+		unsigned int start;
+		u64 n;
+
+		do {
+			start = u64_stats_fetch_begin_bh(&bstats->syncp);
+			n = bstats->nf_bypassed;
+		} while (u64_stats_fetch_retry_bh(&bstats->syncp, start));
+		sum += n;
+	}
+
+	return sum;
+}
+
 static inline struct rtable *bridge_parent_rtable(const struct net_device *dev)
 {
 	struct net_bridge_port *port;
@@ -688,6 +756,8 @@ static unsigned int br_nf_pre_routing(unsigned int hook, struct sk_buff *skb,
 	if (IS_IPV6(skb) || IS_VLAN_IPV6(skb) || IS_PPPOE_IPV6(skb)) {
 		if (!brnf_call_ip6tables && !br->nf_call_ip6tables)
 			return NF_ACCEPT;
+		if (br_nf_bypass(br, NFPROTO_IPV6))
+			return NF_ACCEPT;
 
 		nf_bridge_pull_encap_header_rcsum(skb);
 		return br_nf_pre_routing_ipv6(hook, skb, in, out, okfn);
@@ -699,6 +769,9 @@ static unsigned int br_nf_pre_routing(unsigned int hook, struct sk_buff *skb,
 	if (!IS_IP(skb) && !IS_VLAN_IP(skb) && !IS_PPPOE_IP(skb))
 		return NF_ACCEPT;
 
+	if (br_nf_bypass(br, NFPROTO_IPV4))
+		return NF_ACCEPT;
+
 	nf_bridge_pull_encap_header_rcsum(skb);
 
 	if (br_parse_ip_options(skb))
@@ -834,11 +907,14 @@ static unsigned int br_nf_forward_arp(unsigned int hook, struct sk_buff *skb,
 	if (!brnf_call_arptables && !br->nf_call_arptables)
 		return NF_ACCEPT;
 
-	if (!IS_ARP(skb)) {
-		if (!IS_VLAN_ARP(skb))
-			return NF_ACCEPT;
+	if (!IS_ARP(skb) && !IS_VLAN_ARP(skb))
+		return NF_ACCEPT;
+
+	if (br_nf_bypass(br, NFPROTO_ARP))
+		return NF_ACCEPT;
+
+	if (!IS_ARP(skb))
 		nf_bridge_pull_encap_header(skb);
-	}
 
 	if (arp_hdr(skb)->ar_pln != 4) {
 		if (IS_VLAN_ARP(skb))
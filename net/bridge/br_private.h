@@ -17,6 +17,7 @@
 #include <linux/if_bridge.h>
 #include <linux/netpoll.h>
 #include <linux/u64_stats_sync.h>
+#include <linux/if_vlan.h>
 #include <net/route.h>
 
 #define BR_HASH_BITS 8
@@ -29,6 +30,8 @@
 
 #define BR_VERSION	"2.3"
 
+#define BR_VLAN_BITMAP_LEN	BITS_TO_LONGS(VLAN_N_VID)
+
 /* Control of forwarding link local multicast */
 #define BR_GROUPFWD_DEFAULT	0
 /* Don't allow forwarding control protocols like STP and LLDP */
@@ -65,13 +68,14 @@ struct br_ip
 
 struct net_bridge_fdb_entry
 {
-	struct hlist_node		hlist;
+	struct hlist_node		hlist[2];
 	struct net_bridge_port		*dst;
 
 	struct rcu_head			rcu;
 	unsigned long			updated;
 	unsigned long			used;
 	mac_addr			addr;
+	u16				vlan_id;
 	unsigned char			is_local;
 	unsigned char			is_static;
 };
@@ -108,6 +112,24 @@ struct net_bridge_mdb_htable
 	u32				ver;
 };
 
+struct net_bridge_fdb_htable
+{
+	struct hlist_head		*hash;
+	u32				size;
+	u32				max;
+	u32				ver;
+};
+
+/* VLAN membership of a port, or of the bridge device itself */
+struct net_port_vlans
+{
+	u16				pvid;
+	u16				num_vlans;
+	struct rcu_head			rcu;
+	unsigned long			vlan_bitmap[BR_VLAN_BITMAP_LEN];
+	unsigned long			untagged_bitmap[BR_VLAN_BITMAP_LEN];
+};
+
 struct net_bridge_port
 {
 	struct net_bridge		*br;
@@ -156,6 +178,9 @@ struct net_bridge_port
 #ifdef CONFIG_NET_POLL_CONTROLLER
 	struct netpoll			*np;
 #endif
+#ifdef CONFIG_BRIDGE_VLAN_FILTERING
+	struct net_port_vlans __rcu	*vlan_info;
+#endif
 };
 
 #define br_port_exists(dev) (dev->priv_flags & IFF_BRIDGE_PORT)
@@ -179,6 +204,9 @@ struct br_cpu_netstats {
 	u64			rx_bytes;
 	u64			tx_packets;
 	u64			tx_bytes;
+#ifdef CONFIG_BRIDGE_NETFILTER
+	u64			nf_bypassed;
+#endif
 	struct u64_stats_sync	syncp;
 };
 
@@ -190,12 +218,19 @@ struct net_bridge
 
 	struct br_cpu_netstats __percpu *stats;
 	spinlock_t			hash_lock;
-	struct hlist_head		hash[BR_HASH_SIZE];
+	struct net_bridge_fdb_htable __rcu *fdb_hash;
+	struct work_struct		fdb_rehash_work;
+	/* table being filled by br_fdb_rehash(), not yet published */
+	struct net_bridge_fdb_htable	*fdb_rehash_tbl;
+	u32				fdb_rehash_pos;
+	u32				fdb_gc_pos;
+	unsigned long			fdb_gc_next;
 #ifdef CONFIG_BRIDGE_NETFILTER
 	struct rtable 			fake_rtable;
 	bool				nf_call_iptables;
 	bool				nf_call_ip6tables;
 	bool				nf_call_arptables;
+	bool				nf_bypass;
 #endif
 	unsigned long			flags;
 #define BR_SET_MAC_ADDR		0x00000001
@@ -260,6 +295,10 @@ struct net_bridge
 	struct timer_list		topology_change_timer;
 	struct timer_list		gc_timer;
 	struct kobject			*ifobj;
+#ifdef CONFIG_BRIDGE_VLAN_FILTERING
+	u8				vlan_enabled;
+	struct net_port_vlans __rcu	*vlan_info;
+#endif
 };
 
 struct br_input_skb_cb {
@@ -347,6 +386,8 @@ static inline void br_netpoll_disable(struct net_bridge_port *p)
 /* br_fdb.c */
 extern int br_fdb_init(void);
 extern void br_fdb_fini(void);
+extern int br_fdb_hash_init(struct net_bridge *br);
+extern void br_fdb_hash_fini(struct net_bridge *br);
 extern void br_fdb_flush(struct net_bridge *br);
 extern void br_fdb_changeaddr(struct net_bridge_port *p,
 			      const unsigned char *newaddr);
@@ -355,7 +396,8 @@ extern void br_fdb_cleanup(unsigned long arg);
 extern void br_fdb_delete_by_port(struct net_bridge *br,
 				  const struct net_bridge_port *p, int do_all);
 extern struct net_bridge_fdb_entry *__br_fdb_get(struct net_bridge *br,
-						 const unsigned char *addr);
+						 const unsigned char *addr,
+						 u16 vid);
 extern int br_fdb_test_addr(struct net_device *dev, unsigned char *addr);
 extern int br_fdb_fillbuf(struct net_bridge *br, void *buf,
 			  unsigned long count, unsigned long off);
@@ -364,7 +406,7 @@ extern int br_fdb_insert(struct net_bridge *br,
 			 const unsigned char *addr);
 extern void br_fdb_update(struct net_bridge *br,
 			  struct net_bridge_port *source,
-			  const unsigned char *addr);
+			  const unsigned char *addr, u16 vid);
 
 extern int br_fdb_delete(struct ndmsg *ndm,
 			 struct net_device *dev,
@@ -534,11 +576,98 @@ static inline void br_mdb_uninit(void)
 }
 #endif
 
+/* br_vlan.c */
+#ifdef CONFIG_BRIDGE_VLAN_FILTERING
+extern bool br_allowed_ingress(struct net_bridge *br,
+			       struct net_port_vlans *v,
+			       struct sk_buff *skb, u16 *vid);
+extern bool br_allowed_egress(struct net_bridge *br,
+			      const struct net_port_vlans *v,
+			      const struct sk_buff *skb);
+extern void br_handle_vlan(struct net_bridge *br,
+			   const struct net_port_vlans *v,
+			   struct sk_buff *skb);
+extern bool br_vlan_get_vid(struct net_bridge *br,
+			    const struct net_port_vlans *v,
+			    const struct sk_buff *skb, u16 *vid);
+extern int br_vlan_filter_toggle(struct net_bridge *br, unsigned long val);
+extern int br_vlan_add(struct net_port_vlans __rcu **vp, u16 vid,
+		       bool untagged);
+extern int br_vlan_delete(struct net_port_vlans __rcu **vp, u16 vid);
+extern int br_vlan_set_pvid(struct net_port_vlans __rcu **vp, u16 vid);
+extern void br_vlan_flush(struct net_bridge *br);
+extern void nbp_vlan_flush(struct net_bridge_port *p);
+extern ssize_t br_vlan_show(const struct net_port_vlans *v, bool untagged,
+			    char *buf);
+
+static inline struct net_port_vlans *br_get_vlan_info(
+						const struct net_bridge *br)
+{
+	return rcu_dereference_rtnl(br->vlan_info);
+}
+
+static inline struct net_port_vlans *nbp_get_vlan_info(
+						const struct net_bridge_port *p)
+{
+	return rcu_dereference_rtnl(p->vlan_info);
+}
+#else
+static inline bool br_allowed_ingress(struct net_bridge *br,
+				      struct net_port_vlans *v,
+				      struct sk_buff *skb, u16 *vid)
+{
+	*vid = 0;
+	return true;
+}
+
+static inline bool br_allowed_egress(struct net_bridge *br,
+				     const struct net_port_vlans *v,
+				     const struct sk_buff *skb)
+{
+	return true;
+}
+
+static inline void br_handle_vlan(struct net_bridge *br,
+				  const struct net_port_vlans *v,
+				  struct sk_buff *skb)
+{
+}
+
+static inline bool br_vlan_get_vid(struct net_bridge *br,
+				   const struct net_port_vlans *v,
+				   const struct sk_buff *skb, u16 *vid)
+{
+	*vid = 0;
+	return true;
+}
+
+static inline struct net_port_vlans *br_get_vlan_info(
+						const struct net_bridge *br)
+{
+	return NULL;
+}
+
+static inline void br_vlan_flush(struct net_bridge *br)
+{
+}
+
+static inline void nbp_vlan_flush(struct net_bridge_port *p)
+{
+}
+
+static inline struct net_port_vlans *nbp_get_vlan_info(
+						const struct net_bridge_port *p)
+{
+	return NULL;
+}
+#endif
+
 /* br_netfilter.c */
 #ifdef CONFIG_BRIDGE_NETFILTER
 extern int br_netfilter_init(void);
 extern void br_netfilter_fini(void);
 extern void br_netfilter_rtable_init(struct net_bridge *);
+extern u64 br_nf_bypassed(const struct net_bridge *br);
 #else
 #define br_netfilter_init()	(0)
 #define br_netfilter_fini()	do { } while(0)
@@ -690,6 +690,158 @@ static ssize_t store_nf_call_arptables(
 }
 static DEVICE_ATTR(nf_call_arptables, S_IRUGO | S_IWUSR,
 		   show_nf_call_arptables, store_nf_call_arptables);
+
+static ssize_t show_nf_bypass(
+	struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct net_bridge *br = to_bridge(d);
+	return sprintf(buf, "%u\n", br->nf_bypass);
+}
+
+static int set_nf_bypass(struct net_bridge *br, unsigned long val)
+{
+	br->nf_bypass = val ? true : false;
+	return 0;
+}
+
+static ssize_t store_nf_bypass(
+	struct device *d, struct device_attribute *attr, const char *buf,
+	size_t len)
+{
+	return store_bridge_parm(d, buf, len, set_nf_bypass);
+}
+static DEVICE_ATTR(nf_bypass, S_IRUGO | S_IWUSR,
+		   show_nf_bypass, store_nf_bypass);
+
+static ssize_t show_nf_bypassed(
+	struct device *d, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n",
+		       (unsigned long long)br_nf_bypassed(to_bridge(d)));
+}
+static DEVICE_ATTR(nf_bypassed, S_IRUGO, show_nf_bypassed, NULL);
+#endif
+
+#ifdef CONFIG_BRIDGE_VLAN_FILTERING
+/*
+ * VLAN membership of the bridge device itself, i.e. of the frames
+ * the host sends and receives through it.
+ */
+static ssize_t store_bridge_vlan(struct device *d,
+				 const char *buf, size_t len,
+				 int (*set)(struct net_port_vlans __rcu **, u16))
+{
+	struct net_bridge *br = to_bridge(d);
+	char *endp;
+	unsigned long val;
+	int err;
+
+	if (!ns_capable(dev_net(br->dev)->user_ns, CAP_NET_ADMIN))
+		return -EPERM;
+
+	val = simple_strtoul(buf, &endp, 0);
+	if (endp == buf || val >= VLAN_N_VID)
+		return -EINVAL;
+
+	if (!rtnl_trylock())
+		return restart_syscall();
+	err = (*set)(&br->vlan_info, val);
+	rtnl_unlock();
+
+	return err ? err : len;
+}
+
+static ssize_t show_vlan_filtering(struct device *d,
+				   struct device_attribute *attr, char *buf)
+{
+	struct net_bridge *br = to_bridge(d);
+	return sprintf(buf, "%d\n", br->vlan_enabled);
+}
+
+static ssize_t store_vlan_filtering(struct device *d,
+				    struct device_attribute *attr,
+				    const char *buf, size_t len)
+{
+	return store_bridge_parm(d, buf, len, br_vlan_filter_toggle);
+}
+static DEVICE_ATTR(vlan_filtering, S_IRUGO | S_IWUSR,
+		   show_vlan_filtering, store_vlan_filtering);
+
+static ssize_t show_vlans(struct device *d, struct device_attribute *attr,
+			  char *buf)
+{
+	ssize_t ret;
+
+	rcu_read_lock();
+	ret = br_vlan_show(br_get_vlan_info(to_bridge(d)), false, buf);
+	rcu_read_unlock();
+	return ret;
+}
+static DEVICE_ATTR(vlans, S_IRUGO, show_vlans, NULL);
+
+static ssize_t show_untagged_vlans(struct device *d,
+				   struct device_attribute *attr, char *buf)
+{
+	ssize_t ret;
+
+	rcu_read_lock();
+	ret = br_vlan_show(br_get_vlan_info(to_bridge(d)), true, buf);
+	rcu_read_unlock();
+	return ret;
+}
+static DEVICE_ATTR(untagged_vlans, S_IRUGO, show_untagged_vlans, NULL);
+
+static int set_vlan_add(struct net_port_vlans __rcu **vp, u16 vid)
+{
+	return br_vlan_add(vp, vid, false);
+}
+
+static ssize_t store_vlan_add(struct device *d, struct device_attribute *attr,
+			      const char *buf, size_t len)
+{
+	return store_bridge_vlan(d, buf, len, set_vlan_add);
+}
+static DEVICE_ATTR(vlan_add, S_IWUSR, NULL, store_vlan_add);
+
+static int set_vlan_add_untagged(struct net_port_vlans __rcu **vp, u16 vid)
+{
+	return br_vlan_add(vp, vid, true);
+}
+
+static ssize_t store_vlan_add_untagged(struct device *d,
+				       struct device_attribute *attr,
+				       const char *buf, size_t len)
+{
+	return store_bridge_vlan(d, buf, len, set_vlan_add_untagged);
+}
+static DEVICE_ATTR(vlan_add_untagged, S_IWUSR, NULL, store_vlan_add_untagged);
+
+static ssize_t store_vlan_del(struct device *d, struct device_attribute *attr,
+			      const char *buf, size_t len)
+{
+	return store_bridge_vlan(d, buf, len, br_vlan_delete);
+}
+static DEVICE_ATTR(vlan_del, S_IWUSR, NULL, store_vlan_del);
+
+static ssize_t show_pvid(struct device *d, struct device_attribute *attr,
+			 char *buf)
+{
+	struct net_port_vlans *v;
+	ssize_t ret;
+
+	rcu_read_lock();
+	v = br_get_vlan_info(to_bridge(d));
+	ret = sprintf(buf, "%u\n", v ? v->pvid : 0);
+	rcu_read_unlock();
+	return ret;
+}
+
+static ssize_t store_pvid(struct device *d, struct device_attribute *attr,
+			  const char *buf, size_t len)
+{
+	return store_bridge_vlan(d, buf, len, br_vlan_set_pvid);
+}
+static DEVICE_ATTR(pvid, S_IRUGO | S_IWUSR, show_pvid, store_pvid);
 #endif
 
 static struct attribute *bridge_attrs[] = {
@@ -731,6 +883,17 @@ static struct attribute *bridge_attrs[] = {
 	&dev_attr_nf_call_iptables.attr,
 	&dev_attr_nf_call_ip6tables.attr,
 	&dev_attr_nf_call_arptables.attr,
+	&dev_attr_nf_bypass.attr,
+	&dev_attr_nf_bypassed.attr,
+#endif
+#ifdef CONFIG_BRIDGE_VLAN_FILTERING
+	&dev_attr_vlan_filtering.attr,
+	&dev_attr_vlans.attr,
+	&dev_attr_untagged_vlans.attr,
+	&dev_attr_vlan_add.attr,
+	&dev_attr_vlan_add_untagged.attr,
+	&dev_attr_vlan_del.attr,
+	&dev_attr_pvid.attr,
 #endif
 	NULL
 };
@@ -176,6 +176,74 @@ static BRPORT_ATTR(multicast_router, S_IRUGO | S_IWUSR, show_multicast_router,
 BRPORT_ATTR_FLAG(multicast_fast_leave, BR_MULTICAST_FAST_LEAVE);
 #endif
 
+#ifdef CONFIG_BRIDGE_VLAN_FILTERING
+static ssize_t show_vlans(struct net_bridge_port *p, char *buf)
+{
+	ssize_t ret;
+
+	rcu_read_lock();
+	ret = br_vlan_show(nbp_get_vlan_info(p), false, buf);
+	rcu_read_unlock();
+	return ret;
+}
+static BRPORT_ATTR(vlans, S_IRUGO, show_vlans, NULL);
+
+static ssize_t show_untagged_vlans(struct net_bridge_port *p, char *buf)
+{
+	ssize_t ret;
+
+	rcu_read_lock();
+	ret = br_vlan_show(nbp_get_vlan_info(p), true, buf);
+	rcu_read_unlock();
+	return ret;
+}
+static BRPORT_ATTR(untagged_vlans, S_IRUGO, show_untagged_vlans, NULL);
+
+static int store_vlan_add(struct net_bridge_port *p, unsigned long v)
+{
+	if (v >= VLAN_N_VID)
+		return -EINVAL;
+	return br_vlan_add(&p->vlan_info, v, false);
+}
+static BRPORT_ATTR(vlan_add, S_IWUSR, NULL, store_vlan_add);
+
+static int store_vlan_add_untagged(struct net_bridge_port *p, unsigned long v)
+{
+	if (v >= VLAN_N_VID)
+		return -EINVAL;
+	return br_vlan_add(&p->vlan_info, v, true);
+}
+static BRPORT_ATTR(vlan_add_untagged, S_IWUSR, NULL, store_vlan_add_untagged);
+
+static int store_vlan_del(struct net_bridge_port *p, unsigned long v)
+{
+	if (v >= VLAN_N_VID)
+		return -EINVAL;
+	return br_vlan_delete(&p->vlan_info, v);
+}
+static BRPORT_ATTR(vlan_del, S_IWUSR, NULL, store_vlan_del);
+
+static ssize_t show_pvid(struct net_bridge_port *p, char *buf)
+{
+	struct net_port_vlans *v;
+	ssize_t ret;
+
+	rcu_read_lock();
+	v = nbp_get_vlan_info(p);
+	ret = sprintf(buf, "%u\n", v ? v->pvid : 0);
+	rcu_read_unlock();
+	return ret;
+}
+
+static int store_pvid(struct net_bridge_port *p, unsigned long v)
+{
+	if (v >= VLAN_N_VID)
+		return -EINVAL;
+	return br_vlan_set_pvid(&p->vlan_info, v);
+}
+static BRPORT_ATTR(pvid, S_IRUGO | S_IWUSR, show_pvid, store_pvid);
+#endif
+
 static const struct brport_attribute *brport_attrs[] = {
 	&brport_attr_path_cost,
 	&brport_attr_priority,
@@ -198,6 +266,14 @@ static const struct brport_attribute *brport_attrs[] = {
 #ifdef CONFIG_BRIDGE_IGMP_SNOOPING
 	&brport_attr_multicast_router,
 	&brport_attr_multicast_fast_leave,
+#endif
+#ifdef CONFIG_BRIDGE_VLAN_FILTERING
+	&brport_attr_vlans,
+	&brport_attr_untagged_vlans,
+	&brport_attr_vlan_add,
+	&brport_attr_vlan_add_untagged,
+	&brport_attr_vlan_del,
+	&brport_attr_pvid,
 #endif
 	NULL
 };
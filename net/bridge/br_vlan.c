@@ -0,0 +1,237 @@
+/*
+ *	VLAN filtering
+ *	Linux ethernet bridge
+ *
+ *	Every port, and the bridge device itself, may carry a bitmap of
+ *	the VLANs it is a member of, a second bitmap of the VLANs it
+ *	sends untagged, and a PVID that untagged frames are classified
+ *	into. Inside the bridge a frame always carries its VLAN in
+ *	skb->vlan_tci, so the per-frame cost is one bit test on ingress
+ *	and one on egress.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <linux/kernel.h>
+#include <linux/netdevice.h>
+#include <linux/rtnetlink.h>
+#include <linux/slab.h>
+#include "br_private.h"
+
+/* Called with rcu_read_lock; tags untagged frames with the PVID */
+bool br_allowed_ingress(struct net_bridge *br, struct net_port_vlans *v,
+			struct sk_buff *skb, u16 *vid)
+{
+	u16 pvid;
+
+	/* with filtering off all frames share a single VLAN-less table */
+	if (!br->vlan_enabled) {
+		*vid = 0;
+		return true;
+	}
+
+	/* a port without any VLANs admits nothing */
+	if (!v)
+		return false;
+
+	*vid = vlan_tx_tag_get(skb) & VLAN_VID_MASK;
+	if (vlan_tx_tag_present(skb) && *vid)
+		return test_bit(*vid, v->vlan_bitmap);
+
+	/* untagged and priority-tagged frames belong to the PVID */
+	pvid = ACCESS_ONCE(v->pvid);
+	if (!pvid)
+		return false;
+
+	__vlan_hwaccel_put_tag(skb, (vlan_tx_tag_get(skb) & VLAN_PRIO_MASK) |
+				    pvid);
+	*vid = pvid;
+	return true;
+}
+
+/* Called with rcu_read_lock */
+bool br_allowed_egress(struct net_bridge *br, const struct net_port_vlans *v,
+		       const struct sk_buff *skb)
+{
+	if (!br->vlan_enabled)
+		return true;
+
+	if (!v)
+		return false;
+
+	return test_bit(vlan_tx_tag_get(skb) & VLAN_VID_MASK, v->vlan_bitmap);
+}
+
+/* Called with rcu_read_lock; strips the tag on untagged egress */
+void br_handle_vlan(struct net_bridge *br, const struct net_port_vlans *v,
+		    struct sk_buff *skb)
+{
+	if (!br->vlan_enabled || !v)
+		return;
+
+	if (test_bit(vlan_tx_tag_get(skb) & VLAN_VID_MASK, v->untagged_bitmap))
+		skb->vlan_tci = 0;
+}
+
+/*
+ * VLAN a frame would be classified into, without touching the frame.
+ * Used for frames the bridge learns from but hands back to the port's
+ * own stack. Returns false if the port would not admit it.
+ */
+bool br_vlan_get_vid(struct net_bridge *br, const struct net_port_vlans *v,
+		     const struct sk_buff *skb, u16 *vid)
+{
+	if (!br->vlan_enabled) {
+		*vid = 0;
+		return true;
+	}
+
+	if (!v)
+		return false;
+
+	*vid = vlan_tx_tag_get(skb) & VLAN_VID_MASK;
+	if (vlan_tx_tag_present(skb) && *vid)
+		return test_bit(*vid, v->vlan_bitmap);
+
+	*vid = ACCESS_ONCE(v->pvid);
+	return *vid != 0;
+}
+
+int br_vlan_filter_toggle(struct net_bridge *br, unsigned long val)
+{
+	if (!rtnl_trylock())
+		return restart_syscall();
+
+	if (br->vlan_enabled != !!val) {
+		br->vlan_enabled = !!val;
+		/* learned entries are keyed differently in the two modes */
+		br_fdb_flush(br);
+	}
+
+	rtnl_unlock();
+	return 0;
+}
+
+/*
+ * The helpers below run under RTNL. The bitmaps are updated in place
+ * with atomic bitops, so the data path never needs more than RCU.
+ */
+int br_vlan_add(struct net_port_vlans __rcu **vp, u16 vid, bool untagged)
+{
+	struct net_port_vlans *v = rtnl_dereference(*vp);
+
+	if (!vid || vid >= VLAN_VID_MASK)
+		return -EINVAL;
+
+	if (!v) {
+		/* port attributes are stored under the bridge lock */
+		v = kzalloc(sizeof(*v), GFP_ATOMIC);
+		if (!v)
+			return -ENOMEM;
+		rcu_assign_pointer(*vp, v);
+	}
+
+	if (untagged)
+		set_bit(vid, v->untagged_bitmap);
+	else
+		clear_bit(vid, v->untagged_bitmap);
+
+	if (!test_and_set_bit(vid, v->vlan_bitmap))
+		v->num_vlans++;
+
+	return 0;
+}
+
+static void vlan_flush(struct net_port_vlans __rcu **vp)
+{
+	struct net_port_vlans *v = rtnl_dereference(*vp);
+
+	if (!v)
+		return;
+
+	RCU_INIT_POINTER(*vp, NULL);
+	kfree_rcu(v, rcu);
+}
+
+int br_vlan_delete(struct net_port_vlans __rcu **vp, u16 vid)
+{
+	struct net_port_vlans *v = rtnl_dereference(*vp);
+
+	if (!vid || vid >= VLAN_VID_MASK)
+		return -EINVAL;
+
+	if (!v || !test_bit(vid, v->vlan_bitmap))
+		return -ENOENT;
+
+	if (v->pvid == vid)
+		ACCESS_ONCE(v->pvid) = 0;
+
+	clear_bit(vid, v->vlan_bitmap);
+	clear_bit(vid, v->untagged_bitmap);
+
+	if (--v->num_vlans == 0)
+		vlan_flush(vp);
+
+	return 0;
+}
+
+/* A PVID that is not yet a member is added as an untagged VLAN */
+int br_vlan_set_pvid(struct net_port_vlans __rcu **vp, u16 vid)
+{
+	struct net_port_vlans *v = rtnl_dereference(*vp);
+	int err;
+
+	if (!vid) {
+		if (v)
+			ACCESS_ONCE(v->pvid) = 0;
+		return 0;
+	}
+
+	if (!v || !test_bit(vid, v->vlan_bitmap)) {
+		err = br_vlan_add(vp, vid, true);
+		if (err)
+			return err;
+		v = rtnl_dereference(*vp);
+	}
+
+	ACCESS_ONCE(v->pvid) = vid;
+	return 0;
+}
+
+void br_vlan_flush(struct net_bridge *br)
+{
+	vlan_flush(&br->vlan_info);
+}
+
+void nbp_vlan_flush(struct net_bridge_port *p)
+{
+	vlan_flush(&p->vlan_info);
+}
+
+/* Print a bitmap as a list of ranges, e.g. "1,10-20" */
+ssize_t br_vlan_show(const struct net_port_vlans *v, bool untagged, char *buf)
+{
+	const unsigned long *map;
+	unsigned int vid, end;
+	ssize_t len = 0;
+
+	if (v) {
+		map = untagged ? v->untagged_bitmap : v->vlan_bitmap;
+		vid = find_first_bit(map, VLAN_N_VID);
+		while (vid < VLAN_N_VID) {
+			end = find_next_zero_bit(map, VLAN_N_VID, vid);
+			len += scnprintf(buf + len, PAGE_SIZE - len, "%s%u",
+					 len ? "," : "", vid);
+			if (end - 1 > vid)
+				len += scnprintf(buf + len, PAGE_SIZE - len,
+						 "-%u", end - 1);
+			vid = find_next_bit(map, VLAN_N_VID, end);
+		}
+	}
+
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	return len;
+}
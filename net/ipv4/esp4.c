@@ -25,6 +25,10 @@ struct esp_skb_cb {
 
 #define ESP_SKB_CB(__skb) ((struct esp_skb_cb *)&((__skb)->cb[0]))
 
+static bool esp_pcrypt __read_mostly;
+module_param_named(pcrypt, esp_pcrypt, bool, 0644);
+MODULE_PARM_DESC(pcrypt, "Spread the crypto of each new SA over all CPUs");
+
 static u32 esp4_get_mtu(struct xfrm_state *x, int mtu);
 
 /*
@@ -517,13 +521,36 @@ static void esp_destroy(struct xfrm_state *x)
 	kfree(esp);
 }
 
+/*
+ * With pcrypt, requests of one SA are processed on all CPUs through
+ * padata, which hands the completions back in submission order.  The
+ * ESP sequence numbers are assigned before esp_output(), so packets
+ * leave in sequence.  Falls back to the plain algorithm if pcrypt is
+ * not available.
+ */
+static struct crypto_aead *esp_alloc_aead(const char *name)
+{
+	char pcrypt_name[CRYPTO_MAX_ALG_NAME];
+	struct crypto_aead *aead;
+
+	if (esp_pcrypt &&
+	    snprintf(pcrypt_name, CRYPTO_MAX_ALG_NAME, "pcrypt(%s)",
+		     name) < CRYPTO_MAX_ALG_NAME) {
+		aead = crypto_alloc_aead(pcrypt_name, 0, 0);
+		if (!IS_ERR(aead))
+			return aead;
+	}
+
+	return crypto_alloc_aead(name, 0, 0);
+}
+
 static int esp_init_aead(struct xfrm_state *x)
 {
 	struct esp_data *esp = x->data;
 	struct crypto_aead *aead;
 	int err;
 
-	aead = crypto_alloc_aead(x->aead->alg_name, 0, 0);
+	aead = esp_alloc_aead(x->aead->alg_name);
 	err = PTR_ERR(aead);
 	if (IS_ERR(aead))
 		goto error;
@@ -575,7 +602,7 @@ static int esp_init_authenc(struct xfrm_state *x)
 			goto error;
 	}
 
-	aead = crypto_alloc_aead(authenc_name, 0, 0);
+	aead = esp_alloc_aead(authenc_name);
 	err = PTR_ERR(aead);
 	if (IS_ERR(aead))
 		goto error;
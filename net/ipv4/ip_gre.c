@@ -48,6 +48,8 @@
 #include <net/rtnetlink.h>
 #include <net/gre.h>
 
+#include "ip_tunnel_hash.h"
+
 #if IS_ENABLED(CONFIG_IPV6)
 #include <net/ipv6.h>
 #include <net/ip6_fib.h>
@@ -131,11 +133,9 @@ static int ipgre_tunnel_bind_dev(struct net_device *dev);
 
 /* Fallback tunnel: no source, no destination, no key, no options */
 
-#define HASH_SIZE  16
-
 static int ipgre_net_id __read_mostly;
 struct ipgre_net {
-	struct ip_tunnel __rcu *tunnels[4][HASH_SIZE];
+	struct ip_tunnel_hash tunnels[4];
 
 	struct net_device *fb_tunnel_dev;
 };
@@ -156,15 +156,27 @@ struct ipgre_net {
 
    All keysless packets, if not matched configured keyless tunnels
    will match fallback tunnel.
- */
 
-#define HASH(addr) (((__force u32)addr^((__force u32)addr>>4))&0xF)
+   Each table hashes the key plus the addresses it matches exactly.
+   Table 1 leaves the local address out: a tunnel with a multicast
+   remote there also matches packets sent to that group.
+ */
 
 #define tunnels_r_l	tunnels[3]
 #define tunnels_r	tunnels[2]
 #define tunnels_l	tunnels[1]
 #define tunnels_wc	tunnels[0]
 
+static u32 ipgre_hash(struct ipgre_net *ign, int prio,
+		      __be32 remote, __be32 local, __be32 key)
+{
+	if (!(prio & 2))
+		remote = 0;
+	if (prio != 3)
+		local = 0;
+	return ip_tunnel_hash_fn(&ign->tunnels[prio], remote, local, key);
+}
+
 static struct rtnl_link_stats64 *ipgre_get_stats64(struct net_device *dev,
 						   struct rtnl_link_stats64 *tot)
 {
@@ -227,15 +239,20 @@ static struct ip_tunnel *ipgre_tunnel_lookup(struct net_device *dev,
 {
 	struct net *net = dev_net(dev);
 	int link = dev->ifindex;
-	unsigned int h0 = HASH(remote);
-	unsigned int h1 = HASH(key);
 	struct ip_tunnel *t, *cand = NULL;
 	struct ipgre_net *ign = net_generic(net, ipgre_net_id);
 	int dev_type = (gre_proto == htons(ETH_P_TEB)) ?
 		       ARPHRD_ETHER : ARPHRD_IPGRE;
 	int score, cand_score = 4;
-
-	for_each_ip_tunnel_rcu(t, ign->tunnels_r_l[h0 ^ h1]) {
+	struct ip_tunnel_htable *tbl;
+	struct ip_tunnel_hashed *ht;
+	struct hlist_node *pos;
+	u32 hash;
+
+	tbl = rcu_dereference(ign->tunnels_r_l.tbl);
+	hash = ipgre_hash(ign, 3, remote, local, key);
+	for_each_ip_tunnel_hashed_rcu(ht, pos, tbl, hash) {
+		t = &ht->t;
 		if (local != t->parms.iph.saddr ||
 		    remote != t->parms.iph.daddr ||
 		    !(t->dev->flags & IFF_UP))
@@ -262,7 +279,10 @@ static struct ip_tunnel *ipgre_tunnel_lookup(struct net_device *dev,
 		}
 	}
 
-	for_each_ip_tunnel_rcu(t, ign->tunnels_r[h0 ^ h1]) {
+	tbl = rcu_dereference(ign->tunnels_r.tbl);
+	hash = ipgre_hash(ign, 2, remote, local, key);
+	for_each_ip_tunnel_hashed_rcu(ht, pos, tbl, hash) {
+		t = &ht->t;
 		if (remote != t->parms.iph.daddr ||
 		    !(t->dev->flags & IFF_UP))
 			continue;
@@ -288,7 +308,10 @@ static struct ip_tunnel *ipgre_tunnel_lookup(struct net_device *dev,
 		}
 	}
 
-	for_each_ip_tunnel_rcu(t, ign->tunnels_l[h1]) {
+	tbl = rcu_dereference(ign->tunnels_l.tbl);
+	hash = ipgre_hash(ign, 1, remote, local, key);
+	for_each_ip_tunnel_hashed_rcu(ht, pos, tbl, hash) {
+		t = &ht->t;
 		if ((local != t->parms.iph.saddr &&
 		     (local != t->parms.iph.daddr ||
 		      !ipv4_is_multicast(local))) ||
@@ -316,7 +339,10 @@ static struct ip_tunnel *ipgre_tunnel_lookup(struct net_device *dev,
 		}
 	}
 
-	for_each_ip_tunnel_rcu(t, ign->tunnels_wc[h1]) {
+	tbl = rcu_dereference(ign->tunnels_wc.tbl);
+	hash = ipgre_hash(ign, 0, remote, local, key);
+	for_each_ip_tunnel_hashed_rcu(ht, pos, tbl, hash) {
+		t = &ht->t;
 		if (t->parms.i_key != key ||
 		    !(t->dev->flags & IFF_UP))
 			continue;
@@ -349,52 +375,31 @@ static struct ip_tunnel *ipgre_tunnel_lookup(struct net_device *dev,
 	return NULL;
 }
 
-static struct ip_tunnel __rcu **__ipgre_bucket(struct ipgre_net *ign,
-		struct ip_tunnel_parm *parms)
+static int ipgre_prio(const struct ip_tunnel_parm *parms)
 {
 	__be32 remote = parms->iph.daddr;
-	__be32 local = parms->iph.saddr;
-	__be32 key = parms->i_key;
-	unsigned int h = HASH(key);
 	int prio = 0;
 
-	if (local)
+	if (parms->iph.saddr)
 		prio |= 1;
-	if (remote && !ipv4_is_multicast(remote)) {
+	if (remote && !ipv4_is_multicast(remote))
 		prio |= 2;
-		h ^= HASH(remote);
-	}
 
-	return &ign->tunnels[prio][h];
-}
-
-static inline struct ip_tunnel __rcu **ipgre_bucket(struct ipgre_net *ign,
-		struct ip_tunnel *t)
-{
-	return __ipgre_bucket(ign, &t->parms);
+	return prio;
 }
 
 static void ipgre_tunnel_link(struct ipgre_net *ign, struct ip_tunnel *t)
 {
-	struct ip_tunnel __rcu **tp = ipgre_bucket(ign, t);
+	int prio = ipgre_prio(&t->parms);
 
-	rcu_assign_pointer(t->next, rtnl_dereference(*tp));
-	rcu_assign_pointer(*tp, t);
+	ip_tunnel_hash_link(&ign->tunnels[prio], t,
+			    ipgre_hash(ign, prio, t->parms.iph.daddr,
+				       t->parms.iph.saddr, t->parms.i_key));
 }
 
 static void ipgre_tunnel_unlink(struct ipgre_net *ign, struct ip_tunnel *t)
 {
-	struct ip_tunnel __rcu **tp;
-	struct ip_tunnel *iter;
-
-	for (tp = ipgre_bucket(ign, t);
-	     (iter = rtnl_dereference(*tp)) != NULL;
-	     tp = &iter->next) {
-		if (t == iter) {
-			rcu_assign_pointer(*tp, t->next);
-			break;
-		}
-	}
+	ip_tunnel_hash_unlink(&ign->tunnels[ipgre_prio(&t->parms)], t);
 }
 
 static struct ip_tunnel *ipgre_tunnel_find(struct net *net,
@@ -406,20 +411,24 @@ static struct ip_tunnel *ipgre_tunnel_find(struct net *net,
 	__be32 key = parms->i_key;
 	int link = parms->link;
 	struct ip_tunnel *t;
-	struct ip_tunnel __rcu **tp;
 	struct ipgre_net *ign = net_generic(net, ipgre_net_id);
-
-	for (tp = __ipgre_bucket(ign, parms);
-	     (t = rtnl_dereference(*tp)) != NULL;
-	     tp = &t->next)
+	int prio = ipgre_prio(parms);
+	struct ip_tunnel_htable *tbl = rtnl_dereference(ign->tunnels[prio].tbl);
+	struct ip_tunnel_hashed *ht;
+	struct hlist_node *pos;
+	u32 hash = ipgre_hash(ign, prio, remote, local, key);
+
+	for_each_ip_tunnel_hashed(ht, pos, tbl, hash) {
+		t = &ht->t;
 		if (local == t->parms.iph.saddr &&
 		    remote == t->parms.iph.daddr &&
 		    key == t->parms.i_key &&
 		    link == t->parms.link &&
 		    type == t->dev->type)
-			break;
+			return t;
+	}
 
-	return t;
+	return NULL;
 }
 
 static struct ip_tunnel *ipgre_tunnel_locate(struct net *net,
@@ -439,7 +448,8 @@ static struct ip_tunnel *ipgre_tunnel_locate(struct net *net,
 	else
 		strcpy(name, "gre%d");
 
-	dev = alloc_netdev(sizeof(*t), name, ipgre_tunnel_setup);
+	dev = alloc_netdev(sizeof(struct ip_tunnel_hashed), name,
+			   ipgre_tunnel_setup);
 	if (!dev)
 		return NULL;
 
@@ -1403,28 +1413,24 @@ static void ipgre_destroy_tunnels(struct ipgre_net *ign, struct list_head *head)
 {
 	int prio;
 
-	for (prio = 0; prio < 4; prio++) {
-		int h;
-		for (h = 0; h < HASH_SIZE; h++) {
-			struct ip_tunnel *t;
-
-			t = rtnl_dereference(ign->tunnels[prio][h]);
-
-			while (t != NULL) {
-				unregister_netdevice_queue(t->dev, head);
-				t = rtnl_dereference(t->next);
-			}
-		}
-	}
+	for (prio = 0; prio < 4; prio++)
+		ip_tunnel_hash_flush(&ign->tunnels[prio], head);
 }
 
 static int __net_init ipgre_init_net(struct net *net)
 {
 	struct ipgre_net *ign = net_generic(net, ipgre_net_id);
+	int prio;
 	int err;
 
-	ign->fb_tunnel_dev = alloc_netdev(sizeof(struct ip_tunnel), "gre0",
-					   ipgre_tunnel_setup);
+	for (prio = 0; prio < 4; prio++) {
+		err = ip_tunnel_hash_init(&ign->tunnels[prio]);
+		if (err)
+			goto err_hash;
+	}
+
+	ign->fb_tunnel_dev = alloc_netdev(sizeof(struct ip_tunnel_hashed),
+					   "gre0", ipgre_tunnel_setup);
 	if (!ign->fb_tunnel_dev) {
 		err = -ENOMEM;
 		goto err_alloc_dev;
@@ -1437,13 +1443,17 @@ static int __net_init ipgre_init_net(struct net *net)
 	if ((err = register_netdev(ign->fb_tunnel_dev)))
 		goto err_reg_dev;
 
-	rcu_assign_pointer(ign->tunnels_wc[0],
-			   netdev_priv(ign->fb_tunnel_dev));
+	rtnl_lock();
+	ipgre_tunnel_link(ign, netdev_priv(ign->fb_tunnel_dev));
+	rtnl_unlock();
 	return 0;
 
 err_reg_dev:
 	ipgre_dev_free(ign->fb_tunnel_dev);
 err_alloc_dev:
+err_hash:
+	while (prio--)
+		ip_tunnel_hash_destroy(&ign->tunnels[prio]);
 	return err;
 }
 
@@ -1451,12 +1461,16 @@ static void __net_exit ipgre_exit_net(struct net *net)
 {
 	struct ipgre_net *ign;
 	LIST_HEAD(list);
+	int prio;
 
 	ign = net_generic(net, ipgre_net_id);
 	rtnl_lock();
 	ipgre_destroy_tunnels(ign, &list);
 	unregister_netdevice_many(&list);
 	rtnl_unlock();
+
+	for (prio = 0; prio < 4; prio++)
+		ip_tunnel_hash_destroy(&ign->tunnels[prio]);
 }
 
 static struct pernet_operations ipgre_net_ops = {
@@ -1756,7 +1770,7 @@ static struct rtnl_link_ops ipgre_link_ops __read_mostly = {
 	.kind		= "gre",
 	.maxtype	= IFLA_GRE_MAX,
 	.policy		= ipgre_policy,
-	.priv_size	= sizeof(struct ip_tunnel),
+	.priv_size	= sizeof(struct ip_tunnel_hashed),
 	.setup		= ipgre_tunnel_setup,
 	.validate	= ipgre_tunnel_validate,
 	.newlink	= ipgre_newlink,
@@ -1769,7 +1783,7 @@ static struct rtnl_link_ops ipgre_tap_ops __read_mostly = {
 	.kind		= "gretap",
 	.maxtype	= IFLA_GRE_MAX,
 	.policy		= ipgre_policy,
-	.priv_size	= sizeof(struct ip_tunnel),
+	.priv_size	= sizeof(struct ip_tunnel_hashed),
 	.setup		= ipgre_tap_setup,
 	.validate	= ipgre_tap_validate,
 	.newlink	= ipgre_newlink,
@@ -0,0 +1,163 @@
+/*
+ *	Resizable RCU hash of IPv4 tunnels, shared by ipip and ip_gre.
+ *
+ *	The drivers used to keep 16 buckets per lookup class, which made
+ *	the receive path a linear scan once there were thousands of
+ *	tunnels.  The table here doubles when it holds more tunnels than
+ *	buckets and halves when it is a quarter full.  Resizing happens
+ *	under RTNL and waits for a grace period, so that the old set of
+ *	hash nodes is free again before the next resize.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/netdevice.h>
+#include <linux/random.h>
+#include <linux/rtnetlink.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "ip_tunnel_hash.h"
+
+#define IP_TUNNEL_HASH_MIN	16
+#define IP_TUNNEL_HASH_MAX	(1 << 16)
+
+static struct ip_tunnel_htable *ip_tunnel_htable_alloc(unsigned int size)
+{
+	struct ip_tunnel_htable *tbl;
+	size_t sz = sizeof(*tbl) + size * sizeof(struct hlist_head);
+
+	if (sz <= PAGE_SIZE)
+		tbl = kzalloc(sz, GFP_KERNEL);
+	else
+		tbl = vzalloc(sz);
+	if (tbl)
+		tbl->size = size;
+	return tbl;
+}
+
+static void ip_tunnel_htable_free(struct ip_tunnel_htable *tbl)
+{
+	if (is_vmalloc_addr(tbl))
+		vfree(tbl);
+	else
+		kfree(tbl);
+}
+
+static void ip_tunnel_hash_resize(struct ip_tunnel_hash *h, unsigned int size)
+{
+	struct ip_tunnel_htable *old = rtnl_dereference(h->tbl);
+	struct ip_tunnel_htable *tbl;
+	struct ip_tunnel_hashed *ht;
+	struct hlist_node *pos;
+	unsigned int i;
+
+	/* Best effort: a table that is too small is only slower */
+	tbl = ip_tunnel_htable_alloc(size);
+	if (!tbl)
+		return;
+	tbl->ver = !old->ver;
+
+	for (i = 0; i < old->size; i++)
+		hlist_for_each_entry(ht, pos, &old->buckets[i],
+				     hash_node[old->ver])
+			hlist_add_head(&ht->hash_node[tbl->ver],
+				       ip_tunnel_hash_head(tbl, ht->hash));
+
+	rcu_assign_pointer(h->tbl, tbl);
+	synchronize_rcu();
+
+	/* Only the current set of nodes may look hashed, see unlink */
+	for (i = 0; i < tbl->size; i++)
+		hlist_for_each_entry(ht, pos, &tbl->buckets[i],
+				     hash_node[tbl->ver])
+			INIT_HLIST_NODE(&ht->hash_node[old->ver]);
+
+	ip_tunnel_htable_free(old);
+}
+
+int ip_tunnel_hash_init(struct ip_tunnel_hash *h)
+{
+	struct ip_tunnel_htable *tbl;
+
+	tbl = ip_tunnel_htable_alloc(IP_TUNNEL_HASH_MIN);
+	if (!tbl)
+		return -ENOMEM;
+
+	RCU_INIT_POINTER(h->tbl, tbl);
+	h->count = 0;
+	get_random_bytes(&h->seed, sizeof(h->seed));
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ip_tunnel_hash_init);
+
+/* Called once every tunnel has been unlinked */
+void ip_tunnel_hash_destroy(struct ip_tunnel_hash *h)
+{
+	struct ip_tunnel_htable *tbl = rcu_dereference_protected(h->tbl, 1);
+
+	WARN_ON(h->count);
+	RCU_INIT_POINTER(h->tbl, NULL);
+	synchronize_rcu();
+	ip_tunnel_htable_free(tbl);
+}
+EXPORT_SYMBOL_GPL(ip_tunnel_hash_destroy);
+
+void ip_tunnel_hash_link(struct ip_tunnel_hash *h, struct ip_tunnel *t,
+			 u32 hash)
+{
+	struct ip_tunnel_hashed *ht = (struct ip_tunnel_hashed *)t;
+	struct ip_tunnel_htable *tbl = rtnl_dereference(h->tbl);
+
+	ASSERT_RTNL();
+
+	if (++h->count > tbl->size && tbl->size < IP_TUNNEL_HASH_MAX) {
+		ip_tunnel_hash_resize(h, tbl->size * 2);
+		tbl = rtnl_dereference(h->tbl);
+	}
+
+	ht->hash = hash;
+	hlist_add_head_rcu(&ht->hash_node[tbl->ver],
+			   ip_tunnel_hash_head(tbl, hash));
+}
+EXPORT_SYMBOL_GPL(ip_tunnel_hash_link);
+
+void ip_tunnel_hash_unlink(struct ip_tunnel_hash *h, struct ip_tunnel *t)
+{
+	struct ip_tunnel_hashed *ht = (struct ip_tunnel_hashed *)t;
+	struct ip_tunnel_htable *tbl = rtnl_dereference(h->tbl);
+
+	ASSERT_RTNL();
+
+	/* ndo_uninit also runs for tunnels that failed to register */
+	if (hlist_unhashed(&ht->hash_node[tbl->ver]))
+		return;
+	hlist_del_init_rcu(&ht->hash_node[tbl->ver]);
+
+	if (--h->count < tbl->size / 4 && tbl->size > IP_TUNNEL_HASH_MIN)
+		ip_tunnel_hash_resize(h, tbl->size / 2);
+}
+EXPORT_SYMBOL_GPL(ip_tunnel_hash_unlink);
+
+/* Queue every tunnel of the table for unregistration, called with RTNL */
+void ip_tunnel_hash_flush(struct ip_tunnel_hash *h, struct list_head *head)
+{
+	struct ip_tunnel_htable *tbl = rtnl_dereference(h->tbl);
+	struct ip_tunnel_hashed *ht;
+	struct hlist_node *pos;
+	unsigned int i;
+
+	for (i = 0; i < tbl->size; i++)
+		hlist_for_each_entry(ht, pos, &tbl->buckets[i],
+				     hash_node[tbl->ver])
+			unregister_netdevice_queue(ht->t.dev, head);
+}
+EXPORT_SYMBOL_GPL(ip_tunnel_hash_flush);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Resizable IPv4 tunnel hash");
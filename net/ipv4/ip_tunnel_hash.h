@@ -0,0 +1,69 @@
+#ifndef _IP_TUNNEL_HASH_H
+#define _IP_TUNNEL_HASH_H
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/jhash.h>
+#include <linux/rculist.h>
+#include <net/ipip.h>
+
+/*
+ * Resizable tunnel hash shared by ipip and ip_gre.
+ *
+ * Tunnels are kept in the netdev private area as struct ip_tunnel_hashed,
+ * so linking a tunnel never allocates.  Every tunnel has two hash nodes:
+ * readers walk the nodes of the table they found, while a resize links
+ * the other set into the new table.  Writers hold RTNL.
+ */
+
+struct ip_tunnel_hashed {
+	struct ip_tunnel	t;		/* must be first, see netdev_priv() */
+	struct hlist_node	hash_node[2];
+	u32			hash;
+};
+
+struct ip_tunnel_htable {
+	unsigned int		size;		/* power of two */
+	unsigned int		ver;		/* hash_node[] used by this table */
+	struct hlist_head	buckets[0];
+};
+
+struct ip_tunnel_hash {
+	struct ip_tunnel_htable __rcu *tbl;
+	unsigned int		count;
+	u32			seed;
+};
+
+static inline u32 ip_tunnel_hash_fn(const struct ip_tunnel_hash *h,
+				    __be32 remote, __be32 local, __be32 key)
+{
+	return jhash_3words((__force u32)remote, (__force u32)local,
+			    (__force u32)key, h->seed);
+}
+
+static inline struct hlist_head *
+ip_tunnel_hash_head(struct ip_tunnel_htable *tbl, u32 hash)
+{
+	return &tbl->buckets[hash & (tbl->size - 1)];
+}
+
+/* Walk the tunnels that may hash to 'hash', under rcu_read_lock */
+#define for_each_ip_tunnel_hashed_rcu(ht, pos, tbl, hash)		\
+	hlist_for_each_entry_rcu(ht, pos, ip_tunnel_hash_head(tbl, hash), \
+				 hash_node[(tbl)->ver])
+
+/* Same, under RTNL */
+#define for_each_ip_tunnel_hashed(ht, pos, tbl, hash)			\
+	hlist_for_each_entry(ht, pos, ip_tunnel_hash_head(tbl, hash),	\
+			     hash_node[(tbl)->ver])
+
+extern int ip_tunnel_hash_init(struct ip_tunnel_hash *h);
+extern void ip_tunnel_hash_destroy(struct ip_tunnel_hash *h);
+extern void ip_tunnel_hash_link(struct ip_tunnel_hash *h,
+				struct ip_tunnel *t, u32 hash);
+extern void ip_tunnel_hash_unlink(struct ip_tunnel_hash *h,
+				  struct ip_tunnel *t);
+extern void ip_tunnel_hash_flush(struct ip_tunnel_hash *h,
+				 struct list_head *head);
+
+#endif /* _IP_TUNNEL_HASH_H */
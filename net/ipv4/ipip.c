@@ -117,8 +117,7 @@
 #include <net/net_namespace.h>
 #include <net/netns/generic.h>
 
-#define HASH_SIZE  16
-#define HASH(addr) (((__force u32)addr^((__force u32)addr>>4))&0xF)
+#include "ip_tunnel_hash.h"
 
 static bool log_ecn_error = true;
 module_param(log_ecn_error, bool, 0644);
@@ -126,11 +125,8 @@ MODULE_PARM_DESC(log_ecn_error, "Log packets received with corrupted ECN");
 
 static int ipip_net_id __read_mostly;
 struct ipip_net {
-	struct ip_tunnel __rcu *tunnels_r_l[HASH_SIZE];
-	struct ip_tunnel __rcu *tunnels_r[HASH_SIZE];
-	struct ip_tunnel __rcu *tunnels_l[HASH_SIZE];
-	struct ip_tunnel __rcu *tunnels_wc[1];
-	struct ip_tunnel __rcu **tunnels[4];
+	/* 3: (remote,local), 2: (remote,*), 1: (*,local), 0: (*,*) */
+	struct ip_tunnel_hash tunnels[4];
 
 	struct net_device *fb_tunnel_dev;
 };
@@ -174,79 +170,65 @@ static struct rtnl_link_stats64 *ipip_get_stats64(struct net_device *dev,
 	return tot;
 }
 
+/* Hash only the addresses the table matches on */
+static u32 ipip_hash(struct ipip_net *ipn, int prio,
+		     __be32 remote, __be32 local)
+{
+	if (!(prio & 2))
+		remote = 0;
+	if (!(prio & 1))
+		local = 0;
+	return ip_tunnel_hash_fn(&ipn->tunnels[prio], remote, local, 0);
+}
+
 static struct ip_tunnel *ipip_tunnel_lookup(struct net *net,
 		__be32 remote, __be32 local)
 {
-	unsigned int h0 = HASH(remote);
-	unsigned int h1 = HASH(local);
-	struct ip_tunnel *t;
 	struct ipip_net *ipn = net_generic(net, ipip_net_id);
+	struct ip_tunnel_htable *tbl;
+	struct ip_tunnel_hashed *ht;
+	struct hlist_node *pos;
+	struct ip_tunnel *t;
+	int prio;
 
-	for_each_ip_tunnel_rcu(t, ipn->tunnels_r_l[h0 ^ h1])
-		if (local == t->parms.iph.saddr &&
-		    remote == t->parms.iph.daddr && (t->dev->flags&IFF_UP))
-			return t;
-
-	for_each_ip_tunnel_rcu(t, ipn->tunnels_r[h0])
-		if (remote == t->parms.iph.daddr && (t->dev->flags&IFF_UP))
-			return t;
-
-	for_each_ip_tunnel_rcu(t, ipn->tunnels_l[h1])
-		if (local == t->parms.iph.saddr && (t->dev->flags&IFF_UP))
-			return t;
+	for (prio = 3; prio >= 0; prio--) {
+		tbl = rcu_dereference(ipn->tunnels[prio].tbl);
+		for_each_ip_tunnel_hashed_rcu(ht, pos, tbl,
+				ipip_hash(ipn, prio, remote, local)) {
+			t = &ht->t;
+			if ((!(prio & 1) || local == t->parms.iph.saddr) &&
+			    (!(prio & 2) || remote == t->parms.iph.daddr) &&
+			    (t->dev->flags&IFF_UP))
+				return t;
+		}
+	}
 
-	t = rcu_dereference(ipn->tunnels_wc[0]);
-	if (t && (t->dev->flags&IFF_UP))
-		return t;
 	return NULL;
 }
 
-static struct ip_tunnel __rcu **__ipip_bucket(struct ipip_net *ipn,
-		struct ip_tunnel_parm *parms)
+static int ipip_prio(const struct ip_tunnel_parm *parms)
 {
-	__be32 remote = parms->iph.daddr;
-	__be32 local = parms->iph.saddr;
-	unsigned int h = 0;
 	int prio = 0;
 
-	if (remote) {
+	if (parms->iph.daddr)
 		prio |= 2;
-		h ^= HASH(remote);
-	}
-	if (local) {
+	if (parms->iph.saddr)
 		prio |= 1;
-		h ^= HASH(local);
-	}
-	return &ipn->tunnels[prio][h];
-}
-
-static inline struct ip_tunnel __rcu **ipip_bucket(struct ipip_net *ipn,
-		struct ip_tunnel *t)
-{
-	return __ipip_bucket(ipn, &t->parms);
+	return prio;
 }
 
 static void ipip_tunnel_unlink(struct ipip_net *ipn, struct ip_tunnel *t)
 {
-	struct ip_tunnel __rcu **tp;
-	struct ip_tunnel *iter;
-
-	for (tp = ipip_bucket(ipn, t);
-	     (iter = rtnl_dereference(*tp)) != NULL;
-	     tp = &iter->next) {
-		if (t == iter) {
-			rcu_assign_pointer(*tp, t->next);
-			break;
-		}
-	}
+	ip_tunnel_hash_unlink(&ipn->tunnels[ipip_prio(&t->parms)], t);
 }
 
 static void ipip_tunnel_link(struct ipip_net *ipn, struct ip_tunnel *t)
 {
-	struct ip_tunnel __rcu **tp = ipip_bucket(ipn, t);
+	int prio = ipip_prio(&t->parms);
 
-	rcu_assign_pointer(t->next, rtnl_dereference(*tp));
-	rcu_assign_pointer(*tp, t);
+	ip_tunnel_hash_link(&ipn->tunnels[prio], t,
+			    ipip_hash(ipn, prio, t->parms.iph.daddr,
+				      t->parms.iph.saddr));
 }
 
 static int ipip_tunnel_create(struct net_device *dev)
@@ -281,14 +263,17 @@ static struct ip_tunnel *ipip_tunnel_locate(struct net *net,
 	__be32 remote = parms->iph.daddr;
 	__be32 local = parms->iph.saddr;
 	struct ip_tunnel *t, *nt;
-	struct ip_tunnel __rcu **tp;
 	struct net_device *dev;
 	char name[IFNAMSIZ];
 	struct ipip_net *ipn = net_generic(net, ipip_net_id);
-
-	for (tp = __ipip_bucket(ipn, parms);
-		 (t = rtnl_dereference(*tp)) != NULL;
-		 tp = &t->next) {
+	int prio = ipip_prio(parms);
+	struct ip_tunnel_htable *tbl = rtnl_dereference(ipn->tunnels[prio].tbl);
+	struct ip_tunnel_hashed *ht;
+	struct hlist_node *pos;
+
+	for_each_ip_tunnel_hashed(ht, pos, tbl,
+				  ipip_hash(ipn, prio, remote, local)) {
+		t = &ht->t;
 		if (local == t->parms.iph.saddr && remote == t->parms.iph.daddr)
 			return t;
 	}
@@ -300,7 +285,8 @@ static struct ip_tunnel *ipip_tunnel_locate(struct net *net,
 	else
 		strcpy(name, "tunl%d");
 
-	dev = alloc_netdev(sizeof(*t), name, ipip_tunnel_setup);
+	dev = alloc_netdev(sizeof(struct ip_tunnel_hashed), name,
+			   ipip_tunnel_setup);
 	if (dev == NULL)
 		return NULL;
 
@@ -325,10 +311,7 @@ static void ipip_tunnel_uninit(struct net_device *dev)
 	struct net *net = dev_net(dev);
 	struct ipip_net *ipn = net_generic(net, ipip_net_id);
 
-	if (dev == ipn->fb_tunnel_dev)
-		RCU_INIT_POINTER(ipn->tunnels_wc[0], NULL);
-	else
-		ipip_tunnel_unlink(ipn, netdev_priv(dev));
+	ipip_tunnel_unlink(ipn, netdev_priv(dev));
 	dev_put(dev);
 }
 
@@ -830,7 +813,6 @@ static int __net_init ipip_fb_tunnel_init(struct net_device *dev)
 {
 	struct ip_tunnel *tunnel = netdev_priv(dev);
 	struct iphdr *iph = &tunnel->parms.iph;
-	struct ipip_net *ipn = net_generic(dev_net(dev), ipip_net_id);
 
 	tunnel->dev = dev;
 	strcpy(tunnel->parms.name, dev->name);
@@ -844,7 +826,6 @@ static int __net_init ipip_fb_tunnel_init(struct net_device *dev)
 		return -ENOMEM;
 
 	dev_hold(dev);
-	rcu_assign_pointer(ipn->tunnels_wc[0], tunnel);
 	return 0;
 }
 
@@ -976,7 +957,7 @@ static struct rtnl_link_ops ipip_link_ops __read_mostly = {
 	.kind		= "ipip",
 	.maxtype	= IFLA_IPTUN_MAX,
 	.policy		= ipip_policy,
-	.priv_size	= sizeof(struct ip_tunnel),
+	.priv_size	= sizeof(struct ip_tunnel_hashed),
 	.setup		= ipip_tunnel_setup,
 	.newlink	= ipip_newlink,
 	.changelink	= ipip_changelink,
@@ -997,32 +978,24 @@ static void ipip_destroy_tunnels(struct ipip_net *ipn, struct list_head *head)
 {
 	int prio;
 
-	for (prio = 1; prio < 4; prio++) {
-		int h;
-		for (h = 0; h < HASH_SIZE; h++) {
-			struct ip_tunnel *t;
-
-			t = rtnl_dereference(ipn->tunnels[prio][h]);
-			while (t != NULL) {
-				unregister_netdevice_queue(t->dev, head);
-				t = rtnl_dereference(t->next);
-			}
-		}
-	}
+	for (prio = 1; prio < 4; prio++)
+		ip_tunnel_hash_flush(&ipn->tunnels[prio], head);
 }
 
 static int __net_init ipip_init_net(struct net *net)
 {
 	struct ipip_net *ipn = net_generic(net, ipip_net_id);
 	struct ip_tunnel *t;
+	int prio;
 	int err;
 
-	ipn->tunnels[0] = ipn->tunnels_wc;
-	ipn->tunnels[1] = ipn->tunnels_l;
-	ipn->tunnels[2] = ipn->tunnels_r;
-	ipn->tunnels[3] = ipn->tunnels_r_l;
+	for (prio = 0; prio < 4; prio++) {
+		err = ip_tunnel_hash_init(&ipn->tunnels[prio]);
+		if (err)
+			goto err_hash;
+	}
 
-	ipn->fb_tunnel_dev = alloc_netdev(sizeof(struct ip_tunnel),
+	ipn->fb_tunnel_dev = alloc_netdev(sizeof(struct ip_tunnel_hashed),
 					   "tunl0",
 					   ipip_tunnel_setup);
 	if (!ipn->fb_tunnel_dev) {
@@ -1041,12 +1014,18 @@ static int __net_init ipip_init_net(struct net *net)
 	t = netdev_priv(ipn->fb_tunnel_dev);
 
 	strcpy(t->parms.name, ipn->fb_tunnel_dev->name);
+
+	rtnl_lock();
+	ipip_tunnel_link(ipn, t);
+	rtnl_unlock();
 	return 0;
 
 err_reg_dev:
 	ipip_dev_free(ipn->fb_tunnel_dev);
 err_alloc_dev:
-	/* nothing */
+err_hash:
+	while (prio--)
+		ip_tunnel_hash_destroy(&ipn->tunnels[prio]);
 	return err;
 }
 
@@ -1054,12 +1033,16 @@ static void __net_exit ipip_exit_net(struct net *net)
 {
 	struct ipip_net *ipn = net_generic(net, ipip_net_id);
 	LIST_HEAD(list);
+	int prio;
 
 	rtnl_lock();
 	ipip_destroy_tunnels(ipn, &list);
 	unregister_netdevice_queue(ipn->fb_tunnel_dev, &list);
 	unregister_netdevice_many(&list);
 	rtnl_unlock();
+
+	for (prio = 0; prio < 4; prio++)
+		ip_tunnel_hash_destroy(&ipn->tunnels[prio]);
 }
 
 static struct pernet_operations ipip_net_ops = {
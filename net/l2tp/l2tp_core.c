@@ -28,6 +28,7 @@
 
 #include <linux/kernel.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
 #include <linux/kthread.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
@@ -107,8 +108,7 @@ static unsigned int l2tp_net_id;
 struct l2tp_net {
 	struct list_head l2tp_tunnel_list;
 	spinlock_t l2tp_tunnel_list_lock;
-	struct hlist_head l2tp_session_hlist[L2TP_HASH_SIZE_2];
-	spinlock_t l2tp_session_hlist_lock;
+	struct l2tp_session_hash l2tp_session_hash;
 };
 
 static void l2tp_session_set_header_len(struct l2tp_session *session, int version);
@@ -156,99 +156,232 @@ do {									\
 #define l2tp_tunnel_dec_refcount(t) l2tp_tunnel_dec_refcount_1(t)
 #endif
 
-/* Session hash global list for L2TPv3.
- * The session_id SHOULD be random according to RFC3931, but several
- * L2TP implementations use incrementing session_ids.  So we do a real
- * hash on the session_id, rather than a simple bitmask.
+/*****************************************************************************
+ * Session hash
+ *****************************************************************************/
+
+/* The session_id SHOULD be random according to RFC2661 and RFC3931, but
+ * several L2TP implementations (Cisco and Microsoft) use incrementing
+ * session_ids.  So we do a real hash on the session_id, rather than a
+ * simple bitmask.
  */
 static inline struct hlist_head *
-l2tp_session_id_hash_2(struct l2tp_net *pn, u32 session_id)
+l2tp_session_hash_head(struct l2tp_session_htable *tbl, u32 session_id)
+{
+	return &tbl->buckets[hash_32(session_id, tbl->bits)];
+}
+
+static size_t l2tp_session_htable_size(unsigned int bits)
+{
+	return sizeof(struct l2tp_session_htable) +
+	       (sizeof(struct hlist_head) << bits);
+}
+
+/* Tables are freed from RCU callbacks, so stay away from vmalloc */
+static struct l2tp_session_htable *l2tp_session_htable_alloc(unsigned int bits)
+{
+	struct l2tp_session_htable *tbl;
+	size_t sz = l2tp_session_htable_size(bits);
+
+	if (sz <= PAGE_SIZE)
+		tbl = kzalloc(sz, GFP_KERNEL);
+	else
+		tbl = (struct l2tp_session_htable *)
+			__get_free_pages(GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN,
+					 get_order(sz));
+	if (tbl)
+		tbl->bits = bits;
+	return tbl;
+}
+
+static void l2tp_session_htable_free(struct l2tp_session_htable *tbl)
 {
-	return &pn->l2tp_session_hlist[hash_32(session_id, L2TP_HASH_BITS_2)];
+	size_t sz = l2tp_session_htable_size(tbl->bits);
 
+	if (sz <= PAGE_SIZE)
+		kfree(tbl);
+	else
+		free_pages((unsigned long)tbl, get_order(sz));
+}
+
+static void l2tp_session_htable_free_rcu(struct rcu_head *head)
+{
+	l2tp_session_htable_free(container_of(head, struct l2tp_session_htable,
+					      rcu));
 }
 
-/* Lookup a session by id in the global session list
+static int l2tp_session_hash_init(struct l2tp_session_hash *h,
+				  unsigned int type, unsigned int bits)
+{
+	struct l2tp_session_htable *tbl;
+
+	tbl = l2tp_session_htable_alloc(bits);
+	if (tbl == NULL)
+		return -ENOMEM;
+
+	RCU_INIT_POINTER(h->tbl, tbl);
+	spin_lock_init(&h->lock);
+	mutex_init(&h->resize_mutex);
+	h->count = 0;
+	h->type = type;
+
+	return 0;
+}
+
+/* Called once every session has been unlinked. May run in atomic
+ * context, from the tunnel socket destructor.
  */
-static struct l2tp_session *l2tp_session_find_2(struct net *net, u32 session_id)
+static void l2tp_session_hash_destroy(struct l2tp_session_hash *h)
 {
-	struct l2tp_net *pn = l2tp_pernet(net);
-	struct hlist_head *session_list =
-		l2tp_session_id_hash_2(pn, session_id);
+	struct l2tp_session_htable *tbl = rcu_dereference_protected(h->tbl, 1);
+
+	RCU_INIT_POINTER(h->tbl, NULL);
+	call_rcu(&tbl->rcu, l2tp_session_htable_free_rcu);
+}
+
+/* Move every session to a table of 1 << bits buckets. Called with
+ * resize_mutex held; the grace period makes sure that nobody walks the
+ * old set of nodes any more when the next resize reuses them.
+ */
+static void l2tp_session_hash_resize(struct l2tp_session_hash *h,
+				     unsigned int bits)
+{
+	struct l2tp_session_htable *old, *tbl;
 	struct l2tp_session *session;
 	struct hlist_node *walk;
+	unsigned int i;
+
+	/* Best effort: a table that is too small is only slower */
+	tbl = l2tp_session_htable_alloc(bits);
+	if (tbl == NULL)
+		return;
+
+	spin_lock_bh(&h->lock);
+	old = rcu_dereference_protected(h->tbl, lockdep_is_held(&h->lock));
+	tbl->ver = !old->ver;
+	for (i = 0; i < (1U << old->bits); i++)
+		hlist_for_each_entry(session, walk, &old->buckets[i],
+				     hash_node[h->type][old->ver])
+			hlist_add_head(&session->hash_node[h->type][tbl->ver],
+				       l2tp_session_hash_head(tbl,
+							      session->session_id));
+	rcu_assign_pointer(h->tbl, tbl);
+	spin_unlock_bh(&h->lock);
+
+	synchronize_rcu();
+	l2tp_session_htable_free(old);
+}
 
-	rcu_read_lock_bh();
-	hlist_for_each_entry_rcu(session, walk, session_list, global_hlist) {
-		if (session->session_id == session_id) {
-			rcu_read_unlock_bh();
-			return session;
-		}
-	}
-	rcu_read_unlock_bh();
+/* Called in process context, from l2tp_session_create() */
+static void l2tp_session_hash_link(struct l2tp_session_hash *h,
+				   struct l2tp_session *session)
+{
+	struct l2tp_session_htable *tbl;
 
-	return NULL;
+	mutex_lock(&h->resize_mutex);
+
+	tbl = rcu_dereference_protected(h->tbl,
+					lockdep_is_held(&h->resize_mutex));
+	if (h->count >= (1U << tbl->bits) && tbl->bits < L2TP_HASH_BITS_MAX)
+		l2tp_session_hash_resize(h, tbl->bits + 1);
+
+	spin_lock_bh(&h->lock);
+	tbl = rcu_dereference_protected(h->tbl, lockdep_is_held(&h->lock));
+	hlist_add_head_rcu(&session->hash_node[h->type][tbl->ver],
+			   l2tp_session_hash_head(tbl, session->session_id));
+	session->hashed[h->type] = true;
+	h->count++;
+	spin_unlock_bh(&h->lock);
+
+	mutex_unlock(&h->resize_mutex);
 }
 
-/* Session hash list.
- * The session_id SHOULD be random according to RFC2661, but several
- * L2TP implementations (Cisco and Microsoft) use incrementing
- * session_ids.  So we do a real hash on the session_id, rather than a
- * simple bitmask.
+/* Called with the hash lock held. Sessions are freed after a grace
+ * period, so readers that still see the session on either table are
+ * safe. Tables never shrink, which lets this run in atomic context.
  */
-static inline struct hlist_head *
-l2tp_session_id_hash(struct l2tp_tunnel *tunnel, u32 session_id)
+static void __l2tp_session_hash_unlink(struct l2tp_session_hash *h,
+				       struct l2tp_session *session)
+{
+	struct l2tp_session_htable *tbl;
+
+	if (!session->hashed[h->type])
+		return;
+
+	tbl = rcu_dereference_protected(h->tbl, lockdep_is_held(&h->lock));
+	hlist_del_rcu(&session->hash_node[h->type][tbl->ver]);
+	session->hashed[h->type] = false;
+	h->count--;
+}
+
+static void l2tp_session_hash_unlink(struct l2tp_session_hash *h,
+				     struct l2tp_session *session)
 {
-	return &tunnel->session_hlist[hash_32(session_id, L2TP_HASH_BITS)];
+	spin_lock_bh(&h->lock);
+	__l2tp_session_hash_unlink(h, session);
+	spin_unlock_bh(&h->lock);
+}
+
+/* Called under rcu_read_lock */
+static struct l2tp_session *l2tp_session_hash_find(struct l2tp_session_hash *h,
+						   u32 session_id)
+{
+	struct l2tp_session_htable *tbl = rcu_dereference(h->tbl);
+	struct l2tp_session *session;
+	struct hlist_node *walk;
+
+	hlist_for_each_entry_rcu(session, walk,
+				 l2tp_session_hash_head(tbl, session_id),
+				 hash_node[h->type][tbl->ver]) {
+		if (session->session_id == session_id)
+			return session;
+	}
+
+	return NULL;
 }
 
 /* Lookup a session by id
  */
 struct l2tp_session *l2tp_session_find(struct net *net, struct l2tp_tunnel *tunnel, u32 session_id)
 {
-	struct hlist_head *session_list;
+	struct l2tp_session_hash *h;
 	struct l2tp_session *session;
-	struct hlist_node *walk;
 
 	/* In L2TPv3, session_ids are unique over all tunnels and we
 	 * sometimes need to look them up before we know the
 	 * tunnel.
 	 */
 	if (tunnel == NULL)
-		return l2tp_session_find_2(net, session_id);
+		h = &l2tp_pernet(net)->l2tp_session_hash;
+	else
+		h = &tunnel->session_hash;
 
-	session_list = l2tp_session_id_hash(tunnel, session_id);
-	read_lock_bh(&tunnel->hlist_lock);
-	hlist_for_each_entry(session, walk, session_list, hlist) {
-		if (session->session_id == session_id) {
-			read_unlock_bh(&tunnel->hlist_lock);
-			return session;
-		}
-	}
-	read_unlock_bh(&tunnel->hlist_lock);
+	rcu_read_lock();
+	session = l2tp_session_hash_find(h, session_id);
+	rcu_read_unlock();
 
-	return NULL;
+	return session;
 }
 EXPORT_SYMBOL_GPL(l2tp_session_find);
 
 struct l2tp_session *l2tp_session_find_nth(struct l2tp_tunnel *tunnel, int nth)
 {
-	int hash;
+	struct l2tp_session_htable *tbl;
 	struct hlist_node *walk;
 	struct l2tp_session *session;
+	unsigned int hash;
 	int count = 0;
 
-	read_lock_bh(&tunnel->hlist_lock);
-	for (hash = 0; hash < L2TP_HASH_SIZE; hash++) {
-		hlist_for_each_entry(session, walk, &tunnel->session_hlist[hash], hlist) {
-			if (++count > nth) {
-				read_unlock_bh(&tunnel->hlist_lock);
-				return session;
-			}
+	rcu_read_lock();
+	l2tp_session_hash_for_each_rcu(session, walk, &tunnel->session_hash,
+				       tbl, hash) {
+		if (++count > nth) {
+			rcu_read_unlock();
+			return session;
 		}
 	}
 
-	read_unlock_bh(&tunnel->hlist_lock);
+	rcu_read_unlock();
 
 	return NULL;
 }
@@ -260,21 +393,21 @@ EXPORT_SYMBOL_GPL(l2tp_session_find_nth);
 struct l2tp_session *l2tp_session_find_by_ifname(struct net *net, char *ifname)
 {
 	struct l2tp_net *pn = l2tp_pernet(net);
-	int hash;
+	struct l2tp_session_htable *tbl;
 	struct hlist_node *walk;
 	struct l2tp_session *session;
+	unsigned int hash;
 
-	rcu_read_lock_bh();
-	for (hash = 0; hash < L2TP_HASH_SIZE_2; hash++) {
-		hlist_for_each_entry_rcu(session, walk, &pn->l2tp_session_hlist[hash], global_hlist) {
-			if (!strcmp(session->ifname, ifname)) {
-				rcu_read_unlock_bh();
-				return session;
-			}
+	rcu_read_lock();
+	l2tp_session_hash_for_each_rcu(session, walk, &pn->l2tp_session_hash,
+				       tbl, hash) {
+		if (!strcmp(session->ifname, ifname)) {
+			rcu_read_unlock();
+			return session;
 		}
 	}
 
-	rcu_read_unlock_bh();
+	rcu_read_unlock();
 
 	return NULL;
 }
@@ -325,7 +458,7 @@ EXPORT_SYMBOL_GPL(l2tp_tunnel_find_nth);
  *****************************************************************************/
 
 /* Queue a skb in order. We come here only if the skb has an L2TP sequence
- * number.
+ * number. Called with the reorder_q lock held.
  */
 static void l2tp_recv_queue_skb(struct l2tp_session *session, struct sk_buff *skb)
 {
@@ -334,7 +467,6 @@ static void l2tp_recv_queue_skb(struct l2tp_session *session, struct sk_buff *sk
 	u32 ns = L2TP_SKB_CB(skb)->ns;
 	struct l2tp_stats *sstats;
 
-	spin_lock_bh(&session->reorder_q.lock);
 	sstats = &session->stats;
 	skb_queue_walk_safe(&session->reorder_q, skbp, tmp) {
 		if (L2TP_SKB_CB(skbp)->ns > ns) {
@@ -346,52 +478,22 @@ static void l2tp_recv_queue_skb(struct l2tp_session *session, struct sk_buff *sk
 			u64_stats_update_begin(&sstats->syncp);
 			sstats->rx_oos_packets++;
 			u64_stats_update_end(&sstats->syncp);
-			goto out;
+			return;
 		}
 	}
 
 	__skb_queue_tail(&session->reorder_q, skb);
-
-out:
-	spin_unlock_bh(&session->reorder_q.lock);
 }
 
 /* Dequeue a single skb.
  */
 static void l2tp_recv_dequeue_skb(struct l2tp_session *session, struct sk_buff *skb)
 {
-	struct l2tp_tunnel *tunnel = session->tunnel;
-	int length = L2TP_SKB_CB(skb)->length;
-	struct l2tp_stats *tstats, *sstats;
-
 	/* We're about to requeue the skb, so return resources
 	 * to its current owner (a socket receive buffer).
 	 */
 	skb_orphan(skb);
 
-	tstats = &tunnel->stats;
-	u64_stats_update_begin(&tstats->syncp);
-	sstats = &session->stats;
-	u64_stats_update_begin(&sstats->syncp);
-	tstats->rx_packets++;
-	tstats->rx_bytes += length;
-	sstats->rx_packets++;
-	sstats->rx_bytes += length;
-	u64_stats_update_end(&tstats->syncp);
-	u64_stats_update_end(&sstats->syncp);
-
-	if (L2TP_SKB_CB(skb)->has_seq) {
-		/* Bump our Nr */
-		session->nr++;
-		if (tunnel->version == L2TP_HDR_VER_2)
-			session->nr &= 0xffff;
-		else
-			session->nr &= 0xffffff;
-
-		l2tp_dbg(session, L2TP_MSG_SEQ, "%s: updated nr to %hu\n",
-			 session->name, session->nr);
-	}
-
 	/* call private receive handler */
 	if (session->recv_skb != NULL)
 		(*session->recv_skb)(session, skb, L2TP_SKB_CB(skb)->length);
@@ -402,22 +504,39 @@ static void l2tp_recv_dequeue_skb(struct l2tp_session *session, struct sk_buff *
 		(*session->deref)(session);
 }
 
-/* Dequeue skbs from the session's reorder_q, subject to packet order.
- * Skbs that have been in the queue for too long are simply discarded.
+/* Add skb, if any, to the session's reorder_q, then dequeue skbs
+ * subject to packet order. Skbs that have been in the queue for too
+ * long are simply discarded.
+ *
+ * Every skb that can go up is taken off the queue in one hold of the
+ * queue lock, and the run is then delivered with one update of the
+ * counters. In-sequence traffic thus costs a single lock round trip
+ * per packet, and a burst that fills a gap is handed up in one go.
  */
-static void l2tp_recv_dequeue(struct l2tp_session *session)
+static void l2tp_recv_dequeue(struct l2tp_session *session, struct sk_buff *skb)
 {
-	struct sk_buff *skb;
+	struct l2tp_tunnel *tunnel = session->tunnel;
+	struct sk_buff_head batch;
 	struct sk_buff *tmp;
-	struct l2tp_stats *sstats;
+	struct l2tp_stats *tstats, *sstats;
+	unsigned int held;
+	u64 bytes = 0;
+
+	__skb_queue_head_init(&batch);
+	sstats = &session->stats;
+
+	spin_lock_bh(&session->reorder_q.lock);
+	if (skb != NULL) {
+		if (L2TP_SKB_CB(skb)->has_seq && session->reorder_timeout != 0)
+			l2tp_recv_queue_skb(session, skb);
+		else
+			__skb_queue_tail(&session->reorder_q, skb);
+	}
 
 	/* If the pkt at the head of the queue has the nr that we
 	 * expect to send up next, dequeue it and any other
 	 * in-sequence packets behind it.
 	 */
-start:
-	spin_lock_bh(&session->reorder_q.lock);
-	sstats = &session->stats;
 	skb_queue_walk_safe(&session->reorder_q, skb, tmp) {
 		if (time_after(jiffies, L2TP_SKB_CB(skb)->expires)) {
 			u64_stats_update_begin(&sstats->syncp);
@@ -452,21 +571,44 @@ start:
 					 session->name, L2TP_SKB_CB(skb)->ns,
 					 L2TP_SKB_CB(skb)->length, session->nr,
 					 skb_queue_len(&session->reorder_q));
-				goto out;
+				break;
 			}
+
+			/* Bump our Nr */
+			session->nr++;
+			if (tunnel->version == L2TP_HDR_VER_2)
+				session->nr &= 0xffff;
+			else
+				session->nr &= 0xffffff;
+
+			l2tp_dbg(session, L2TP_MSG_SEQ, "%s: updated nr to %hu\n",
+				 session->name, session->nr);
 		}
 		__skb_unlink(skb, &session->reorder_q);
-
-		/* Process the skb. We release the queue lock while we
-		 * do so to let other contexts process the queue.
-		 */
-		spin_unlock_bh(&session->reorder_q.lock);
-		l2tp_recv_dequeue_skb(session, skb);
-		goto start;
+		__skb_queue_tail(&batch, skb);
+		bytes += L2TP_SKB_CB(skb)->length;
 	}
 
-out:
+	held = skb_queue_len(&session->reorder_q);
+	if (held > session->reorder_q_max)
+		session->reorder_q_max = held;
 	spin_unlock_bh(&session->reorder_q.lock);
+
+	if (skb_queue_empty(&batch))
+		return;
+
+	tstats = &tunnel->stats;
+	u64_stats_update_begin(&tstats->syncp);
+	u64_stats_update_begin(&sstats->syncp);
+	tstats->rx_packets += skb_queue_len(&batch);
+	tstats->rx_bytes += bytes;
+	sstats->rx_packets += skb_queue_len(&batch);
+	sstats->rx_bytes += bytes;
+	u64_stats_update_end(&tstats->syncp);
+	u64_stats_update_end(&sstats->syncp);
+
+	while ((skb = __skb_dequeue(&batch)) != NULL)
+		l2tp_recv_dequeue_skb(session, skb);
 }
 
 static inline int l2tp_verify_udp_checksum(struct sock *sk,
@@ -733,42 +875,27 @@ void l2tp_recv_common(struct l2tp_session *session, struct sk_buff *skb,
 	L2TP_SKB_CB(skb)->expires = jiffies +
 		(session->reorder_timeout ? session->reorder_timeout : HZ);
 
-	/* Add packet to the session's receive queue. Reordering is done here, if
-	 * enabled. Saved L2TP protocol info is stored in skb->sb[].
-	 */
-	if (L2TP_SKB_CB(skb)->has_seq) {
-		if (session->reorder_timeout != 0) {
-			/* Packet reordering enabled. Add skb to session's
-			 * reorder queue, in order of ns.
-			 */
-			l2tp_recv_queue_skb(session, skb);
-		} else {
-			/* Packet reordering disabled. Discard out-of-sequence
-			 * packets
-			 */
-			if (L2TP_SKB_CB(skb)->ns != session->nr) {
-				u64_stats_update_begin(&sstats->syncp);
-				sstats->rx_seq_discards++;
-				u64_stats_update_end(&sstats->syncp);
-				l2tp_dbg(session, L2TP_MSG_SEQ,
-					 "%s: oos pkt %u len %d discarded, waiting for %u, reorder_q_len=%d\n",
-					 session->name, L2TP_SKB_CB(skb)->ns,
-					 L2TP_SKB_CB(skb)->length, session->nr,
-					 skb_queue_len(&session->reorder_q));
-				goto discard;
-			}
-			skb_queue_tail(&session->reorder_q, skb);
-		}
-	} else {
-		/* No sequence numbers. Add the skb to the tail of the
-		 * reorder queue. This ensures that it will be
-		 * delivered after all previous sequenced skbs.
-		 */
-		skb_queue_tail(&session->reorder_q, skb);
+	/* Packet reordering disabled. Discard out-of-sequence packets */
+	if (L2TP_SKB_CB(skb)->has_seq && session->reorder_timeout == 0 &&
+	    L2TP_SKB_CB(skb)->ns != session->nr) {
+		u64_stats_update_begin(&sstats->syncp);
+		sstats->rx_seq_discards++;
+		u64_stats_update_end(&sstats->syncp);
+		l2tp_dbg(session, L2TP_MSG_SEQ,
+			 "%s: oos pkt %u len %d discarded, waiting for %u, reorder_q_len=%d\n",
+			 session->name, L2TP_SKB_CB(skb)->ns,
+			 L2TP_SKB_CB(skb)->length, session->nr,
+			 skb_queue_len(&session->reorder_q));
+		goto discard;
 	}
 
-	/* Try to dequeue as many skbs from reorder_q as we can. */
-	l2tp_recv_dequeue(session);
+	/* Add packet to the session's receive queue, in order of ns if
+	 * reordering is enabled, and dequeue as many skbs from reorder_q
+	 * as we can. Packets without sequence numbers go to the tail, so
+	 * that they are delivered after all previous sequenced skbs.
+	 * Saved L2TP protocol info is stored in skb->sb[].
+	 */
+	l2tp_recv_dequeue(session, skb);
 
 	l2tp_session_dec_refcount(session);
 
@@ -1272,26 +1399,30 @@ end:
  */
 static void l2tp_tunnel_closeall(struct l2tp_tunnel *tunnel)
 {
-	int hash;
-	struct hlist_node *walk;
-	struct hlist_node *tmp;
+	struct l2tp_session_hash *h;
+	struct l2tp_session_htable *tbl;
 	struct l2tp_session *session;
+	struct hlist_node *walk;
+	unsigned int hash;
+	unsigned int bits;
 
 	BUG_ON(tunnel == NULL);
 
 	l2tp_info(tunnel, L2TP_MSG_CONTROL, "%s: closing all sessions...\n",
 		  tunnel->name);
 
-	write_lock_bh(&tunnel->hlist_lock);
-	for (hash = 0; hash < L2TP_HASH_SIZE; hash++) {
+	h = &tunnel->session_hash;
+	spin_lock_bh(&h->lock);
+	tbl = rcu_dereference_protected(h->tbl, lockdep_is_held(&h->lock));
+	bits = tbl->bits;
+	for (hash = 0; hash < (1U << bits); hash++) {
 again:
-		hlist_for_each_safe(walk, tmp, &tunnel->session_hlist[hash]) {
-			session = hlist_entry(walk, struct l2tp_session, hlist);
-
+		hlist_for_each_entry(session, walk, &tbl->buckets[hash],
+				     hash_node[h->type][tbl->ver]) {
 			l2tp_info(session, L2TP_MSG_CONTROL,
 				  "%s: closing session\n", session->name);
 
-			hlist_del_init(&session->hlist);
+			__l2tp_session_hash_unlink(h, session);
 
 			/* Since we should hold the sock lock while
 			 * doing any unbinding, we need to release the
@@ -1302,15 +1433,13 @@ again:
 			if (session->ref != NULL)
 				(*session->ref)(session);
 
-			write_unlock_bh(&tunnel->hlist_lock);
+			spin_unlock_bh(&h->lock);
 
 			if (tunnel->version != L2TP_HDR_VER_2) {
 				struct l2tp_net *pn = l2tp_pernet(tunnel->l2tp_net);
 
-				spin_lock_bh(&pn->l2tp_session_hlist_lock);
-				hlist_del_init_rcu(&session->global_hlist);
-				spin_unlock_bh(&pn->l2tp_session_hlist_lock);
-				synchronize_rcu();
+				l2tp_session_hash_unlink(&pn->l2tp_session_hash,
+							 session);
 			}
 
 			if (session->session_close != NULL)
@@ -1319,17 +1448,26 @@ again:
 			if (session->deref != NULL)
 				(*session->deref)(session);
 
-			write_lock_bh(&tunnel->hlist_lock);
+			spin_lock_bh(&h->lock);
 
 			/* Now restart from the beginning of this hash
 			 * chain.  We always remove a session from the
 			 * list so we are guaranteed to make forward
-			 * progress.
+			 * progress.  If the table grew meanwhile, the
+			 * sessions were rehashed: start over.
 			 */
+			if (tbl != rcu_dereference_protected(h->tbl,
+						lockdep_is_held(&h->lock)) ||
+			    tbl->bits != bits) {
+				tbl = rcu_dereference_protected(h->tbl,
+						lockdep_is_held(&h->lock));
+				bits = tbl->bits;
+				hash = 0;
+			}
 			goto again;
 		}
 	}
-	write_unlock_bh(&tunnel->hlist_lock);
+	spin_unlock_bh(&h->lock);
 }
 
 /* Really kill the tunnel.
@@ -1344,6 +1482,8 @@ static void l2tp_tunnel_free(struct l2tp_tunnel *tunnel)
 
 	l2tp_info(tunnel, L2TP_MSG_CONTROL, "%s: free...\n", tunnel->name);
 
+	l2tp_session_hash_destroy(&tunnel->session_hash);
+
 	/* Remove from tunnel list */
 	spin_lock_bh(&pn->l2tp_tunnel_list_lock);
 	list_del_rcu(&tunnel->list);
@@ -1569,6 +1709,14 @@ int l2tp_tunnel_create(struct net *net, int fd, int version, u32 tunnel_id, u32
 		goto err;
 	}
 
+	err = l2tp_session_hash_init(&tunnel->session_hash,
+				     L2TP_SESSION_HASH_TUNNEL, L2TP_HASH_BITS);
+	if (err < 0) {
+		kfree(tunnel);
+		tunnel = NULL;
+		goto err;
+	}
+
 	tunnel->version = version;
 	tunnel->tunnel_id = tunnel_id;
 	tunnel->peer_tunnel_id = peer_tunnel_id;
@@ -1576,7 +1724,6 @@ int l2tp_tunnel_create(struct net *net, int fd, int version, u32 tunnel_id, u32
 
 	tunnel->magic = L2TP_TUNNEL_MAGIC;
 	sprintf(&tunnel->name[0], "tunl %u", tunnel_id);
-	rwlock_init(&tunnel->hlist_lock);
 
 	/* The net we belong to */
 	tunnel->l2tp_net = net;
@@ -1677,18 +1824,14 @@ void l2tp_session_free(struct l2tp_session *session)
 		BUG_ON(tunnel->magic != L2TP_TUNNEL_MAGIC);
 
 		/* Delete the session from the hash */
-		write_lock_bh(&tunnel->hlist_lock);
-		hlist_del_init(&session->hlist);
-		write_unlock_bh(&tunnel->hlist_lock);
+		l2tp_session_hash_unlink(&tunnel->session_hash, session);
 
 		/* Unlink from the global hash if not L2TPv2 */
 		if (tunnel->version != L2TP_HDR_VER_2) {
 			struct l2tp_net *pn = l2tp_pernet(tunnel->l2tp_net);
 
-			spin_lock_bh(&pn->l2tp_session_hlist_lock);
-			hlist_del_init_rcu(&session->global_hlist);
-			spin_unlock_bh(&pn->l2tp_session_hlist_lock);
-			synchronize_rcu();
+			l2tp_session_hash_unlink(&pn->l2tp_session_hash,
+						 session);
 		}
 
 		if (session->session_id != 0)
@@ -1703,7 +1846,8 @@ void l2tp_session_free(struct l2tp_session *session)
 		l2tp_tunnel_dec_refcount(tunnel);
 	}
 
-	kfree(session);
+	/* Lookups do not take a reference */
+	kfree_rcu(session, rcu);
 
 	return;
 }
@@ -1759,9 +1903,6 @@ struct l2tp_session *l2tp_session_create(int priv_size, struct l2tp_tunnel *tunn
 
 		skb_queue_head_init(&session->reorder_q);
 
-		INIT_HLIST_NODE(&session->hlist);
-		INIT_HLIST_NODE(&session->global_hlist);
-
 		/* Inherit debug options from tunnel */
 		session->debug = tunnel->debug;
 
@@ -1800,19 +1941,13 @@ struct l2tp_session *l2tp_session_create(int priv_size, struct l2tp_tunnel *tunn
 		sock_hold(tunnel->sock);
 
 		/* Add session to the tunnel's hash list */
-		write_lock_bh(&tunnel->hlist_lock);
-		hlist_add_head(&session->hlist,
-			       l2tp_session_id_hash(tunnel, session_id));
-		write_unlock_bh(&tunnel->hlist_lock);
+		l2tp_session_hash_link(&tunnel->session_hash, session);
 
 		/* And to the global session list if L2TPv3 */
 		if (tunnel->version != L2TP_HDR_VER_2) {
 			struct l2tp_net *pn = l2tp_pernet(tunnel->l2tp_net);
 
-			spin_lock_bh(&pn->l2tp_session_hlist_lock);
-			hlist_add_head_rcu(&session->global_hlist,
-					   l2tp_session_id_hash_2(pn, session_id));
-			spin_unlock_bh(&pn->l2tp_session_hlist_lock);
+			l2tp_session_hash_link(&pn->l2tp_session_hash, session);
 		}
 
 		/* Ignore management session in session count value */
@@ -1831,21 +1966,24 @@ EXPORT_SYMBOL_GPL(l2tp_session_create);
 static __net_init int l2tp_init_net(struct net *net)
 {
 	struct l2tp_net *pn = net_generic(net, l2tp_net_id);
-	int hash;
 
 	INIT_LIST_HEAD(&pn->l2tp_tunnel_list);
 	spin_lock_init(&pn->l2tp_tunnel_list_lock);
 
-	for (hash = 0; hash < L2TP_HASH_SIZE_2; hash++)
-		INIT_HLIST_HEAD(&pn->l2tp_session_hlist[hash]);
+	return l2tp_session_hash_init(&pn->l2tp_session_hash,
+				      L2TP_SESSION_HASH_NET, L2TP_HASH_BITS_2);
+}
 
-	spin_lock_init(&pn->l2tp_session_hlist_lock);
+static __net_exit void l2tp_exit_net(struct net *net)
+{
+	struct l2tp_net *pn = net_generic(net, l2tp_net_id);
 
-	return 0;
+	l2tp_session_hash_destroy(&pn->l2tp_session_hash);
 }
 
 static struct pernet_operations l2tp_net_ops = {
 	.init = l2tp_init_net,
+	.exit = l2tp_exit_net,
 	.id   = &l2tp_net_id,
 	.size = sizeof(struct l2tp_net),
 };
@@ -1867,6 +2005,7 @@ out:
 static void __exit l2tp_exit(void)
 {
 	unregister_pernet_device(&l2tp_net_ops);
+	rcu_barrier(); /* Wait for completion of call_rcu()'s */
 }
 
 module_init(l2tp_init);
@@ -15,13 +15,14 @@
 #define L2TP_TUNNEL_MAGIC	0x42114DDA
 #define L2TP_SESSION_MAGIC	0x0C04EB7D
 
-/* Per tunnel, session hash table size */
+/* Per tunnel, initial session hash table size */
 #define L2TP_HASH_BITS	4
-#define L2TP_HASH_SIZE	(1 << L2TP_HASH_BITS)
 
-/* System-wide, session hash table size */
+/* System-wide, initial session hash table size */
 #define L2TP_HASH_BITS_2	8
-#define L2TP_HASH_SIZE_2	(1 << L2TP_HASH_BITS_2)
+
+/* Session hash tables double up to this size as sessions are added */
+#define L2TP_HASH_BITS_MAX	16
 
 /* Debug message categories for the DEBUG socket option */
 enum {
@@ -49,6 +50,36 @@ struct l2tp_stats {
 };
 
 struct l2tp_tunnel;
+struct l2tp_session;
+
+/* Session hashes, keyed by session_id. Every session is on the hash of
+ * its tunnel, and L2TPv3 sessions also on the per-net hash.
+ */
+enum {
+	L2TP_SESSION_HASH_TUNNEL,
+	L2TP_SESSION_HASH_NET,
+};
+
+/* Lookups run under rcu_read_lock. Writers hold the hash lock, and
+ * growing the table also takes resize_mutex. A session has two nodes
+ * per hash: readers walk the nodes of the table they found while a
+ * resize links the other set into the new table, so a session is never
+ * missing from either table during the switch.
+ */
+struct l2tp_session_htable {
+	struct rcu_head		rcu;
+	unsigned int		bits;
+	unsigned int		ver;		/* hash_node[][] used by this table */
+	struct hlist_head	buckets[0];
+};
+
+struct l2tp_session_hash {
+	struct l2tp_session_htable __rcu *tbl;
+	spinlock_t		lock;		/* protect chains and count */
+	struct mutex		resize_mutex;
+	unsigned int		count;
+	unsigned int		type;		/* L2TP_SESSION_HASH_* */
+};
 
 /* Describes a session. Contains information to determine incoming
  * packets and transmit outgoing ones.
@@ -103,8 +134,13 @@ struct l2tp_session {
 	u32			nr;		/* session NR state (receive) */
 	u32			ns;		/* session NR state (send) */
 	struct sk_buff_head	reorder_q;	/* receive reorder queue */
-	struct hlist_node	hlist;		/* Hash list node */
+	unsigned int		reorder_q_max;	/* most skbs held in reorder_q
+						 * waiting for a gap */
+	struct hlist_node	hash_node[2][2]; /* [L2TP_SESSION_HASH_*][ver] */
+	bool			hashed[2];	/* on the L2TP_SESSION_HASH_*
+						 * hash, under its lock */
 	atomic_t		ref_count;
+	struct rcu_head		rcu;
 
 	char			name[32];	/* for logging */
 	char			ifname[IFNAMSIZ];
@@ -128,7 +164,6 @@ struct l2tp_session {
 	int			mru;
 	enum l2tp_pwtype	pwtype;
 	struct l2tp_stats	stats;
-	struct hlist_node	global_hlist;	/* Global hash list node */
 
 	int (*build_header)(struct l2tp_session *session, void *buf);
 	void (*recv_skb)(struct l2tp_session *session, struct sk_buff *skb, int data_len);
@@ -164,10 +199,7 @@ struct l2tp_tunnel_cfg {
 struct l2tp_tunnel {
 	int			magic;		/* Should be L2TP_TUNNEL_MAGIC */
 	struct rcu_head rcu;
-	rwlock_t		hlist_lock;	/* protect session_hlist */
-	struct hlist_head	session_hlist[L2TP_HASH_SIZE];
-						/* hashed list of sessions,
-						 * hashed by id */
+	struct l2tp_session_hash session_hash;	/* sessions, hashed by id */
 	u32			tunnel_id;
 	u32			peer_tunnel_id;
 	int			version;	/* 2=>L2TPv2, 3=>L2TPv3 */
@@ -208,6 +240,13 @@ static inline void *l2tp_session_priv(struct l2tp_session *session)
 	return &session->priv[0];
 }
 
+/* Walk every session of a hash, under rcu_read_lock */
+#define l2tp_session_hash_for_each_rcu(session, walk, h, tbl, i)	\
+	for ((tbl) = rcu_dereference((h)->tbl), (i) = 0;		\
+	     (i) < (1U << (tbl)->bits); (i)++)				\
+		hlist_for_each_entry_rcu(session, walk, &(tbl)->buckets[i], \
+					 hash_node[(h)->type][(tbl)->ver])
+
 static inline struct l2tp_tunnel *l2tp_sock_to_tunnel(struct sock *sk)
 {
 	struct l2tp_tunnel *tunnel;
@@ -102,24 +102,21 @@ static void l2tp_dfs_seq_stop(struct seq_file *p, void *v)
 static void l2tp_dfs_seq_tunnel_show(struct seq_file *m, void *v)
 {
 	struct l2tp_tunnel *tunnel = v;
-	int session_count = 0;
-	int hash;
+	struct l2tp_session_htable *tbl;
+	struct l2tp_session *session;
 	struct hlist_node *walk;
-	struct hlist_node *tmp;
-
-	read_lock_bh(&tunnel->hlist_lock);
-	for (hash = 0; hash < L2TP_HASH_SIZE; hash++) {
-		hlist_for_each_safe(walk, tmp, &tunnel->session_hlist[hash]) {
-			struct l2tp_session *session;
+	int session_count = 0;
+	unsigned int hash;
 
-			session = hlist_entry(walk, struct l2tp_session, hlist);
-			if (session->session_id == 0)
-				continue;
+	rcu_read_lock();
+	l2tp_session_hash_for_each_rcu(session, walk, &tunnel->session_hash,
+				       tbl, hash) {
+		if (session->session_id == 0)
+			continue;
 
-			session_count++;
-		}
+		session_count++;
 	}
-	read_unlock_bh(&tunnel->hlist_lock);
+	rcu_read_unlock();
 
 	seq_printf(m, "\nTUNNEL %u peer %u", tunnel->tunnel_id, tunnel->peer_tunnel_id);
 	if (tunnel->sock) {
@@ -211,6 +208,8 @@ static void l2tp_dfs_seq_session_show(struct seq_file *m, void *v)
 		   (unsigned long long)session->stats.rx_packets,
 		   (unsigned long long)session->stats.rx_bytes,
 		   (unsigned long long)session->stats.rx_errors);
+	seq_printf(m, "   reorder_q %u/%u\n",
+		   skb_queue_len(&session->reorder_q), session->reorder_q_max);
 
 	if (session->show != NULL)
 		session->show(m, session);
@@ -233,6 +232,7 @@ static int l2tp_dfs_seq_show(struct seq_file *m, void *v)
 		seq_puts(m, "   [ peer cookie ]\n");
 		seq_puts(m, "   config mtu/mru/rcvseq/sendseq/dataseq/lns debug reorderto\n");
 		seq_puts(m, "   nr/ns tx-pkts/bytes/errs rx-pkts/bytes/errs\n");
+		seq_puts(m, "   reorder_q depth/max-held\n");
 		goto out;
 	}
 
@@ -34,6 +34,22 @@ static ip_set_id_t ip_set_max = CONFIG_IP_SET_MAX; /* max number of sets */
 #define IP_SET_INC	64
 #define STREQ(a, b)	(strncmp(a, b, IPSET_MAXNAMELEN) == 0)
 
+/* Set types whose members are tested without the set lock: the members
+ * are bits in an array which lives as long as the set itself and which
+ * is changed with atomic bit operations or single word stores only.
+ */
+static const char * const ip_set_lockless_names[] = {
+	"bitmap:ip",
+	"bitmap:port",
+};
+
+/* The registered types of ip_set_lockless_names, protected by
+ * ip_set_type_mutex. A set holds a reference to its type module, so the
+ * entry of its type cannot change while the set is tested.
+ */
+static const struct ip_set_type *
+ip_set_lockless_types[ARRAY_SIZE(ip_set_lockless_names)];
+
 static unsigned int max_sets;
 
 module_param(max_sets, int, 0600);
@@ -173,6 +189,20 @@ __find_set_type_minmax(const char *name, u8 family, u8 *min, u8 *max,
 		__find_set_type_minmax(name, family, min, max, true);
 }
 
+/* Record or forget a lockless tested type: called with the type mutex */
+static void
+ip_set_lockless_type_update(const struct ip_set_type *type, bool add)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ip_set_lockless_names); i++) {
+		if (add && STREQ(type->name, ip_set_lockless_names[i]))
+			ip_set_lockless_types[i] = type;
+		else if (!add && ip_set_lockless_types[i] == type)
+			ip_set_lockless_types[i] = NULL;
+	}
+}
+
 #define family_name(f)	((f) == NFPROTO_IPV4 ? "inet" : \
 			 (f) == NFPROTO_IPV6 ? "inet6" : "any")
 
@@ -203,6 +233,7 @@ ip_set_type_register(struct ip_set_type *type)
 		goto unlock;
 	}
 	list_add_rcu(&type->list, &ip_set_type_list);
+	ip_set_lockless_type_update(type, true);
 	pr_debug("type %s, family %s, revision %u:%u registered.\n",
 		 type->name, family_name(type->family),
 		 type->revision_min, type->revision_max);
@@ -224,6 +255,7 @@ ip_set_type_unregister(struct ip_set_type *type)
 		goto unlock;
 	}
 	list_del_rcu(&type->list);
+	ip_set_lockless_type_update(type, false);
 	pr_debug("type %s, family %s with revision min %u unregistered.\n",
 		 type->name, family_name(type->family), type->revision_min);
 unlock:
@@ -364,6 +396,17 @@ ip_set_rcu_get(ip_set_id_t index)
 	return set;
 }
 
+static inline bool
+ip_set_lockless_test(const struct ip_set *set)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ip_set_lockless_types); i++)
+		if (set->type == ip_set_lockless_types[i])
+			return true;
+	return false;
+}
+
 int
 ip_set_test(ip_set_id_t index, const struct sk_buff *skb,
 	    const struct xt_action_param *par,
@@ -379,9 +422,13 @@ ip_set_test(ip_set_id_t index, const struct sk_buff *skb,
 	    !(opt->family == set->family || set->family == NFPROTO_UNSPEC))
 		return 0;
 
-	read_lock_bh(&set->lock);
-	ret = set->variant->kadt(set, skb, par, IPSET_TEST, opt);
-	read_unlock_bh(&set->lock);
+	if (ip_set_lockless_test(set)) {
+		ret = set->variant->kadt(set, skb, par, IPSET_TEST, opt);
+	} else {
+		read_lock_bh(&set->lock);
+		ret = set->variant->kadt(set, skb, par, IPSET_TEST, opt);
+		read_unlock_bh(&set->lock);
+	}
 
 	if (ret == -EAGAIN) {
 		/* Type requests element to be completed */
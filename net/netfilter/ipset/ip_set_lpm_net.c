@@ -0,0 +1,692 @@
+/* Copyright (C) 2026 pvbolotov <pvbolotov@users.noreply.github.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* Kernel module implementing an IP set type: the lpm:net type
+ *
+ * The elements are stored in a path-compressed binary trie, so that
+ * the longest matching prefix is found in a single walk from the root,
+ * independently of the number of different prefix lengths in the set.
+ * A node is either a stored network or an intermediate node, which only
+ * joins two subtrees.  Every node has a longer prefix than its parent,
+ * so the depth of the trie is bounded by the address length.
+ *
+ * Nodes are published with RCU and freed after a grace period, so the
+ * trie can always be walked safely; the core still runs tests under
+ * the set read lock and writers under the set write lock.
+ */
+
+#include <linux/module.h>
+#include <linux/ip.h>
+#include <linux/skbuff.h>
+#include <linux/errno.h>
+#include <linux/bitops.h>
+#include <linux/slab.h>
+#include <linux/rcupdate.h>
+#include <linux/timer.h>
+#include <net/ip.h>
+#include <net/ipv6.h>
+#include <net/netlink.h>
+
+#include <linux/netfilter.h>
+#include <linux/netfilter/ipset/pfxlen.h>
+#include <linux/netfilter/ipset/ip_set.h>
+#include <linux/netfilter/ipset/ip_set_timeout.h>
+#include <linux/netfilter/ipset/ip_set_hash.h>
+
+#define REVISION_MIN	0
+#define REVISION_MAX	0
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("pvbolotov <pvbolotov@users.noreply.github.com>");
+IP_SET_MODULE_DESC("lpm:net", REVISION_MIN, REVISION_MAX);
+MODULE_ALIAS("ip_set_lpm:net");
+
+/* Node flags */
+#define LPM_NET_INTERMEDIATE	0x01	/* no element, joins two subtrees */
+#define LPM_NET_NOMATCH		0x02	/* element matches as nomatch */
+
+struct lpm_net_node {
+	struct lpm_net_node __rcu *child[2];
+	struct rcu_head rcu;
+	unsigned long timeout;		/* expiry, IPSET_ELEM_PERMANENT */
+	union nf_inet_addr ip;		/* network order, masked by cidr */
+	u8 cidr;
+	u8 flags;
+};
+
+/* Element passed to the adt functions */
+struct lpm_net_elem {
+	union nf_inet_addr ip;
+	u8 cidr;
+};
+
+/* Walk stack entry of the writers */
+struct lpm_net_walk {
+	struct lpm_net_node __rcu **slot;
+	u8 dir;				/* next child to visit */
+};
+
+/* Type structure */
+struct lpm_net {
+	struct lpm_net_node __rcu *root;
+	struct lpm_net_walk *walk;	/* writer walk stack */
+	u32 elements;			/* number of stored networks */
+	u32 maxelem;			/* max elements in the set */
+	u32 timeout;			/* timeout parameter */
+	u8 host_mask;			/* 32 or 128 */
+	size_t memsize;			/* memory used by the nodes */
+	struct timer_list gc;		/* garbage collection */
+};
+
+/* Writers run under the set lock (or own the set exclusively) */
+#define lpm_net_deref(p)	rcu_dereference_protected(p, 1)
+
+static inline void
+lpm_net_netmask(union nf_inet_addr *ip, u8 cidr, u8 host_mask)
+{
+	if (host_mask == 32) {
+		ip->ip &= ip_set_netmask(cidr);
+		return;
+	}
+	ip->ip6[0] &= ip_set_netmask6(cidr)[0];
+	ip->ip6[1] &= ip_set_netmask6(cidr)[1];
+	ip->ip6[2] &= ip_set_netmask6(cidr)[2];
+	ip->ip6[3] &= ip_set_netmask6(cidr)[3];
+}
+
+/* Value of the bit at position index, counted from the MSB */
+static inline u8
+lpm_net_bit(const union nf_inet_addr *ip, u8 index)
+{
+	return (ntohl(ip->ip6[index / 32]) >> (31 - index % 32)) & 1;
+}
+
+/* Number of leading bits common to the node and the prefix ip/cidr */
+static inline u8
+lpm_net_match_len(const struct lpm_net_node *node,
+		  const union nf_inet_addr *ip, u8 cidr)
+{
+	u8 limit = min(node->cidr, cidr), len = 0;
+	u32 diff;
+	int i;
+
+	for (i = 0; len < limit; i++) {
+		diff = ntohl(node->ip.ip6[i] ^ ip->ip6[i]);
+		if (diff) {
+			len += 32 - fls(diff);
+			break;
+		}
+		len += 32;
+	}
+	return min(len, limit);
+}
+
+static inline bool
+lpm_net_valid(const struct lpm_net_node *node)
+{
+	return !(node->flags & LPM_NET_INTERMEDIATE) &&
+	       ip_set_timeout_test(node->timeout);
+}
+
+static struct lpm_net_node *
+lpm_net_node_alloc(struct lpm_net *map, const union nf_inet_addr *ip,
+		   u8 cidr, u8 flags)
+{
+	struct lpm_net_node *node;
+
+	node = kzalloc(sizeof(*node), GFP_ATOMIC);
+	if (!node)
+		return NULL;
+	node->ip = *ip;
+	lpm_net_netmask(&node->ip, cidr, map->host_mask);
+	node->cidr = cidr;
+	node->flags = flags;
+	node->timeout = IPSET_ELEM_PERMANENT;
+	map->memsize += sizeof(*node);
+
+	return node;
+}
+
+static inline void
+lpm_net_node_free(struct lpm_net *map, struct lpm_net_node *node)
+{
+	map->memsize -= sizeof(*node);
+	kfree_rcu(node, rcu);
+}
+
+/* Longest prefix match: called with the set read lock held */
+static const struct lpm_net_node *
+lpm_net_lookup(const struct lpm_net *map, const union nf_inet_addr *ip,
+	       u8 cidr)
+{
+	const struct lpm_net_node *node, *found = NULL;
+	u8 matchlen;
+
+	for (node = rcu_dereference_bh(map->root); node; ) {
+		matchlen = lpm_net_match_len(node, ip, cidr);
+		if (matchlen < node->cidr)
+			break;
+		if (lpm_net_valid(node))
+			found = node;
+		if (node->cidr == cidr)
+			break;
+		node = rcu_dereference_bh(node->child[lpm_net_bit(ip,
+							      node->cidr)]);
+	}
+	return found;
+}
+
+static int
+lpm_net_test(struct ip_set *set, void *value, u32 timeout, u32 flags)
+{
+	const struct lpm_net *map = set->data;
+	const struct lpm_net_elem *e = value;
+	const struct lpm_net_node *node;
+
+	node = lpm_net_lookup(map, &e->ip, e->cidr);
+	if (!node)
+		return 0;
+
+	return node->flags & LPM_NET_NOMATCH ? -ENOTEMPTY : 1;
+}
+
+static int
+lpm_net_add(struct ip_set *set, void *value, u32 timeout, u32 flags)
+{
+	struct lpm_net *map = set->data;
+	const struct lpm_net_elem *e = value;
+	struct lpm_net_node __rcu **slot = &map->root;
+	struct lpm_net_node *node, *new, *im;
+	u8 nflags = (flags >> 16) & IPSET_FLAG_NOMATCH ? LPM_NET_NOMATCH : 0;
+	u8 matchlen = 0;
+
+	while ((node = lpm_net_deref(*slot)) != NULL) {
+		matchlen = lpm_net_match_len(node, &e->ip, e->cidr);
+		if (node->cidr != matchlen || node->cidr == e->cidr)
+			break;
+		slot = &node->child[lpm_net_bit(&e->ip, node->cidr)];
+	}
+
+	if (node && node->cidr == e->cidr && matchlen == e->cidr &&
+	    !(node->flags & LPM_NET_INTERMEDIATE)) {
+		/* Element exists: it can be refreshed only */
+		if (ip_set_timeout_test(node->timeout) &&
+		    !(flags & IPSET_FLAG_EXIST))
+			return -IPSET_ERR_EXIST;
+		node->flags = nflags;
+		node->timeout = with_timeout(map->timeout)
+			? ip_set_timeout_set(timeout) : IPSET_ELEM_PERMANENT;
+		return 0;
+	}
+
+	if (map->elements >= map->maxelem)
+		return -IPSET_ERR_HASH_FULL;
+
+	new = lpm_net_node_alloc(map, &e->ip, e->cidr, nflags);
+	if (!new)
+		return -ENOMEM;
+	if (with_timeout(map->timeout))
+		new->timeout = ip_set_timeout_set(timeout);
+
+	if (!node) {
+		/* Empty slot */
+		rcu_assign_pointer(*slot, new);
+	} else if (node->cidr == e->cidr && matchlen == e->cidr) {
+		/* Replace the intermediate node */
+		RCU_INIT_POINTER(new->child[0], lpm_net_deref(node->child[0]));
+		RCU_INIT_POINTER(new->child[1], lpm_net_deref(node->child[1]));
+		rcu_assign_pointer(*slot, new);
+		lpm_net_node_free(map, node);
+	} else if (matchlen == e->cidr) {
+		/* The new element covers the node */
+		RCU_INIT_POINTER(new->child[lpm_net_bit(&node->ip, e->cidr)],
+				 node);
+		rcu_assign_pointer(*slot, new);
+	} else {
+		/* Join the node and the new element under a new parent */
+		im = lpm_net_node_alloc(map, &e->ip, matchlen,
+					LPM_NET_INTERMEDIATE);
+		if (!im) {
+			map->memsize -= sizeof(*new);
+			kfree(new);
+			return -ENOMEM;
+		}
+		if (lpm_net_bit(&e->ip, matchlen)) {
+			RCU_INIT_POINTER(im->child[0], node);
+			RCU_INIT_POINTER(im->child[1], new);
+		} else {
+			RCU_INIT_POINTER(im->child[0], new);
+			RCU_INIT_POINTER(im->child[1], node);
+		}
+		rcu_assign_pointer(*slot, im);
+	}
+	map->elements++;
+
+	return 0;
+}
+
+/* Unlink an intermediate node which has less than two children */
+static inline bool
+lpm_net_splice(struct lpm_net *map, struct lpm_net_node __rcu **slot,
+	       struct lpm_net_node *node)
+{
+	struct lpm_net_node *c0 = lpm_net_deref(node->child[0]);
+	struct lpm_net_node *c1 = lpm_net_deref(node->child[1]);
+
+	if (c0 && c1)
+		return false;
+	rcu_assign_pointer(*slot, c0 ? c0 : c1);
+	lpm_net_node_free(map, node);
+
+	return true;
+}
+
+static int
+lpm_net_del(struct ip_set *set, void *value, u32 timeout, u32 flags)
+{
+	struct lpm_net *map = set->data;
+	const struct lpm_net_elem *e = value;
+	struct lpm_net_node __rcu **slot = &map->root, **pslot = NULL;
+	struct lpm_net_node *node, *parent = NULL;
+	u8 matchlen = 0;
+	int ret;
+
+	while ((node = lpm_net_deref(*slot)) != NULL) {
+		matchlen = lpm_net_match_len(node, &e->ip, e->cidr);
+		if (node->cidr != matchlen || node->cidr == e->cidr)
+			break;
+		parent = node;
+		pslot = slot;
+		slot = &node->child[lpm_net_bit(&e->ip, node->cidr)];
+	}
+
+	if (!node || node->cidr != e->cidr || matchlen != e->cidr ||
+	    (node->flags & LPM_NET_INTERMEDIATE))
+		return -IPSET_ERR_EXIST;
+
+	ret = ip_set_timeout_test(node->timeout) ? 0 : -IPSET_ERR_EXIST;
+	node->flags |= LPM_NET_INTERMEDIATE;
+	map->elements--;
+
+	if (lpm_net_splice(map, slot, node) &&
+	    parent && (parent->flags & LPM_NET_INTERMEDIATE))
+		lpm_net_splice(map, pslot, parent);
+
+	return ret;
+}
+
+/* Remove the expired (or all) elements in a post-order walk */
+static void
+lpm_net_prune(struct lpm_net *map, bool all)
+{
+	struct lpm_net_walk *w = map->walk;
+	struct lpm_net_node *node;
+	int sp = 0;
+
+	w[sp].slot = &map->root;
+	w[sp++].dir = 0;
+	while (sp) {
+		node = lpm_net_deref(*w[sp - 1].slot);
+		if (!node) {
+			sp--;
+			continue;
+		}
+		if (w[sp - 1].dir < 2) {
+			w[sp].slot = &node->child[w[sp - 1].dir++];
+			w[sp++].dir = 0;
+			continue;
+		}
+		sp--;
+		if (!(node->flags & LPM_NET_INTERMEDIATE)) {
+			if (!all && !ip_set_timeout_expired(node->timeout))
+				continue;
+			node->flags |= LPM_NET_INTERMEDIATE;
+			map->elements--;
+		}
+		lpm_net_splice(map, w[sp].slot, node);
+	}
+}
+
+static int
+lpm_net_list(const struct ip_set *set,
+	     struct sk_buff *skb, struct netlink_callback *cb)
+{
+	const struct lpm_net *map = set->data;
+	const struct lpm_net_node *node, *child, **stack;
+	struct nlattr *atd, *nested;
+	u32 id = 0, first = cb->args[2];
+	u32 flags;
+	int sp = 0, ret = 0;
+
+	/* Pre-order walk, every level leaves at most one pending child */
+	stack = kmalloc((map->host_mask + 2) * sizeof(*stack), GFP_ATOMIC);
+	if (!stack)
+		return -ENOMEM;
+
+	atd = ipset_nest_start(skb, IPSET_ATTR_ADT);
+	if (!atd) {
+		kfree(stack);
+		return -EMSGSIZE;
+	}
+	/* Writers are locked out by the set lock held by the core */
+	node = rcu_dereference_bh(map->root);
+	if (node)
+		stack[sp++] = node;
+	while (sp) {
+		node = stack[--sp];
+		child = rcu_dereference_bh(node->child[1]);
+		if (child)
+			stack[sp++] = child;
+		child = rcu_dereference_bh(node->child[0]);
+		if (child)
+			stack[sp++] = child;
+		if (!lpm_net_valid(node) || id++ < first)
+			continue;
+		nested = ipset_nest_start(skb, IPSET_ATTR_DATA);
+		if (!nested)
+			goto nla_put_failure;
+		flags = node->flags & LPM_NET_NOMATCH ? IPSET_FLAG_NOMATCH : 0;
+		if ((map->host_mask == 32
+		     ? nla_put_ipaddr4(skb, IPSET_ATTR_IP, node->ip.ip)
+		     : nla_put_ipaddr6(skb, IPSET_ATTR_IP, &node->ip.in6)) ||
+		    nla_put_u8(skb, IPSET_ATTR_CIDR, node->cidr) ||
+		    (with_timeout(map->timeout) &&
+		     nla_put_net32(skb, IPSET_ATTR_TIMEOUT,
+				   htonl(ip_set_timeout_get(node->timeout)))) ||
+		    (flags &&
+		     nla_put_net32(skb, IPSET_ATTR_CADT_FLAGS, htonl(flags)))) {
+			nla_nest_cancel(skb, nested);
+			goto nla_put_failure;
+		}
+		ipset_nest_end(skb, nested);
+		cb->args[2] = id;
+	}
+	/* Set listing finished */
+	cb->args[2] = 0;
+	goto out;
+
+nla_put_failure:
+	if (unlikely(id - 1 == first)) {
+		cb->args[2] = 0;
+		ret = -EMSGSIZE;
+	}
+out:
+	ipset_nest_end(skb, atd);
+	kfree(stack);
+
+	return ret;
+}
+
+static int
+lpm_net_kadt(struct ip_set *set, const struct sk_buff *skb,
+	     const struct xt_action_param *par,
+	     enum ipset_adt adt, const struct ip_set_adt_opt *opt)
+{
+	const struct lpm_net *map = set->data;
+	ipset_adtfn adtfn = set->variant->adt[adt];
+	struct lpm_net_elem e = { .cidr = map->host_mask };
+
+	if (map->host_mask == 32)
+		ip4addrptr(skb, opt->flags & IPSET_DIM_ONE_SRC, &e.ip.ip);
+	else
+		ip6addrptr(skb, opt->flags & IPSET_DIM_ONE_SRC, &e.ip.in6);
+
+	return adtfn(set, &e, opt_timeout(opt, map), opt->cmdflags);
+}
+
+static int
+lpm_net_uadt(struct ip_set *set, struct nlattr *tb[],
+	     enum ipset_adt adt, u32 *lineno, u32 flags, bool retried)
+{
+	const struct lpm_net *map = set->data;
+	ipset_adtfn adtfn = set->variant->adt[adt];
+	struct lpm_net_elem e = { .cidr = map->host_mask };
+	u32 timeout = map->timeout;
+	u32 ip, ip_to, last;
+	int ret;
+
+	if (unlikely(!tb[IPSET_ATTR_IP] ||
+		     !ip_set_optattr_netorder(tb, IPSET_ATTR_TIMEOUT) ||
+		     !ip_set_optattr_netorder(tb, IPSET_ATTR_CADT_FLAGS)))
+		return -IPSET_ERR_PROTOCOL;
+	if (unlikely(tb[IPSET_ATTR_IP_TO] && map->host_mask != 32))
+		return -IPSET_ERR_HASH_RANGE_UNSUPPORTED;
+
+	if (tb[IPSET_ATTR_LINENO])
+		*lineno = nla_get_u32(tb[IPSET_ATTR_LINENO]);
+
+	if (map->host_mask == 32)
+		ret = ip_set_get_ipaddr4(tb[IPSET_ATTR_IP], &e.ip.ip);
+	else
+		ret = ip_set_get_ipaddr6(tb[IPSET_ATTR_IP], &e.ip);
+	if (ret)
+		return ret;
+
+	if (tb[IPSET_ATTR_CIDR]) {
+		e.cidr = nla_get_u8(tb[IPSET_ATTR_CIDR]);
+		if (!e.cidr || e.cidr > map->host_mask)
+			return -IPSET_ERR_INVALID_CIDR;
+	}
+
+	if (tb[IPSET_ATTR_TIMEOUT]) {
+		if (!with_timeout(map->timeout))
+			return -IPSET_ERR_TIMEOUT;
+		timeout = ip_set_timeout_uget(tb[IPSET_ATTR_TIMEOUT]);
+	}
+
+	if (tb[IPSET_ATTR_CADT_FLAGS] && adt == IPSET_ADD) {
+		u32 cadt_flags = ip_set_get_h32(tb[IPSET_ATTR_CADT_FLAGS]);
+		if (cadt_flags & IPSET_FLAG_NOMATCH)
+			flags |= (cadt_flags << 16);
+	}
+
+	if (adt == IPSET_TEST || !tb[IPSET_ATTR_IP_TO]) {
+		lpm_net_netmask(&e.ip, e.cidr, map->host_mask);
+		ret = adtfn(set, &e, timeout, flags);
+		return ip_set_eexist(ret, flags) ? 0 : ret;
+	}
+
+	ip = ntohl(e.ip.ip);
+	ret = ip_set_get_hostipaddr4(tb[IPSET_ATTR_IP_TO], &ip_to);
+	if (ret)
+		return ret;
+	if (ip_to < ip)
+		swap(ip, ip_to);
+	if (ip + UINT_MAX == ip_to)
+		return -IPSET_ERR_HASH_RANGE;
+
+	while (!after(ip, ip_to)) {
+		e.ip.ip = htonl(ip);
+		last = ip_set_range_to_cidr(ip, ip_to, &e.cidr);
+		ret = adtfn(set, &e, timeout, flags);
+		if (ret && !ip_set_eexist(ret, flags))
+			return ret;
+		else
+			ret = 0;
+		ip = last + 1;
+	}
+	return ret;
+}
+
+static void
+lpm_net_flush(struct ip_set *set)
+{
+	lpm_net_prune(set->data, true);
+}
+
+static void
+lpm_net_destroy(struct ip_set *set)
+{
+	struct lpm_net *map = set->data;
+
+	if (with_timeout(map->timeout))
+		del_timer_sync(&map->gc);
+
+	lpm_net_prune(map, true);
+	kfree(map->walk);
+	kfree(map);
+
+	set->data = NULL;
+}
+
+static int
+lpm_net_head(struct ip_set *set, struct sk_buff *skb)
+{
+	const struct lpm_net *map = set->data;
+	struct nlattr *nested;
+
+	nested = ipset_nest_start(skb, IPSET_ATTR_DATA);
+	if (!nested)
+		goto nla_put_failure;
+	if (nla_put_net32(skb, IPSET_ATTR_MAXELEM, htonl(map->maxelem)) ||
+	    nla_put_net32(skb, IPSET_ATTR_REFERENCES, htonl(set->ref - 1)) ||
+	    nla_put_net32(skb, IPSET_ATTR_MEMSIZE,
+			  htonl(sizeof(*map) + map->memsize)) ||
+	    (with_timeout(map->timeout) &&
+	     nla_put_net32(skb, IPSET_ATTR_TIMEOUT, htonl(map->timeout))))
+		goto nla_put_failure;
+	ipset_nest_end(skb, nested);
+
+	return 0;
+nla_put_failure:
+	return -EMSGSIZE;
+}
+
+static bool
+lpm_net_same_set(const struct ip_set *a, const struct ip_set *b)
+{
+	const struct lpm_net *x = a->data;
+	const struct lpm_net *y = b->data;
+
+	return x->maxelem == y->maxelem &&
+	       x->timeout == y->timeout;
+}
+
+static const struct ip_set_type_variant lpm_net_variant = {
+	.kadt	= lpm_net_kadt,
+	.uadt	= lpm_net_uadt,
+	.adt	= {
+		[IPSET_ADD] = lpm_net_add,
+		[IPSET_DEL] = lpm_net_del,
+		[IPSET_TEST] = lpm_net_test,
+	},
+	.destroy = lpm_net_destroy,
+	.flush	= lpm_net_flush,
+	.head	= lpm_net_head,
+	.list	= lpm_net_list,
+	.same_set = lpm_net_same_set,
+};
+
+static void
+lpm_net_gc(unsigned long ul_set)
+{
+	struct ip_set *set = (struct ip_set *) ul_set;
+	struct lpm_net *map = set->data;
+
+	write_lock_bh(&set->lock);
+	lpm_net_prune(map, false);
+	write_unlock_bh(&set->lock);
+
+	map->gc.expires = jiffies + IPSET_GC_PERIOD(map->timeout) * HZ;
+	add_timer(&map->gc);
+}
+
+static void
+lpm_net_gc_init(struct ip_set *set)
+{
+	struct lpm_net *map = set->data;
+
+	init_timer(&map->gc);
+	map->gc.data = (unsigned long) set;
+	map->gc.function = lpm_net_gc;
+	map->gc.expires = jiffies + IPSET_GC_PERIOD(map->timeout) * HZ;
+	add_timer(&map->gc);
+}
+
+/* Create lpm:net type of sets */
+
+static int
+lpm_net_create(struct ip_set *set, struct nlattr *tb[], u32 flags)
+{
+	struct lpm_net *map;
+
+	if (!(set->family == NFPROTO_IPV4 || set->family == NFPROTO_IPV6))
+		return -IPSET_ERR_INVALID_FAMILY;
+
+	if (unlikely(!ip_set_optattr_netorder(tb, IPSET_ATTR_MAXELEM) ||
+		     !ip_set_optattr_netorder(tb, IPSET_ATTR_TIMEOUT)))
+		return -IPSET_ERR_PROTOCOL;
+
+	map = kzalloc(sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return -ENOMEM;
+
+	map->host_mask = set->family == NFPROTO_IPV4 ? 32 : 128;
+	/* A slot for every level plus the empty child of the deepest node */
+	map->walk = kcalloc(map->host_mask + 2, sizeof(*map->walk),
+			    GFP_KERNEL);
+	if (!map->walk) {
+		kfree(map);
+		return -ENOMEM;
+	}
+	map->maxelem = IPSET_DEFAULT_MAXELEM;
+	if (tb[IPSET_ATTR_MAXELEM])
+		map->maxelem = ip_set_get_h32(tb[IPSET_ATTR_MAXELEM]);
+	map->timeout = IPSET_NO_TIMEOUT;
+
+	set->data = map;
+	set->variant = &lpm_net_variant;
+
+	if (tb[IPSET_ATTR_TIMEOUT]) {
+		map->timeout = ip_set_timeout_uget(tb[IPSET_ATTR_TIMEOUT]);
+		lpm_net_gc_init(set);
+	}
+
+	pr_debug("create %s maxelem %u: %p\n",
+		 set->name, map->maxelem, set->data);
+
+	return 0;
+}
+
+static struct ip_set_type lpm_net_type __read_mostly = {
+	.name		= "lpm:net",
+	.protocol	= IPSET_PROTOCOL,
+	.features	= IPSET_TYPE_IP | IPSET_TYPE_NOMATCH,
+	.dimension	= IPSET_DIM_ONE,
+	.family		= NFPROTO_UNSPEC,
+	.revision_min	= REVISION_MIN,
+	.revision_max	= REVISION_MAX,
+	.create		= lpm_net_create,
+	.create_policy	= {
+		[IPSET_ATTR_MAXELEM]	= { .type = NLA_U32 },
+		[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
+	},
+	.adt_policy	= {
+		[IPSET_ATTR_IP]		= { .type = NLA_NESTED },
+		[IPSET_ATTR_IP_TO]	= { .type = NLA_NESTED },
+		[IPSET_ATTR_CIDR]	= { .type = NLA_U8 },
+		[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
+		[IPSET_ATTR_CADT_FLAGS]	= { .type = NLA_U32 },
+		[IPSET_ATTR_LINENO]	= { .type = NLA_U32 },
+	},
+	.me		= THIS_MODULE,
+};
+
+static int __init
+lpm_net_init(void)
+{
+	return ip_set_type_register(&lpm_net_type);
+}
+
+static void __exit
+lpm_net_fini(void)
+{
+	ip_set_type_unregister(&lpm_net_type);
+}
+
+module_init(lpm_net_init);
+module_exit(lpm_net_fini);
@@ -36,6 +36,8 @@
 #include <linux/seq_file.h>
 #include <linux/jhash.h>
 #include <linux/random.h>
+#include <linux/seqlock.h>
+#include <linux/rculist.h>
 
 #include <net/net_namespace.h>
 #include <net/ip_vs.h>
@@ -72,6 +74,12 @@ static unsigned int ip_vs_conn_rnd __read_mostly;
 
 /*
  *  Fine locking granularity for big connection hash table
+ *
+ *  The packet path looks connections up without locking: the entries
+ *  are allocated from a SLAB_DESTROY_BY_RCU cache, a reference is taken
+ *  only while refcnt is not zero and the entry is checked again after
+ *  that. The seqcount of the lock is bumped on every (un)hash, so that
+ *  a reader which walked a changing chain retries instead of missing.
  */
 #define CT_LOCKARRAY_BITS  5
 #define CT_LOCKARRAY_SIZE  (1<<CT_LOCKARRAY_BITS)
@@ -80,6 +88,7 @@ static unsigned int ip_vs_conn_rnd __read_mostly;
 struct ip_vs_aligned_lock
 {
 	rwlock_t	l;
+	seqcount_t	seq;
 } __attribute__((__aligned__(SMP_CACHE_BYTES)));
 
 /* lock array for conn table */
@@ -126,6 +135,31 @@ static inline void ct_write_unlock_bh(unsigned int key)
 	write_unlock_bh(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
 }
 
+static inline unsigned int ct_read_seqbegin(unsigned int key)
+{
+	return read_seqcount_begin(
+		&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].seq);
+}
+
+static inline int ct_read_seqretry(unsigned int key, unsigned int seq)
+{
+	return read_seqcount_retry(
+		&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].seq, seq);
+}
+
+/* Called with the write lock of key held */
+static inline void ct_write_seqbegin(unsigned int key)
+{
+	write_seqcount_begin(
+		&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].seq);
+}
+
+static inline void ct_write_seqend(unsigned int key)
+{
+	write_seqcount_end(
+		&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].seq);
+}
+
 
 /*
  *	Returns hash value for IPVS connection entry
@@ -201,9 +235,11 @@ static inline int ip_vs_conn_hash(struct ip_vs_conn *cp)
 	spin_lock(&cp->lock);
 
 	if (!(cp->flags & IP_VS_CONN_F_HASHED)) {
-		hlist_add_head(&cp->c_list, &ip_vs_conn_tab[hash]);
+		ct_write_seqbegin(hash);
 		cp->flags |= IP_VS_CONN_F_HASHED;
 		atomic_inc(&cp->refcnt);
+		hlist_add_head_rcu(&cp->c_list, &ip_vs_conn_tab[hash]);
+		ct_write_seqend(hash);
 		ret = 1;
 	} else {
 		pr_err("%s(): request for already hashed, called from %pF\n",
@@ -234,9 +270,11 @@ static inline int ip_vs_conn_unhash(struct ip_vs_conn *cp)
 	spin_lock(&cp->lock);
 
 	if (cp->flags & IP_VS_CONN_F_HASHED) {
-		hlist_del(&cp->c_list);
+		ct_write_seqbegin(hash);
+		hlist_del_rcu(&cp->c_list);
 		cp->flags &= ~IP_VS_CONN_F_HASHED;
 		atomic_dec(&cp->refcnt);
+		ct_write_seqend(hash);
 		ret = 1;
 	} else
 		ret = 0;
@@ -249,42 +287,69 @@ static inline int ip_vs_conn_unhash(struct ip_vs_conn *cp)
 
 
 /*
- *  Gets ip_vs_conn associated with supplied parameters in the ip_vs_conn_tab.
- *  Called for pkts coming from OUTside-to-INside.
- *	p->caddr, p->cport: pkt source address (foreign host)
- *	p->vaddr, p->vport: pkt dest address (load balancer)
+ *  Walks the hash chain without locks and returns the entry matched by
+ *  match() with a reference held. The entry can be freed and reused
+ *  under us, so it is matched again once it can not go away anymore.
  */
 static inline struct ip_vs_conn *
-__ip_vs_conn_in_get(const struct ip_vs_conn_param *p)
+__ip_vs_conn_get_rcu(unsigned int hash, const struct ip_vs_conn_param *p,
+		     bool (*match)(const struct ip_vs_conn_param *,
+				   const struct ip_vs_conn *))
 {
-	unsigned int hash;
 	struct ip_vs_conn *cp;
 	struct hlist_node *n;
+	unsigned int seq;
 
-	hash = ip_vs_conn_hashkey_param(p, false);
-
-	ct_read_lock(hash);
-
-	hlist_for_each_entry(cp, n, &ip_vs_conn_tab[hash], c_list) {
-		if (cp->af == p->af &&
-		    p->cport == cp->cport && p->vport == cp->vport &&
-		    ip_vs_addr_equal(p->af, p->caddr, &cp->caddr) &&
-		    ip_vs_addr_equal(p->af, p->vaddr, &cp->vaddr) &&
-		    ((!p->cport) ^ (!(cp->flags & IP_VS_CONN_F_NO_CPORT))) &&
-		    p->protocol == cp->protocol &&
-		    ip_vs_conn_net_eq(cp, p->net)) {
-			/* HIT */
-			atomic_inc(&cp->refcnt);
-			ct_read_unlock(hash);
-			return cp;
+	rcu_read_lock();
+restart:
+	seq = ct_read_seqbegin(hash);
+	hlist_for_each_entry_rcu(cp, n, &ip_vs_conn_tab[hash], c_list) {
+		if (!match(p, cp))
+			continue;
+		if (!atomic_inc_not_zero(&cp->refcnt))
+			goto restart;
+		if (unlikely(!(cp->flags & IP_VS_CONN_F_HASHED) ||
+			     !match(p, cp))) {
+			__ip_vs_conn_put(cp);
+			goto restart;
 		}
+		/* HIT */
+		rcu_read_unlock();
+		return cp;
 	}
-
-	ct_read_unlock(hash);
+	if (ct_read_seqretry(hash, seq))
+		goto restart;
+	rcu_read_unlock();
 
 	return NULL;
 }
 
+static inline bool
+ip_vs_conn_in_match(const struct ip_vs_conn_param *p,
+		    const struct ip_vs_conn *cp)
+{
+	return cp->af == p->af &&
+	       p->cport == cp->cport && p->vport == cp->vport &&
+	       ip_vs_addr_equal(p->af, p->caddr, &cp->caddr) &&
+	       ip_vs_addr_equal(p->af, p->vaddr, &cp->vaddr) &&
+	       ((!p->cport) ^ (!(cp->flags & IP_VS_CONN_F_NO_CPORT))) &&
+	       p->protocol == cp->protocol &&
+	       ip_vs_conn_net_eq(cp, p->net);
+}
+
+/*
+ *  Gets ip_vs_conn associated with supplied parameters in the ip_vs_conn_tab.
+ *  Called for pkts coming from OUTside-to-INside.
+ *	p->caddr, p->cport: pkt source address (foreign host)
+ *	p->vaddr, p->vport: pkt dest address (load balancer)
+ */
+static inline struct ip_vs_conn *
+__ip_vs_conn_in_get(const struct ip_vs_conn_param *p)
+{
+	return __ip_vs_conn_get_rcu(ip_vs_conn_hashkey_param(p, false), p,
+				    ip_vs_conn_in_match);
+}
+
 struct ip_vs_conn *ip_vs_conn_in_get(const struct ip_vs_conn_param *p)
 {
 	struct ip_vs_conn *cp;
@@ -390,34 +455,27 @@ struct ip_vs_conn *ip_vs_ct_in_get(const struct ip_vs_conn_param *p)
  * Called for pkts coming from inside-to-OUTside.
  *	p->caddr, p->cport: pkt source address (inside host)
  *	p->vaddr, p->vport: pkt dest address (foreign host) */
+static inline bool
+ip_vs_conn_out_match(const struct ip_vs_conn_param *p,
+		     const struct ip_vs_conn *cp)
+{
+	return cp->af == p->af &&
+	       p->vport == cp->cport && p->cport == cp->dport &&
+	       ip_vs_addr_equal(p->af, p->vaddr, &cp->caddr) &&
+	       ip_vs_addr_equal(p->af, p->caddr, &cp->daddr) &&
+	       p->protocol == cp->protocol &&
+	       ip_vs_conn_net_eq(cp, p->net);
+}
+
 struct ip_vs_conn *ip_vs_conn_out_get(const struct ip_vs_conn_param *p)
 {
-	unsigned int hash;
-	struct ip_vs_conn *cp, *ret=NULL;
-	struct hlist_node *n;
+	struct ip_vs_conn *ret;
 
 	/*
 	 *	Check for "full" addressed entries
 	 */
-	hash = ip_vs_conn_hashkey_param(p, true);
-
-	ct_read_lock(hash);
-
-	hlist_for_each_entry(cp, n, &ip_vs_conn_tab[hash], c_list) {
-		if (cp->af == p->af &&
-		    p->vport == cp->cport && p->cport == cp->dport &&
-		    ip_vs_addr_equal(p->af, p->vaddr, &cp->caddr) &&
-		    ip_vs_addr_equal(p->af, p->caddr, &cp->daddr) &&
-		    p->protocol == cp->protocol &&
-		    ip_vs_conn_net_eq(cp, p->net)) {
-			/* HIT */
-			atomic_inc(&cp->refcnt);
-			ret = cp;
-			break;
-		}
-	}
-
-	ct_read_unlock(hash);
+	ret = __ip_vs_conn_get_rcu(ip_vs_conn_hashkey_param(p, true), p,
+				   ip_vs_conn_out_match);
 
 	IP_VS_DBG_BUF(9, "lookup/out %s %s:%d->%s:%d %s\n",
 		      ip_vs_proto_name(p->protocol),
@@ -792,9 +850,10 @@ static void ip_vs_conn_expire(unsigned long data)
 		goto expire_later;
 
 	/*
-	 *	refcnt==1 implies I'm the only one referrer
+	 *	refcnt==1 implies I'm the only one referrer. Lockless lookups
+	 *	take references only while refcnt is not zero.
 	 */
-	if (likely(atomic_read(&cp->refcnt) == 1)) {
+	if (likely(atomic_cmpxchg(&cp->refcnt, 1, 0) == 1)) {
 		/* delete the timer if it is activated by other users */
 		if (timer_pending(&cp->timer))
 			del_timer(&cp->timer);
@@ -894,8 +953,10 @@ ip_vs_conn_new(const struct ip_vs_conn_param *p,
 	/*
 	 * Set the entry is referenced by the current thread before hashing
 	 * it in the table, so that other thread run ip_vs_random_dropentry
-	 * but cannot drop this entry.
+	 * but cannot drop this entry. Lockless lookups which still see this
+	 * memory as a freed entry must see the new keys first.
 	 */
+	smp_wmb();
 	atomic_set(&cp->refcnt, 1);
 
 	atomic_set(&cp->n_control, 0);
@@ -1323,7 +1384,8 @@ int __init ip_vs_conn_init(void)
 	/* Allocate ip_vs_conn slab cache */
 	ip_vs_conn_cachep = kmem_cache_create("ip_vs_conn",
 					      sizeof(struct ip_vs_conn), 0,
-					      SLAB_HWCACHE_ALIGN, NULL);
+					      SLAB_HWCACHE_ALIGN |
+					      SLAB_DESTROY_BY_RCU, NULL);
 	if (!ip_vs_conn_cachep) {
 		vfree(ip_vs_conn_tab);
 		return -ENOMEM;
@@ -1341,6 +1403,7 @@ int __init ip_vs_conn_init(void)
 
 	for (idx = 0; idx < CT_LOCKARRAY_SIZE; idx++)  {
 		rwlock_init(&__ip_vs_conntbl_lock_array[idx].l);
+		seqcount_init(&__ip_vs_conntbl_lock_array[idx].seq);
 	}
 
 	/* calculate the random value for connection hash */
@@ -36,6 +36,7 @@
 #include <linux/netfilter.h>
 #include <linux/netfilter_ipv4.h>
 #include <linux/mutex.h>
+#include <linux/lglock.h>
 
 #include <net/net_namespace.h>
 #include <linux/nsproxy.h>
@@ -55,8 +56,36 @@
 /* semaphore for IPVS sockopts. And, [gs]etsockopt may sleep. */
 static DEFINE_MUTEX(__ip_vs_mutex);
 
-/* lock for service table */
-static DEFINE_RWLOCK(__ip_vs_svc_lock);
+/*
+ * lock for service table: every packet looks up its service, so readers
+ * only take the lock of their own CPU and writers take the locks of all
+ * CPUs, instead of bouncing a single rwlock between the CPUs.
+ */
+static DEFINE_STATIC_LGLOCK(__ip_vs_svc_lock);
+
+static inline void svc_read_lock_bh(void)
+{
+	local_bh_disable();
+	lg_local_lock(&__ip_vs_svc_lock);
+}
+
+static inline void svc_read_unlock_bh(void)
+{
+	lg_local_unlock(&__ip_vs_svc_lock);
+	local_bh_enable();
+}
+
+static inline void svc_write_lock_bh(void)
+{
+	local_bh_disable();
+	lg_global_lock(&__ip_vs_svc_lock);
+}
+
+static inline void svc_write_unlock_bh(void)
+{
+	lg_global_unlock(&__ip_vs_svc_lock);
+	local_bh_enable();
+}
 
 /* sysctl variables */
 
@@ -412,7 +441,7 @@ ip_vs_service_get(struct net *net, int af, __u32 fwmark, __u16 protocol,
 	struct ip_vs_service *svc;
 	struct netns_ipvs *ipvs = net_ipvs(net);
 
-	read_lock(&__ip_vs_svc_lock);
+	svc_read_lock_bh();
 
 	/*
 	 *	Check the table hashed by fwmark first
@@ -451,7 +480,7 @@ ip_vs_service_get(struct net *net, int af, __u32 fwmark, __u16 protocol,
   out:
 	if (svc)
 		atomic_inc(&svc->usecnt);
-	read_unlock(&__ip_vs_svc_lock);
+	svc_read_unlock_bh();
 
 	IP_VS_DBG_BUF(9, "lookup service: fwm %u %s %s:%u %s\n",
 		      fwmark, ip_vs_proto_name(protocol),
@@ -815,7 +844,7 @@ __ip_vs_update_dest(struct ip_vs_service *svc, struct ip_vs_dest *dest,
 	if (add)
 		ip_vs_start_estimator(svc->net, &dest->stats);
 
-	write_lock_bh(&__ip_vs_svc_lock);
+	svc_write_lock_bh();
 
 	/* Wait until all other svc users go away */
 	IP_VS_WAIT_WHILE(atomic_read(&svc->usecnt) > 0);
@@ -829,7 +858,7 @@ __ip_vs_update_dest(struct ip_vs_service *svc, struct ip_vs_dest *dest,
 	if (svc->scheduler->update_service)
 		svc->scheduler->update_service(svc);
 
-	write_unlock_bh(&__ip_vs_svc_lock);
+	svc_write_unlock_bh();
 }
 
 
@@ -1097,7 +1126,7 @@ ip_vs_del_dest(struct ip_vs_service *svc, struct ip_vs_dest_user_kern *udest)
 		return -ENOENT;
 	}
 
-	write_lock_bh(&__ip_vs_svc_lock);
+	svc_write_lock_bh();
 
 	/*
 	 *	Wait until all other svc users go away.
@@ -1109,7 +1138,7 @@ ip_vs_del_dest(struct ip_vs_service *svc, struct ip_vs_dest_user_kern *udest)
 	 */
 	__ip_vs_unlink_dest(svc, dest, 1);
 
-	write_unlock_bh(&__ip_vs_svc_lock);
+	svc_write_unlock_bh();
 
 	/*
 	 *	Delete the destination
@@ -1216,9 +1245,9 @@ ip_vs_add_service(struct net *net, struct ip_vs_service_user_kern *u,
 		ipvs->num_services++;
 
 	/* Hash the service into the service table */
-	write_lock_bh(&__ip_vs_svc_lock);
+	svc_write_lock_bh();
 	ip_vs_svc_hash(svc);
-	write_unlock_bh(&__ip_vs_svc_lock);
+	svc_write_unlock_bh();
 
 	*svc_p = svc;
 	/* Now there is a service - full throttle */
@@ -1286,7 +1315,7 @@ ip_vs_edit_service(struct ip_vs_service *svc, struct ip_vs_service_user_kern *u)
 	}
 #endif
 
-	write_lock_bh(&__ip_vs_svc_lock);
+	svc_write_lock_bh();
 
 	/*
 	 * Wait until all other svc users go away.
@@ -1337,7 +1366,7 @@ ip_vs_edit_service(struct ip_vs_service *svc, struct ip_vs_service_user_kern *u)
 	}
 
 out_unlock:
-	write_unlock_bh(&__ip_vs_svc_lock);
+	svc_write_unlock_bh();
 out:
 	ip_vs_scheduler_put(old_sched);
 	ip_vs_pe_put(old_pe);
@@ -1421,7 +1450,7 @@ static void ip_vs_unlink_service(struct ip_vs_service *svc)
 	/*
 	 * Unhash it from the service table
 	 */
-	write_lock_bh(&__ip_vs_svc_lock);
+	svc_write_lock_bh();
 
 	ip_vs_svc_unhash(svc);
 
@@ -1432,7 +1461,7 @@ static void ip_vs_unlink_service(struct ip_vs_service *svc)
 
 	__ip_vs_del_service(svc);
 
-	write_unlock_bh(&__ip_vs_svc_lock);
+	svc_write_unlock_bh();
 }
 
 /*
@@ -1568,12 +1597,12 @@ static int ip_vs_zero_service(struct ip_vs_service *svc)
 {
 	struct ip_vs_dest *dest;
 
-	write_lock_bh(&__ip_vs_svc_lock);
+	svc_write_lock_bh();
 	list_for_each_entry(dest, &svc->destinations, n_list) {
 		ip_vs_zero_stats(&dest->stats);
 	}
 	ip_vs_zero_stats(&svc->stats);
-	write_unlock_bh(&__ip_vs_svc_lock);
+	svc_write_unlock_bh();
 	return 0;
 }
 
@@ -1972,7 +2001,7 @@ static void *ip_vs_info_seq_start(struct seq_file *seq, loff_t *pos)
 __acquires(__ip_vs_svc_lock)
 {
 
-	read_lock_bh(&__ip_vs_svc_lock);
+	svc_read_lock_bh();
 	return *pos ? ip_vs_info_array(seq, *pos - 1) : SEQ_START_TOKEN;
 }
 
@@ -2025,7 +2054,7 @@ static void *ip_vs_info_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 static void ip_vs_info_seq_stop(struct seq_file *seq, void *v)
 __releases(__ip_vs_svc_lock)
 {
-	read_unlock_bh(&__ip_vs_svc_lock);
+	svc_read_unlock_bh();
 }
 
 
@@ -3869,6 +3898,7 @@ int __init ip_vs_control_init(void)
 		INIT_LIST_HEAD(&ip_vs_svc_table[idx]);
 		INIT_LIST_HEAD(&ip_vs_svc_fwm_table[idx]);
 	}
+	lg_lock_init(&__ip_vs_svc_lock, "ip_vs_svc_lock");
 
 	smp_wmb();	/* Do we really need it now ? */
 
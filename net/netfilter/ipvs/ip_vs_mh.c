@@ -0,0 +1,404 @@
+/*
+ * IPVS:        Maglev Hashing scheduling module
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ *
+ * Changes:
+ *
+ */
+
+/*
+ * The mh algorithm assigns a preference list of all the lookup table
+ * positions to each destination and populates the table with the most
+ * preferred position of each destination, round by round, until every
+ * position is owned. Then it selects a destination by looking up the
+ * table with the hash key of the source IP address:
+ *
+ *       n <- lookup[hash(src_ip) % M];
+ *       while (n is dead) OR (n is overloaded) do
+ *                 n <- next entry of the lookup table;
+ *
+ *       return n;
+ *
+ * M is a prime, so that the preference list of a destination, built
+ * from an offset and a skip derived from the hash of its address and
+ * port, is a permutation of all the table positions. When a
+ * destination is added or removed, only about 1/N of the positions
+ * change owner, so most connections keep their server without any
+ * per-connection state.
+ *
+ * The hash functions use fixed seeds: every director configured with
+ * the same destinations builds the same table and thus makes the same
+ * choice, without having to synchronize connections.
+ *
+ * The weight destination attribute controls how many positions a
+ * destination claims per round. Destinations with weight 0 claim none.
+ *
+ * Reference: Eisenbud et al., "Maglev: A Fast and Reliable Software
+ * Network Load Balancer", NSDI 2016.
+ *
+ */
+
+#define KMSG_COMPONENT "IPVS"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/ip.h>
+#include <linux/slab.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/skbuff.h>
+#include <linux/jhash.h>
+#include <linux/gcd.h>
+
+#include <net/ip_vs.h>
+
+
+/*
+ *      IPVS MH lookup table entry
+ */
+struct ip_vs_mh_lookup {
+	struct ip_vs_dest       *dest;          /* real server */
+};
+
+/*
+ *      Permutation state of a destination while populating the table
+ */
+struct ip_vs_mh_dest_setup {
+	unsigned int            next;           /* next preferred position */
+	unsigned int            skip;           /* permutation step */
+	int                     turns;          /* positions per round */
+};
+
+/*
+ *     for IPVS MH lookup table, the size must be a prime
+ */
+#ifndef CONFIG_IP_VS_MH_TAB_INDEX
+#define CONFIG_IP_VS_MH_TAB_INDEX       12
+#endif
+#define IP_VS_MH_TAB_INDEX              (CONFIG_IP_VS_MH_TAB_INDEX - 8)
+#define IP_VS_MH_TAB_SIZE               ip_vs_mh_primes[IP_VS_MH_TAB_INDEX]
+
+static const unsigned int ip_vs_mh_primes[] = {
+	251, 509, 1021, 2039, 4093, 8191, 16381, 32749, 65521, 131071
+};
+
+/* Fixed seeds, see above */
+#define IP_VS_MH_SEED_OFFSET            0x1b873593
+#define IP_VS_MH_SEED_SKIP              0xcc9e2d51
+#define IP_VS_MH_SEED_LOOKUP            0x85ebca6b
+
+
+/*
+ *	Returns hash value of an address and port for the given seed
+ */
+static inline unsigned int
+ip_vs_mh_hashkey(int af, const union nf_inet_addr *addr, __be16 port,
+		 u32 seed)
+{
+#ifdef CONFIG_IP_VS_IPV6
+	if (af == AF_INET6)
+		return jhash2((const u32 *)addr->ip6, 4,
+			      seed ^ (__force u32)port);
+#endif
+	return jhash_2words((__force u32)addr->ip, (__force u32)port, seed);
+}
+
+
+/*
+ *      Get ip_vs_dest associated with supplied parameters.
+ */
+static inline struct ip_vs_dest *
+ip_vs_mh_get(int af, struct ip_vs_mh_lookup *tbl,
+	     const union nf_inet_addr *addr)
+{
+	unsigned int i;
+
+	i = ip_vs_mh_hashkey(af, addr, 0, IP_VS_MH_SEED_LOOKUP) %
+	    IP_VS_MH_TAB_SIZE;
+	return tbl[i].dest;
+}
+
+
+/*
+ *      Returns the weight divisor giving the number of table positions
+ *      a destination claims per round, or 0 if no destination has a
+ *      positive weight.
+ */
+static int ip_vs_mh_weight_div(struct ip_vs_service *svc)
+{
+	struct ip_vs_dest *dest;
+	int weight, mw = 0;
+	int g = 0;
+	unsigned int limit;
+
+	list_for_each_entry(dest, &svc->destinations, n_list) {
+		weight = atomic_read(&dest->weight);
+		if (weight > 0) {
+			g = g > 0 ? gcd(weight, g) : weight;
+			if (weight > mw)
+				mw = weight;
+		}
+	}
+	if (!g)
+		return 0;
+
+	/* Keep a round within the table, so that a heavy destination
+	 * can not starve the others of positions.
+	 */
+	limit = max_t(unsigned int, IP_VS_MH_TAB_SIZE / svc->num_dests, 1);
+	while (mw / g > limit)
+		g <<= 1;
+	return g;
+}
+
+
+/*
+ *      Flush all the entries of the specified table.
+ */
+static void ip_vs_mh_flush(struct ip_vs_mh_lookup *tbl)
+{
+	int i;
+	struct ip_vs_mh_lookup *l;
+
+	l = tbl;
+	for (i = 0; i < IP_VS_MH_TAB_SIZE; i++) {
+		if (l->dest) {
+			atomic_dec(&l->dest->refcnt);
+			l->dest = NULL;
+		}
+		l++;
+	}
+}
+
+
+/*
+ *      Assign all the lookup table entries of the specified table with
+ *      the service.
+ */
+static int
+ip_vs_mh_assign(struct ip_vs_mh_lookup *tbl, struct ip_vs_service *svc)
+{
+	struct ip_vs_mh_dest_setup *setup, *ds;
+	struct ip_vs_dest *dest;
+	unsigned int size = IP_VS_MH_TAB_SIZE;
+	unsigned int n, c;
+	int div;
+	int t;
+
+	div = svc->num_dests ? ip_vs_mh_weight_div(svc) : 0;
+	if (!div) {
+		ip_vs_mh_flush(tbl);
+		return 0;
+	}
+
+	/* update_service runs with the service table write locked. On
+	 * failure, the old table is kept: removed and quiesced
+	 * destinations in it are skipped by the scheduler.
+	 */
+	setup = kcalloc(svc->num_dests, sizeof(*setup), GFP_ATOMIC);
+	if (setup == NULL)
+		return -ENOMEM;
+	ip_vs_mh_flush(tbl);
+
+	ds = setup;
+	list_for_each_entry(dest, &svc->destinations, n_list) {
+		ds->next = ip_vs_mh_hashkey(svc->af, &dest->addr, dest->port,
+					    IP_VS_MH_SEED_OFFSET) % size;
+		ds->skip = ip_vs_mh_hashkey(svc->af, &dest->addr, dest->port,
+					    IP_VS_MH_SEED_SKIP) % (size - 1) + 1;
+		ds->turns = atomic_read(&dest->weight) > 0 ?
+			    max(atomic_read(&dest->weight) / div, 1) : 0;
+		ds++;
+	}
+
+	n = 0;
+	while (n < size) {
+		ds = setup;
+		list_for_each_entry(dest, &svc->destinations, n_list) {
+			for (t = 0; t < ds->turns; t++) {
+				/* Claim the most preferred free position */
+				c = ds->next;
+				while (tbl[c].dest) {
+					c += ds->skip;
+					if (c >= size)
+						c -= size;
+				}
+				ds->next = c + ds->skip;
+				if (ds->next >= size)
+					ds->next -= size;
+
+				atomic_inc(&dest->refcnt);
+				tbl[c].dest = dest;
+
+				IP_VS_DBG_BUF(6, "assigned i: %u dest: %s "
+					      "weight: %d\n",
+					      c, IP_VS_DBG_ADDR(svc->af,
+								&dest->addr),
+					      atomic_read(&dest->weight));
+
+				if (++n == size)
+					goto out;
+			}
+			ds++;
+		}
+	}
+
+out:
+	kfree(setup);
+	return 0;
+}
+
+
+static int ip_vs_mh_init_svc(struct ip_vs_service *svc)
+{
+	struct ip_vs_mh_lookup *tbl;
+
+	/* allocate the MH table for this service */
+	tbl = kcalloc(IP_VS_MH_TAB_SIZE, sizeof(struct ip_vs_mh_lookup),
+		      GFP_KERNEL);
+	if (tbl == NULL)
+		return -ENOMEM;
+
+	svc->sched_data = tbl;
+	IP_VS_DBG(6, "MH lookup table (memory=%Zdbytes) allocated for "
+		  "current service\n",
+		  sizeof(struct ip_vs_mh_lookup)*IP_VS_MH_TAB_SIZE);
+
+	/* assign the lookup table with the current service */
+	if (ip_vs_mh_assign(tbl, svc) < 0) {
+		kfree(tbl);
+		svc->sched_data = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+
+static int ip_vs_mh_done_svc(struct ip_vs_service *svc)
+{
+	struct ip_vs_mh_lookup *tbl = svc->sched_data;
+
+	/* got to clean up table entries here */
+	ip_vs_mh_flush(tbl);
+
+	/* release the table itself */
+	kfree(svc->sched_data);
+	IP_VS_DBG(6, "MH lookup table (memory=%Zdbytes) released\n",
+		  sizeof(struct ip_vs_mh_lookup)*IP_VS_MH_TAB_SIZE);
+
+	return 0;
+}
+
+
+static int ip_vs_mh_update_svc(struct ip_vs_service *svc)
+{
+	struct ip_vs_mh_lookup *tbl = svc->sched_data;
+	int ret;
+
+	/* reassign the lookup table with the updated service */
+	ret = ip_vs_mh_assign(tbl, svc);
+	if (ret < 0)
+		pr_err("%s(): no memory to rebuild the MH lookup table\n",
+		       __func__);
+	return ret;
+}
+
+
+/*
+ *      If the dest flags is set with IP_VS_DEST_F_OVERLOAD,
+ *      consider that the server is overloaded here.
+ */
+static inline int is_overloaded(struct ip_vs_dest *dest)
+{
+	return dest->flags & IP_VS_DEST_F_OVERLOAD;
+}
+
+static inline int is_unavailable(struct ip_vs_dest *dest)
+{
+	return !(dest->flags & IP_VS_DEST_F_AVAILABLE) ||
+	       atomic_read(&dest->weight) <= 0 ||
+	       is_overloaded(dest);
+}
+
+
+/*
+ *      Maglev Hashing scheduling
+ */
+static struct ip_vs_dest *
+ip_vs_mh_schedule(struct ip_vs_service *svc, const struct sk_buff *skb)
+{
+	struct ip_vs_dest *dest;
+	struct ip_vs_mh_lookup *tbl;
+	struct ip_vs_iphdr iph;
+	unsigned int i, n;
+
+	ip_vs_fill_iph_addr_only(svc->af, skb, &iph);
+
+	IP_VS_DBG(6, "ip_vs_mh_schedule(): Scheduling...\n");
+
+	tbl = (struct ip_vs_mh_lookup *)svc->sched_data;
+	dest = ip_vs_mh_get(svc->af, tbl, &iph.saddr);
+	if (dest && !is_unavailable(dest))
+		goto out;
+
+	/* The owner is down or overloaded: fall back to the following
+	 * entries, which every director walks in the same order.
+	 */
+	i = ip_vs_mh_hashkey(svc->af, &iph.saddr, 0, IP_VS_MH_SEED_LOOKUP) %
+	    IP_VS_MH_TAB_SIZE;
+	for (n = 1; n < IP_VS_MH_TAB_SIZE; n++) {
+		if (++i == IP_VS_MH_TAB_SIZE)
+			i = 0;
+		dest = tbl[i].dest;
+		if (dest && !is_unavailable(dest))
+			goto out;
+	}
+
+	ip_vs_scheduler_err(svc, "no destination available");
+	return NULL;
+
+out:
+	IP_VS_DBG_BUF(6, "MH: source IP address %s --> server %s:%d\n",
+		      IP_VS_DBG_ADDR(svc->af, &iph.saddr),
+		      IP_VS_DBG_ADDR(svc->af, &dest->addr),
+		      ntohs(dest->port));
+
+	return dest;
+}
+
+
+/*
+ *      IPVS MH Scheduler structure
+ */
+static struct ip_vs_scheduler ip_vs_mh_scheduler =
+{
+	.name =			"mh",
+	.refcnt =		ATOMIC_INIT(0),
+	.module =		THIS_MODULE,
+	.n_list	 =		LIST_HEAD_INIT(ip_vs_mh_scheduler.n_list),
+	.init_service =		ip_vs_mh_init_svc,
+	.done_service =		ip_vs_mh_done_svc,
+	.update_service =	ip_vs_mh_update_svc,
+	.schedule =		ip_vs_mh_schedule,
+};
+
+
+static int __init ip_vs_mh_init(void)
+{
+	return register_ip_vs_scheduler(&ip_vs_mh_scheduler);
+}
+
+
+static void __exit ip_vs_mh_cleanup(void)
+{
+	unregister_ip_vs_scheduler(&ip_vs_mh_scheduler);
+}
+
+
+module_init(ip_vs_mh_init);
+module_exit(ip_vs_mh_cleanup);
+MODULE_LICENSE("GPL");
@@ -48,6 +48,8 @@
 #include <linux/kthread.h>
 #include <linux/wait.h>
 #include <linux/kernel.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 
 #include <asm/unaligned.h>		/* Used for ntoh_seq and hton_seq */
 
@@ -192,9 +194,22 @@ union ip_vs_sync_conn {
 #define IPVS_OPT_F_PE_NAME	(1 << (IPVS_OPT_PE_NAME-1))
 #define IPVS_OPT_F_PARAM	(1 << (IPVS_OPT_PARAM-1))
 
+/*
+ *	Per-thread counters, reported in /proc/net/ip_vs_sync_threads.
+ *	They are allocated after the ipvs->ms and ipvs->backup_threads
+ *	arrays, one per thread.
+ */
+struct ip_vs_sync_thread_stats {
+	struct socket		*sock;		/* socket of the thread */
+	unsigned long		mesgs;		/* messages sent or received */
+	unsigned long		drops;		/* buffers dropped on full queue */
+	unsigned long		errors;		/* send or receive errors */
+};
+
 struct ip_vs_sync_thread_data {
 	struct net *net;
 	struct socket *sock;
+	struct ip_vs_sync_thread_stats *stats;
 	char *buf;
 	int id;
 };
@@ -294,6 +309,20 @@ static void hton_seq(struct ip_vs_seq *ho, struct ip_vs_seq *no)
 	put_unaligned_be32(ho->previous_delta, &no->previous_delta);
 }
 
+static inline struct ip_vs_sync_thread_stats *
+master_thread_stats(struct netns_ipvs *ipvs)
+{
+	return (struct ip_vs_sync_thread_stats *)
+		&ipvs->ms[ipvs->threads_mask + 1];
+}
+
+static inline struct ip_vs_sync_thread_stats *
+backup_thread_stats(struct netns_ipvs *ipvs)
+{
+	return (struct ip_vs_sync_thread_stats *)
+		&ipvs->backup_threads[ipvs->threads_mask + 1];
+}
+
 static inline struct ip_vs_sync_buff *
 sb_dequeue(struct netns_ipvs *ipvs, struct ipvs_master_sync_state *ms)
 {
@@ -366,8 +395,10 @@ static inline void sb_queue_tail(struct netns_ipvs *ipvs,
 		list_add_tail(&sb->list, &ms->sync_queue);
 		if ((++ms->sync_queue_delay) == IPVS_SYNC_WAKEUP_RATE)
 			wake_up_process(ms->master_thread);
-	} else
+	} else {
+		master_thread_stats(ipvs)[ms - ipvs->ms].drops++;
 		ip_vs_sync_buff_release(sb);
+	}
 	spin_unlock(&ipvs->sync_lock);
 }
 
@@ -1547,16 +1578,14 @@ ip_vs_send_sync_msg(struct socket *sock, struct ip_vs_sync_mesg *msg)
 	int msize;
 	int ret;
 
-	msize = msg->size;
-
-	/* Put size in network byte order */
-	msg->size = htons(msg->size);
+	/* Size is already in network byte order, see next_sync_batch() */
+	msize = ntohs(msg->size);
 
 	ret = ip_vs_send_async(sock, (char *)msg, msize);
 	if (ret >= 0 || ret == -EAGAIN)
 		return ret;
 	pr_err("ip_vs_send_async error %d\n", ret);
-	return 0;
+	return ret;
 }
 
 static int
@@ -1598,17 +1627,58 @@ static void master_wakeup_work_handler(struct work_struct *work)
 	spin_unlock_bh(&ipvs->sync_lock);
 }
 
-/* Get next buffer to send */
-static inline struct ip_vs_sync_buff *
-next_sync_buff(struct netns_ipvs *ipvs, struct ipvs_master_sync_state *ms)
+/*
+ *	Move all the queued buffers to the batch, so that they are sent
+ *	back to back without taking sync_lock for each of them. Returns
+ *	the number of buffers in the batch, *queued is set to how many of
+ *	them came from sync_queue.
+ *
+ *	Those stay counted in sync_queue_len until sync_batch_done(), so
+ *	that sync_qlen_max also bounds what is in flight and the queue
+ *	length reported in /proc includes it.
+ */
+static int next_sync_batch(struct netns_ipvs *ipvs,
+			   struct ipvs_master_sync_state *ms,
+			   struct list_head *batch, int *queued)
 {
 	struct ip_vs_sync_buff *sb;
+	int n;
 
-	sb = sb_dequeue(ipvs, ms);
-	if (sb)
-		return sb;
-	/* Do not delay entries in buffer for more than 2 seconds */
-	return get_curr_sync_buff(ipvs, ms, IPVS_SYNC_FLUSH_TIME);
+	spin_lock_bh(&ipvs->sync_lock);
+	n = ms->sync_queue_len;
+	if (!n) {
+		__set_current_state(TASK_INTERRUPTIBLE);
+	} else {
+		list_splice_tail_init(&ms->sync_queue, batch);
+		ms->sync_queue_delay = 0;
+	}
+	spin_unlock_bh(&ipvs->sync_lock);
+	*queued = n;
+
+	if (!n) {
+		/* Do not delay entries in buffer for more than 2 seconds */
+		sb = get_curr_sync_buff(ipvs, ms, IPVS_SYNC_FLUSH_TIME);
+		if (!sb)
+			return 0;
+		list_add_tail(&sb->list, batch);
+		n = 1;
+	}
+
+	/* Put size in network byte order once, sending may be retried */
+	list_for_each_entry(sb, batch, list)
+		sb->mesg->size = htons(sb->mesg->size);
+	return n;
+}
+
+/* The queued buffers of a batch are gone, sent or released */
+static void sync_batch_done(struct netns_ipvs *ipvs,
+			    struct ipvs_master_sync_state *ms, int queued)
+{
+	if (!queued)
+		return;
+	spin_lock_bh(&ipvs->sync_lock);
+	ms->sync_queue_len -= queued;
+	spin_unlock_bh(&ipvs->sync_lock);
 }
 
 static int sync_thread_master(void *data)
@@ -1616,38 +1686,55 @@ static int sync_thread_master(void *data)
 	struct ip_vs_sync_thread_data *tinfo = data;
 	struct netns_ipvs *ipvs = net_ipvs(tinfo->net);
 	struct ipvs_master_sync_state *ms = &ipvs->ms[tinfo->id];
+	struct ip_vs_sync_thread_stats *st = tinfo->stats;
 	struct sock *sk = tinfo->sock->sk;
-	struct ip_vs_sync_buff *sb;
+	struct ip_vs_sync_buff *sb, *tmp;
+	LIST_HEAD(batch);
+	int queued = 0;
+	int ret;
 
 	pr_info("sync thread started: state = MASTER, mcast_ifn = %s, "
 		"syncid = %d, id = %d\n",
 		ipvs->master_mcast_ifn, ipvs->master_syncid, tinfo->id);
 
 	for (;;) {
-		sb = next_sync_buff(ipvs, ms);
+		ret = next_sync_batch(ipvs, ms, &batch, &queued);
 		if (unlikely(kthread_should_stop()))
 			break;
-		if (!sb) {
+		if (!ret) {
 			schedule_timeout(IPVS_SYNC_CHECK_PERIOD);
 			continue;
 		}
-		while (ip_vs_send_sync_msg(tinfo->sock, sb->mesg) < 0) {
-			int ret = 0;
-
-			__wait_event_interruptible(*sk_sleep(sk),
-						   sock_writeable(sk) ||
-						   kthread_should_stop(),
-						   ret);
-			if (unlikely(kthread_should_stop()))
-				goto done;
+		while (!list_empty(&batch)) {
+			sb = list_first_entry(&batch, struct ip_vs_sync_buff,
+					      list);
+			ret = ip_vs_send_sync_msg(tinfo->sock, sb->mesg);
+			if (ret == -EAGAIN) {
+				ret = 0;
+				__wait_event_interruptible(*sk_sleep(sk),
+						sock_writeable(sk) ||
+						kthread_should_stop(),
+						ret);
+				if (unlikely(kthread_should_stop()))
+					goto done;
+				continue;
+			}
+			if (ret < 0)
+				st->errors++;
+			else
+				st->mesgs++;
+			list_del(&sb->list);
+			ip_vs_sync_buff_release(sb);
 		}
-		ip_vs_sync_buff_release(sb);
+		sync_batch_done(ipvs, ms, queued);
+		queued = 0;
 	}
 
 done:
 	__set_current_state(TASK_RUNNING);
-	if (sb)
+	list_for_each_entry_safe(sb, tmp, &batch, list)
 		ip_vs_sync_buff_release(sb);
+	sync_batch_done(ipvs, ms, queued);
 
 	/* clean up the sync_buff queue */
 	while ((sb = sb_dequeue(ipvs, ms)))
@@ -1687,10 +1774,13 @@ static int sync_thread_backup(void *data)
 			len = ip_vs_receive(tinfo->sock, tinfo->buf,
 					ipvs->recv_mesg_maxlen);
 			if (len <= 0) {
-				if (len != -EAGAIN)
+				if (len != -EAGAIN) {
 					pr_err("receiving message error\n");
+					tinfo->stats->errors++;
+				}
 				break;
 			}
+			tinfo->stats->mesgs++;
 
 			/* disable bottom half, because it accesses the data
 			   shared by softirq while getting/creating conns */
@@ -1713,6 +1803,7 @@ int start_sync_thread(struct net *net, int state, char *mcast_ifn, __u8 syncid)
 {
 	struct ip_vs_sync_thread_data *tinfo;
 	struct task_struct **array = NULL, *task;
+	struct ip_vs_sync_thread_stats *stats;
 	struct socket *sock;
 	struct netns_ipvs *ipvs = net_ipvs(net);
 	char *name;
@@ -1755,9 +1846,11 @@ int start_sync_thread(struct net *net, int state, char *mcast_ifn, __u8 syncid)
 	if (state == IP_VS_STATE_MASTER) {
 		struct ipvs_master_sync_state *ms;
 
-		ipvs->ms = kzalloc(count * sizeof(ipvs->ms[0]), GFP_KERNEL);
+		ipvs->ms = kzalloc(count * (sizeof(ipvs->ms[0]) +
+					    sizeof(*stats)), GFP_KERNEL);
 		if (!ipvs->ms)
 			goto out;
+		stats = master_thread_stats(ipvs);
 		ms = ipvs->ms;
 		for (id = 0; id < count; id++, ms++) {
 			INIT_LIST_HEAD(&ms->sync_queue);
@@ -1768,10 +1861,11 @@ int start_sync_thread(struct net *net, int state, char *mcast_ifn, __u8 syncid)
 			ms->ipvs = ipvs;
 		}
 	} else {
-		array = kzalloc(count * sizeof(struct task_struct *),
-				GFP_KERNEL);
+		array = kzalloc(count * (sizeof(struct task_struct *) +
+					 sizeof(*stats)), GFP_KERNEL);
 		if (!array)
 			goto out;
+		stats = (struct ip_vs_sync_thread_stats *)&array[count];
 	}
 	set_sync_mesg_maxlen(net, state);
 
@@ -1790,6 +1884,8 @@ int start_sync_thread(struct net *net, int state, char *mcast_ifn, __u8 syncid)
 			goto outsocket;
 		tinfo->net = net;
 		tinfo->sock = sock;
+		tinfo->stats = &stats[id];
+		stats[id].sock = sock;
 		if (state == IP_VS_STATE_BACKUP) {
 			tinfo->buf = kmalloc(ipvs->recv_mesg_maxlen,
 					     GFP_KERNEL);
@@ -1915,6 +2011,57 @@ int stop_sync_thread(struct net *net, int state)
 	return retc;
 }
 
+#ifdef CONFIG_PROC_FS
+static int ip_vs_sync_threads_show(struct seq_file *seq, void *v)
+{
+	struct net *net = seq_file_single_net(seq);
+	struct netns_ipvs *ipvs = net_ipvs(net);
+	struct ip_vs_sync_thread_stats *st;
+	struct sock *sk;
+	int id;
+
+	if (mutex_lock_interruptible(&ipvs->sync_mutex))
+		return -ERESTARTSYS;
+
+	seq_puts(seq,
+		 "Type   Id    Queue  Messages     Drops    Errors\n");
+	if (ipvs->ms) {
+		st = master_thread_stats(ipvs);
+		for (id = 0; id <= ipvs->threads_mask; id++, st++)
+			seq_printf(seq, "Master %2d %8d %9lu %9lu %9lu\n",
+				   id, ipvs->ms[id].sync_queue_len,
+				   st->mesgs, st->drops, st->errors);
+	}
+	if (ipvs->backup_threads) {
+		/* Queue and drops are those of the receive socket */
+		st = backup_thread_stats(ipvs);
+		for (id = 0; id <= ipvs->threads_mask; id++, st++) {
+			sk = st->sock->sk;
+			seq_printf(seq, "Backup %2d %8u %9lu %9d %9lu\n",
+				   id, skb_queue_len(&sk->sk_receive_queue),
+				   st->mesgs, atomic_read(&sk->sk_drops),
+				   st->errors);
+		}
+	}
+
+	mutex_unlock(&ipvs->sync_mutex);
+	return 0;
+}
+
+static int ip_vs_sync_threads_seq_open(struct inode *inode, struct file *file)
+{
+	return single_open_net(inode, file, ip_vs_sync_threads_show);
+}
+
+static const struct file_operations ip_vs_sync_threads_fops = {
+	.owner = THIS_MODULE,
+	.open = ip_vs_sync_threads_seq_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release_net,
+};
+#endif
+
 /*
  * Initialize data struct for each netns
  */
@@ -1925,6 +2072,8 @@ int __net_init ip_vs_sync_net_init(struct net *net)
 	__mutex_init(&ipvs->sync_mutex, "ipvs->sync_mutex", &__ipvs_sync_key);
 	spin_lock_init(&ipvs->sync_lock);
 	spin_lock_init(&ipvs->sync_buff_lock);
+	proc_net_fops_create(net, "ip_vs_sync_threads", 0,
+			     &ip_vs_sync_threads_fops);
 	return 0;
 }
 
@@ -1933,6 +2082,7 @@ void ip_vs_sync_net_cleanup(struct net *net)
 	int retc;
 	struct netns_ipvs *ipvs = net_ipvs(net);
 
+	proc_net_remove(net, "ip_vs_sync_threads");
 	mutex_lock(&ipvs->sync_mutex);
 	retc = stop_sync_thread(net, IP_VS_STATE_MASTER);
 	if (retc && retc != -ESRCH)
@@ -28,6 +28,7 @@
 #include <linux/netfilter/nfnetlink.h>
 #include <linux/netfilter/nfnetlink_queue.h>
 #include <linux/list.h>
+#include <linux/log2.h>
 #include <net/sock.h>
 #include <net/netfilter/nf_queue.h>
 #include <net/netfilter/nfnetlink_queue.h>
@@ -39,6 +40,7 @@
 #endif
 
 #define NFQNL_QMAX_DEFAULT 1024
+#define NFQNL_ID_HASH_MAX 8192
 
 struct nfqnl_instance {
 	struct hlist_node hlist;		/* global list of queues */
@@ -62,6 +64,13 @@ struct nfqnl_instance {
 	unsigned int	queue_total;
 	unsigned int	id_sequence;		/* 'sequence' of pkt ids */
 	struct list_head queue_list;		/* packets in queue */
+	/*
+	 * Verdict lookup cache: a queued packet is stored in the slot of
+	 * its id unless the slot is already taken by an older one, which
+	 * then leaves the packet to the queue_list walk.
+	 */
+	struct nf_queue_entry **id_hash;
+	unsigned int	id_hash_mask;
 };
 
 typedef int (*nfqnl_cmpfn)(struct nf_queue_entry *, unsigned long);
@@ -118,6 +127,14 @@ instance_create(u_int16_t queue_num, int portid)
 	spin_lock_init(&inst->lock);
 	INIT_LIST_HEAD(&inst->queue_list);
 
+	inst->id_hash = kcalloc(NFQNL_QMAX_DEFAULT, sizeof(*inst->id_hash),
+				GFP_ATOMIC);
+	if (!inst->id_hash) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+	inst->id_hash_mask = NFQNL_QMAX_DEFAULT - 1;
+
 	if (!try_module_get(THIS_MODULE)) {
 		err = -EAGAIN;
 		goto out_free;
@@ -131,6 +148,7 @@ instance_create(u_int16_t queue_num, int portid)
 	return inst;
 
 out_free:
+	kfree(inst->id_hash);
 	kfree(inst);
 out_unlock:
 	spin_unlock(&instances_lock);
@@ -147,6 +165,7 @@ instance_destroy_rcu(struct rcu_head *head)
 						   rcu);
 
 	nfqnl_flush(inst, NULL, 0);
+	kfree(inst->id_hash);
 	kfree(inst);
 	module_put(THIS_MODULE);
 }
@@ -169,28 +188,62 @@ instance_destroy(struct nfqnl_instance *inst)
 static inline void
 __enqueue_entry(struct nfqnl_instance *queue, struct nf_queue_entry *entry)
 {
-       list_add_tail(&entry->list, &queue->queue_list);
-       queue->queue_total++;
+	struct nf_queue_entry **slot;
+
+	list_add_tail(&entry->list, &queue->queue_list);
+	queue->queue_total++;
+
+	slot = &queue->id_hash[entry->id & queue->id_hash_mask];
+	if (*slot == NULL)
+		*slot = entry;
 }
 
 static void
 __dequeue_entry(struct nfqnl_instance *queue, struct nf_queue_entry *entry)
 {
+	struct nf_queue_entry **slot;
+
 	list_del(&entry->list);
 	queue->queue_total--;
+
+	slot = &queue->id_hash[entry->id & queue->id_hash_mask];
+	if (*slot == entry)
+		*slot = NULL;
+}
+
+/* Replace the id cache, called with queue->lock held */
+static void
+__id_hash_replace(struct nfqnl_instance *queue,
+		  struct nf_queue_entry **id_hash, unsigned int size)
+{
+	struct nf_queue_entry *entry, **slot;
+
+	kfree(queue->id_hash);
+	queue->id_hash = id_hash;
+	queue->id_hash_mask = size - 1;
+
+	list_for_each_entry(entry, &queue->queue_list, list) {
+		slot = &id_hash[entry->id & queue->id_hash_mask];
+		if (*slot == NULL)
+			*slot = entry;
+	}
 }
 
 static struct nf_queue_entry *
 find_dequeue_entry(struct nfqnl_instance *queue, unsigned int id)
 {
-	struct nf_queue_entry *entry = NULL, *i;
+	struct nf_queue_entry *entry, *i;
 
 	spin_lock_bh(&queue->lock);
 
-	list_for_each_entry(i, &queue->queue_list, list) {
-		if (i->id == id) {
-			entry = i;
-			break;
+	entry = queue->id_hash[id & queue->id_hash_mask];
+	if (entry == NULL || entry->id != id) {
+		entry = NULL;
+		list_for_each_entry(i, &queue->queue_list, list) {
+			if (i->id == id) {
+				entry = i;
+				break;
+			}
 		}
 	}
 
@@ -210,8 +263,7 @@ nfqnl_flush(struct nfqnl_instance *queue, nfqnl_cmpfn cmpfn, unsigned long data)
 	spin_lock_bh(&queue->lock);
 	list_for_each_entry_safe(entry, next, &queue->queue_list, list) {
 		if (!cmpfn || cmpfn(entry, data)) {
-			list_del(&entry->list);
-			queue->queue_total--;
+			__dequeue_entry(queue, entry);
 			nf_reinject(entry, NF_DROP);
 		}
 	}
@@ -882,6 +934,8 @@ nfqnl_recv_config(struct sock *ctnl, struct sk_buff *skb,
 	}
 
 	if (nfqa[NFQA_CFG_QUEUE_MAXLEN]) {
+		struct nf_queue_entry **id_hash;
+		unsigned int hsize;
 		__be32 *queue_maxlen;
 
 		if (!queue) {
@@ -889,8 +943,18 @@ nfqnl_recv_config(struct sock *ctnl, struct sk_buff *skb,
 			goto err_out_unlock;
 		}
 		queue_maxlen = nla_data(nfqa[NFQA_CFG_QUEUE_MAXLEN]);
+		hsize = clamp_t(unsigned int, ntohl(*queue_maxlen),
+				1, NFQNL_ID_HASH_MAX);
+		hsize = roundup_pow_of_two(hsize);
+		/* The cache is optional: keep the old one if we are short
+		 * of memory */
+		id_hash = NULL;
+		if (hsize != queue->id_hash_mask + 1)
+			id_hash = kcalloc(hsize, sizeof(*id_hash), GFP_ATOMIC);
 		spin_lock_bh(&queue->lock);
 		queue->queue_maxlen = ntohl(*queue_maxlen);
+		if (id_hash)
+			__id_hash_replace(queue, id_hash, hsize);
 		spin_unlock_bh(&queue->lock);
 	}
 
@@ -91,18 +91,28 @@ struct dsthash_ent {
 	struct rcu_head rcu;
 };
 
+/* Buckets are locked in stripes, so that inserts and gc on different
+ * buckets do not serialize on a table-wide lock.
+ */
+#define HASHLIMIT_LOCKS		64
+
+/* The gc timer visits 1/HASHLIMIT_GC_STEPS of the buckets per run, so
+ * that the whole table is scanned once per gc_interval.
+ */
+#define HASHLIMIT_GC_STEPS	8
+
 struct xt_hashlimit_htable {
 	struct hlist_node node;		/* global list of all htables */
 	int use;
 	u_int8_t family;
-	bool rnd_initialized;
 
 	struct hashlimit_cfg1 cfg;	/* config */
 
 	/* used internally */
-	spinlock_t lock;		/* lock for list_head */
+	spinlock_t locks[HASHLIMIT_LOCKS]; /* locks for hash buckets */
 	u_int32_t rnd;			/* random seed for hash */
-	unsigned int count;		/* number entries in table */
+	atomic_t count;			/* number entries in table */
+	unsigned int gc_next;		/* next bucket to gc */
 	struct timer_list timer;	/* timer for gc */
 
 	/* seq_file stuff */
@@ -136,51 +146,55 @@ hash_dst(const struct xt_hashlimit_htable *ht, const struct dsthash_dst *dst)
 	return ((u64)hash * ht->cfg.size) >> 32;
 }
 
+static inline spinlock_t *
+htable_bucket_lock(struct xt_hashlimit_htable *ht, unsigned int hash)
+{
+	return &ht->locks[hash % HASHLIMIT_LOCKS];
+}
+
+/* Returns the entry unlocked, must be called under rcu_read_lock_bh()
+ * or with the bucket lock held.
+ */
 static struct dsthash_ent *
 dsthash_find(const struct xt_hashlimit_htable *ht,
-	     const struct dsthash_dst *dst)
+	     const struct dsthash_dst *dst, u_int32_t hash)
 {
 	struct dsthash_ent *ent;
 	struct hlist_node *pos;
-	u_int32_t hash = hash_dst(ht, dst);
 
 	if (!hlist_empty(&ht->hash[hash])) {
 		hlist_for_each_entry_rcu(ent, pos, &ht->hash[hash], node)
-			if (dst_cmp(ent, dst)) {
-				spin_lock(&ent->lock);
+			if (dst_cmp(ent, dst))
 				return ent;
-			}
 	}
 	return NULL;
 }
 
-/* allocate dsthash_ent, initialize dst, put in htable and lock it */
+static void rateinfo_init(struct dsthash_ent *dh,
+			  struct xt_hashlimit_htable *hinfo);
+
+/* allocate dsthash_ent, initialize it, put in htable and lock it */
 static struct dsthash_ent *
 dsthash_alloc_init(struct xt_hashlimit_htable *ht,
-		   const struct dsthash_dst *dst, bool *race)
+		   const struct dsthash_dst *dst, u_int32_t hash, bool *race)
 {
+	spinlock_t *lock = htable_bucket_lock(ht, hash);
 	struct dsthash_ent *ent;
 
-	spin_lock(&ht->lock);
+	spin_lock(lock);
 
 	/* Two or more packets may race to create the same entry in the
 	 * hashtable, double check if this packet lost race.
 	 */
-	ent = dsthash_find(ht, dst);
+	ent = dsthash_find(ht, dst, hash);
 	if (ent != NULL) {
-		spin_unlock(&ht->lock);
+		spin_lock(&ent->lock);
+		spin_unlock(lock);
 		*race = true;
 		return ent;
 	}
 
-	/* initialize hash with random val at the time we allocate
-	 * the first hashtable entry */
-	if (unlikely(!ht->rnd_initialized)) {
-		get_random_bytes(&ht->rnd, sizeof(ht->rnd));
-		ht->rnd_initialized = true;
-	}
-
-	if (ht->cfg.max && ht->count >= ht->cfg.max) {
+	if (ht->cfg.max && atomic_read(&ht->count) >= ht->cfg.max) {
 		/* FIXME: do something. question is what.. */
 		net_err_ratelimited("max count of %u reached\n", ht->cfg.max);
 		ent = NULL;
@@ -190,11 +204,17 @@ dsthash_alloc_init(struct xt_hashlimit_htable *ht,
 		memcpy(&ent->dst, dst, sizeof(ent->dst));
 		spin_lock_init(&ent->lock);
 
+		/* Lockless readers may look at the rate info as soon as
+		 * the entry is hashed.
+		 */
+		ent->expires = jiffies + msecs_to_jiffies(ht->cfg.expire);
+		rateinfo_init(ent, ht);
+
 		spin_lock(&ent->lock);
-		hlist_add_head_rcu(&ent->node, &ht->hash[hash_dst(ht, dst)]);
-		ht->count++;
+		hlist_add_head_rcu(&ent->node, &ht->hash[hash]);
+		atomic_inc(&ht->count);
 	}
-	spin_unlock(&ht->lock);
+	spin_unlock(lock);
 	return ent;
 }
 
@@ -210,10 +230,16 @@ dsthash_free(struct xt_hashlimit_htable *ht, struct dsthash_ent *ent)
 {
 	hlist_del_rcu(&ent->node);
 	call_rcu_bh(&ent->rcu, dsthash_free_rcu);
-	ht->count--;
+	atomic_dec(&ht->count);
 }
 static void htable_gc(unsigned long htlong);
 
+static unsigned long htable_gc_period(const struct xt_hashlimit_htable *ht)
+{
+	return max(msecs_to_jiffies(ht->cfg.gc_interval) / HASHLIMIT_GC_STEPS,
+		   1UL);
+}
+
 static int htable_create(struct net *net, struct xt_hashlimit_mtinfo1 *minfo,
 			 u_int8_t family)
 {
@@ -251,10 +277,12 @@ static int htable_create(struct net *net, struct xt_hashlimit_mtinfo1 *minfo,
 		INIT_HLIST_HEAD(&hinfo->hash[i]);
 
 	hinfo->use = 1;
-	hinfo->count = 0;
+	atomic_set(&hinfo->count, 0);
 	hinfo->family = family;
-	hinfo->rnd_initialized = false;
-	spin_lock_init(&hinfo->lock);
+	get_random_bytes(&hinfo->rnd, sizeof(hinfo->rnd));
+	hinfo->gc_next = 0;
+	for (i = 0; i < HASHLIMIT_LOCKS; i++)
+		spin_lock_init(&hinfo->locks[i]);
 
 	hinfo->pde = proc_create_data(minfo->name, 0,
 		(family == NFPROTO_IPV4) ?
@@ -267,7 +295,7 @@ static int htable_create(struct net *net, struct xt_hashlimit_mtinfo1 *minfo,
 	hinfo->net = net;
 
 	setup_timer(&hinfo->timer, htable_gc, (unsigned long)hinfo);
-	hinfo->timer.expires = jiffies + msecs_to_jiffies(hinfo->cfg.gc_interval);
+	hinfo->timer.expires = jiffies + htable_gc_period(hinfo);
 	add_timer(&hinfo->timer);
 
 	hlist_add_head(&hinfo->node, &hashlimit_net->htables);
@@ -288,33 +316,44 @@ static bool select_gc(const struct xt_hashlimit_htable *ht,
 }
 
 static void htable_selective_cleanup(struct xt_hashlimit_htable *ht,
+			unsigned int start, unsigned int end,
 			bool (*select)(const struct xt_hashlimit_htable *ht,
 				      const struct dsthash_ent *he))
 {
 	unsigned int i;
 
-	/* lock hash table and iterate over it */
-	spin_lock_bh(&ht->lock);
-	for (i = 0; i < ht->cfg.size; i++) {
+	/* lock each bucket and iterate over it */
+	for (i = start; i < end; i++) {
+		spinlock_t *lock = htable_bucket_lock(ht, i);
 		struct dsthash_ent *dh;
 		struct hlist_node *pos, *n;
+
+		if (hlist_empty(&ht->hash[i]))
+			continue;
+		spin_lock_bh(lock);
 		hlist_for_each_entry_safe(dh, pos, n, &ht->hash[i], node) {
 			if ((*select)(ht, dh))
 				dsthash_free(ht, dh);
 		}
+		spin_unlock_bh(lock);
 	}
-	spin_unlock_bh(&ht->lock);
 }
 
-/* hash table garbage collector, run by timer */
+/* hash table garbage collector, run by timer on a slice of the table */
 static void htable_gc(unsigned long htlong)
 {
 	struct xt_hashlimit_htable *ht = (struct xt_hashlimit_htable *)htlong;
+	unsigned int start = ht->gc_next;
+	unsigned int end;
 
-	htable_selective_cleanup(ht, select_gc);
+	end = start + DIV_ROUND_UP(ht->cfg.size, HASHLIMIT_GC_STEPS);
+	if (end >= ht->cfg.size)
+		end = ht->cfg.size;
+	htable_selective_cleanup(ht, start, end, select_gc);
+	ht->gc_next = end < ht->cfg.size ? end : 0;
 
 	/* re-add the timer accordingly */
-	ht->timer.expires = jiffies + msecs_to_jiffies(ht->cfg.gc_interval);
+	ht->timer.expires = jiffies + htable_gc_period(ht);
 	add_timer(&ht->timer);
 }
 
@@ -333,7 +372,7 @@ static void htable_destroy(struct xt_hashlimit_htable *hinfo)
 	if(parent != NULL)
 		remove_proc_entry(hinfo->pde->name, parent);
 
-	htable_selective_cleanup(hinfo, select_all);
+	htable_selective_cleanup(hinfo, 0, hinfo->cfg.size, select_all);
 	vfree(hinfo);
 }
 
@@ -599,16 +638,18 @@ hashlimit_mt(const struct sk_buff *skb, struct xt_action_param *par)
 	unsigned long now = jiffies;
 	struct dsthash_ent *dh;
 	struct dsthash_dst dst;
+	u_int32_t hash;
 	bool race = false;
 	u32 cost;
 
 	if (hashlimit_init_dst(hinfo, &dst, skb, par->thoff) < 0)
 		goto hotdrop;
 
+	hash = hash_dst(hinfo, &dst);
 	rcu_read_lock_bh();
-	dh = dsthash_find(hinfo, &dst);
+	dh = dsthash_find(hinfo, &dst, hash);
 	if (dh == NULL) {
-		dh = dsthash_alloc_init(hinfo, &dst, &race);
+		dh = dsthash_alloc_init(hinfo, &dst, hash, &race);
 		if (dh == NULL) {
 			rcu_read_unlock_bh();
 			goto hotdrop;
@@ -616,11 +657,20 @@ hashlimit_mt(const struct sk_buff *skb, struct xt_action_param *par)
 			/* Already got an entry, update expiration timeout */
 			dh->expires = now + msecs_to_jiffies(hinfo->cfg.expire);
 			rateinfo_recalc(dh, now, hinfo->cfg.mode);
-		} else {
-			dh->expires = jiffies + msecs_to_jiffies(hinfo->cfg.expire);
-			rateinfo_init(dh, hinfo);
 		}
 	} else {
+		/* In packet mode, an entry gains no credit before the next
+		 * jiffy: packets over the limit within the same jiffy are
+		 * rejected without taking the lock or dirtying the entry.
+		 */
+		if (!(hinfo->cfg.mode & XT_HASHLIMIT_BYTES) &&
+		    ACCESS_ONCE(dh->rateinfo.prev) == now &&
+		    ACCESS_ONCE(dh->rateinfo.credit) < dh->rateinfo.cost) {
+			rcu_read_unlock_bh();
+			return info->cfg.mode & XT_HASHLIMIT_INVERT;
+		}
+
+		spin_lock(&dh->lock);
 		/* update expiration timeout */
 		dh->expires = now + msecs_to_jiffies(hinfo->cfg.expire);
 		rateinfo_recalc(dh, now, hinfo->cfg.mode);
@@ -734,12 +784,12 @@ static struct xt_match hashlimit_mt_reg[] __read_mostly = {
 
 /* PROC stuff */
 static void *dl_seq_start(struct seq_file *s, loff_t *pos)
-	__acquires(htable->lock)
+	__acquires(RCU)
 {
 	struct xt_hashlimit_htable *htable = s->private;
 	unsigned int *bucket;
 
-	spin_lock_bh(&htable->lock);
+	rcu_read_lock_bh();
 	if (*pos >= htable->cfg.size)
 		return NULL;
 
@@ -765,14 +815,13 @@ static void *dl_seq_next(struct seq_file *s, void *v, loff_t *pos)
 }
 
 static void dl_seq_stop(struct seq_file *s, void *v)
-	__releases(htable->lock)
+	__releases(RCU)
 {
-	struct xt_hashlimit_htable *htable = s->private;
 	unsigned int *bucket = (unsigned int *)v;
 
 	if (!IS_ERR(bucket))
 		kfree(bucket);
-	spin_unlock_bh(&htable->lock);
+	rcu_read_unlock_bh();
 }
 
 static int dl_seq_real_show(struct dsthash_ent *ent, u_int8_t family,
@@ -824,7 +873,7 @@ static int dl_seq_show(struct seq_file *s, void *v)
 	struct hlist_node *pos;
 
 	if (!hlist_empty(&htable->hash[*bucket])) {
-		hlist_for_each_entry(ent, pos, &htable->hash[*bucket], node)
+		hlist_for_each_entry_rcu(ent, pos, &htable->hash[*bucket], node)
 			if (dl_seq_real_show(ent, htable->family, s))
 				return -1;
 	}
@@ -31,6 +31,7 @@
 #include <linux/genetlink.h>
 #include <linux/kernel.h>
 #include <linux/kthread.h>
+#include <linux/interrupt.h>
 #include <linux/mutex.h>
 #include <linux/percpu.h>
 #include <linux/rcupdate.h>
@@ -71,6 +72,44 @@ static int ovs_net_id __read_mostly;
 static void rehash_flow_table(struct work_struct *work);
 static DECLARE_DELAYED_WORK(rehash_flow_wq, rehash_flow_table);
 
+static unsigned int upcall_queue_len __read_mostly = 256;
+module_param(upcall_queue_len, uint, 0644);
+MODULE_PARM_DESC(upcall_queue_len, "Upcalls queued per vport and CPU (0 sends them synchronously)");
+
+static unsigned int upcall_batch __read_mostly = 1;
+module_param(upcall_batch, uint, 0644);
+MODULE_PARM_DESC(upcall_batch, "Upcall messages packed into one Netlink datagram");
+
+static unsigned int upcall_trunc __read_mostly;
+module_param(upcall_trunc, uint, 0644);
+MODULE_PARM_DESC(upcall_trunc, "Bytes of packet data sent with each upcall (0 for all)");
+
+/* Upcall messages sent per run of a CPU's upcall tasklet. */
+#define UPCALL_BUDGET 64
+
+/**
+ * struct dp_upcall_cpu - per-CPU upcall state of a datapath
+ * @lock: Protects @active and the vport upcall queues of this CPU.
+ * @active: Vport upcall queues with messages pending, served round-robin so
+ * that one busy vport cannot starve the others.
+ * @tasklet: Sends the pending messages to userspace.
+ * @retry: Reschedules @tasklet once a full Netlink socket may have drained.
+ * @dp: Owning datapath.
+ */
+struct dp_upcall_cpu {
+	spinlock_t lock;
+	struct list_head active;
+	struct tasklet_struct tasklet;
+	struct timer_list retry;
+	struct datapath *dp;
+};
+
+/* Destination of a queued upcall message, until it is handed to Netlink. */
+struct ovs_upcall_cb {
+	u32 portid;
+};
+#define OVS_UPCALL_CB(skb) ((struct ovs_upcall_cb *)(skb)->cb)
+
 /**
  * DOC: Locking:
  *
@@ -89,11 +128,12 @@ static DECLARE_DELAYED_WORK(rehash_flow_wq, rehash_flow_table);
  */
 
 static struct vport *new_vport(const struct vport_parms *);
-static int queue_gso_packets(struct net *, int dp_ifindex, struct sk_buff *,
-			     const struct dp_upcall_info *);
-static int queue_userspace_packet(struct net *, int dp_ifindex,
+static int queue_gso_packets(struct datapath *, int dp_ifindex,
+			     struct sk_buff *, const struct dp_upcall_info *);
+static int queue_userspace_packet(struct datapath *, int dp_ifindex,
 				  struct sk_buff *,
 				  const struct dp_upcall_info *);
+static void upcall_purge_vport(struct vport *);
 
 /* Must be called with rcu_read_lock, genl_mutex, or RTNL lock. */
 static struct datapath *get_dp(struct net *net, int dp_ifindex)
@@ -143,6 +183,7 @@ static void destroy_dp_rcu(struct rcu_head *rcu)
 	struct datapath *dp = container_of(rcu, struct datapath, rcu);
 
 	ovs_flow_tbl_destroy((__force struct flow_table *)dp->table);
+	free_percpu(dp->upcall_cpu);
 	free_percpu(dp->stats_percpu);
 	release_net(ovs_dp_get_net(dp));
 	kfree(dp->ports);
@@ -192,6 +233,7 @@ void ovs_dp_detach_port(struct vport *p)
 
 	/* First drop references to device. */
 	hlist_del_rcu(&p->dp_hash_node);
+	upcall_purge_vport(p);
 
 	/* Then destroy it. */
 	ovs_vport_del(p);
@@ -254,10 +296,241 @@ static struct genl_family dp_packet_genl_family = {
 	.netnsok = true
 };
 
+static void upcall_lost(struct datapath *dp, unsigned int n)
+{
+	struct dp_stats_percpu *stats = this_cpu_ptr(dp->stats_percpu);
+
+	u64_stats_update_begin(&stats->sync);
+	stats->n_lost += n;
+	u64_stats_update_end(&stats->sync);
+}
+
+/* Hands one datagram holding the messages in @batch to Netlink.  The messages
+ * stay on @batch, so that the caller can requeue them if the socket is full.
+ * Netlink only ever sees a separate skb: it links what it is given onto the
+ * socket's receive queue, so it must not be one that is still on @batch.
+ */
+static int upcall_send(struct net *net, struct sk_buff_head *batch, u32 portid)
+{
+	struct sk_buff *skb, *nskb;
+	unsigned int len = 0;
+
+	if (skb_queue_len(batch) == 1) {
+		nskb = skb_clone(skb_peek(batch), GFP_ATOMIC);
+		if (!nskb)
+			return -ENOMEM;
+		memset(nskb->cb, 0, sizeof(struct ovs_upcall_cb));
+		return genlmsg_unicast(net, nskb, portid);
+	}
+
+	skb_queue_walk(batch, skb)
+		len += NLMSG_ALIGN(skb->len);
+
+	nskb = alloc_skb(len, GFP_ATOMIC);
+	if (!nskb)
+		return -ENOMEM;
+
+	skb_queue_walk(batch, skb) {
+		void *p = skb_put(nskb, NLMSG_ALIGN(skb->len));
+
+		memcpy(p, skb->data, skb->len);
+		memset(p + skb->len, 0, NLMSG_ALIGN(skb->len) - skb->len);
+	}
+
+	return genlmsg_unicast(net, nskb, portid);
+}
+
+static void upcall_tasklet(unsigned long data)
+{
+	struct dp_upcall_cpu *uc = (struct dp_upcall_cpu *)data;
+	struct datapath *dp = uc->dp;
+	struct net *net = ovs_dp_get_net(dp);
+	struct sk_buff_head batch;
+	int budget = UPCALL_BUDGET;
+	LIST_HEAD(blocked);
+	bool pending, full;
+
+	__skb_queue_head_init(&batch);
+
+	/* Keeps the vports' queues alive while the lock is dropped. */
+	rcu_read_lock();
+	spin_lock(&uc->lock);
+	while (budget > 0 && !list_empty(&uc->active)) {
+		struct vport_upcall_queue *q;
+		struct sk_buff *skb;
+		unsigned int len = 0;
+		u32 portid;
+		int err;
+
+		q = list_first_entry(&uc->active, struct vport_upcall_queue,
+				     node);
+		list_del_init(&q->node);
+
+		/* Take the leading messages that go to the same socket. */
+		portid = OVS_UPCALL_CB(skb_peek(&q->skbs))->portid;
+		while ((skb = skb_peek(&q->skbs)) != NULL &&
+		       OVS_UPCALL_CB(skb)->portid == portid &&
+		       skb_queue_len(&batch) < max(upcall_batch, 1U) &&
+		       (!len || len + skb->len <= NLMSG_GOODSIZE)) {
+			len += NLMSG_ALIGN(skb->len);
+			__skb_unlink(skb, &q->skbs);
+			__skb_queue_tail(&batch, skb);
+		}
+		spin_unlock(&uc->lock);
+
+		budget -= skb_queue_len(&batch);
+		err = upcall_send(net, &batch, portid);
+
+		spin_lock(&uc->lock);
+		if ((err == -EAGAIN || err == -ENOMEM) && !q->dead) {
+			/* Receive buffer full: back off this vport for now. */
+			skb_queue_walk(&batch, skb)
+				OVS_UPCALL_CB(skb)->portid = portid;
+			skb_queue_splice_init(&batch, &q->skbs);
+			list_add_tail(&q->node, &blocked);
+			continue;
+		}
+
+		if (err)
+			upcall_lost(dp, skb_queue_len(&batch));
+		while ((skb = __skb_dequeue(&batch)) != NULL) {
+			if (err)
+				kfree_skb(skb);
+			else
+				consume_skb(skb);
+		}
+
+		if (!q->dead && !skb_queue_empty(&q->skbs))
+			list_add_tail(&q->node, &uc->active);
+	}
+
+	full = !list_empty(&blocked);
+	list_splice_tail(&blocked, &uc->active);
+	pending = !list_empty(&uc->active);
+	spin_unlock(&uc->lock);
+	rcu_read_unlock();
+
+	if (full)
+		mod_timer(&uc->retry, jiffies + 1);
+	else if (pending)
+		tasklet_schedule(&uc->tasklet);
+}
+
+static void upcall_retry(unsigned long data)
+{
+	struct dp_upcall_cpu *uc = (struct dp_upcall_cpu *)data;
+
+	tasklet_schedule(&uc->tasklet);
+}
+
+/* Queues @user_skb on @vport's queue for this CPU.  Consumes @user_skb. */
+static int upcall_enqueue(struct datapath *dp, struct vport *vport,
+			  struct sk_buff *user_skb, u32 portid)
+{
+	struct dp_upcall_cpu *uc = this_cpu_ptr(dp->upcall_cpu);
+	struct vport_upcall_queue *q = this_cpu_ptr(vport->upcall_queue);
+	int err = 0;
+
+	OVS_UPCALL_CB(user_skb)->portid = portid;
+
+	/* Scheduled under the lock, so that once upcall_purge_vport() has
+	 * marked the queue dead no new run can be scheduled through it.
+	 */
+	spin_lock(&uc->lock);
+	if (unlikely(q->dead || skb_queue_len(&q->skbs) >= upcall_queue_len)) {
+		err = -ENOBUFS;
+	} else {
+		__skb_queue_tail(&q->skbs, user_skb);
+		if (list_empty(&q->node))
+			list_add_tail(&q->node, &uc->active);
+		tasklet_schedule(&uc->tasklet);
+	}
+	spin_unlock(&uc->lock);
+
+	if (err)
+		kfree_skb(user_skb);
+	return err;
+}
+
+/* Called with RTNL lock.  Drops everything queued for @p and stops queueing. */
+static void upcall_purge_vport(struct vport *p)
+{
+	struct datapath *dp = p->dp;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct dp_upcall_cpu *uc = per_cpu_ptr(dp->upcall_cpu, cpu);
+		struct vport_upcall_queue *q = per_cpu_ptr(p->upcall_queue, cpu);
+
+		spin_lock_bh(&uc->lock);
+		q->dead = true;
+		list_del_init(&q->node);
+		__skb_queue_purge(&q->skbs);
+		spin_unlock_bh(&uc->lock);
+	}
+}
+
+static int upcall_init(struct datapath *dp)
+{
+	int cpu;
+
+	dp->upcall_cpu = alloc_percpu(struct dp_upcall_cpu);
+	if (!dp->upcall_cpu)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct dp_upcall_cpu *uc = per_cpu_ptr(dp->upcall_cpu, cpu);
+
+		spin_lock_init(&uc->lock);
+		INIT_LIST_HEAD(&uc->active);
+		tasklet_init(&uc->tasklet, upcall_tasklet, (unsigned long)uc);
+		setup_timer(&uc->retry, upcall_retry, (unsigned long)uc);
+		uc->dp = dp;
+	}
+
+	return 0;
+}
+
+/* Called once every vport has been detached, so nothing can be queued.
+ * A running tasklet may still arm the retry timer and the timer schedules
+ * the tasklet again, hence the tasklet is killed on both sides of it.  The
+ * second run finds no active queue and arms nothing.
+ */
+static void upcall_stop(struct datapath *dp)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct dp_upcall_cpu *uc = per_cpu_ptr(dp->upcall_cpu, cpu);
+
+		tasklet_kill(&uc->tasklet);
+		del_timer_sync(&uc->retry);
+		tasklet_kill(&uc->tasklet);
+	}
+}
+
+/* Sends @user_skb to userspace, through the input vport's queue if queueing
+ * is enabled.  Consumes @user_skb.
+ */
+static int upcall_deliver(struct datapath *dp, struct sk_buff *user_skb,
+			  const struct dp_upcall_info *upcall_info)
+{
+	struct vport *vport;
+
+	if (upcall_queue_len) {
+		vport = ovs_vport_rcu(dp, upcall_info->key->phy.in_port);
+		if (vport)
+			return upcall_enqueue(dp, vport, user_skb,
+					      upcall_info->portid);
+	}
+
+	return genlmsg_unicast(ovs_dp_get_net(dp), user_skb,
+			       upcall_info->portid);
+}
+
 int ovs_dp_upcall(struct datapath *dp, struct sk_buff *skb,
 		  const struct dp_upcall_info *upcall_info)
 {
-	struct dp_stats_percpu *stats;
 	int dp_ifindex;
 	int err;
 
@@ -273,25 +546,20 @@ int ovs_dp_upcall(struct datapath *dp, struct sk_buff *skb,
 	}
 
 	if (!skb_is_gso(skb))
-		err = queue_userspace_packet(ovs_dp_get_net(dp), dp_ifindex, skb, upcall_info);
+		err = queue_userspace_packet(dp, dp_ifindex, skb, upcall_info);
 	else
-		err = queue_gso_packets(ovs_dp_get_net(dp), dp_ifindex, skb, upcall_info);
+		err = queue_gso_packets(dp, dp_ifindex, skb, upcall_info);
 	if (err)
 		goto err;
 
 	return 0;
 
 err:
-	stats = this_cpu_ptr(dp->stats_percpu);
-
-	u64_stats_update_begin(&stats->sync);
-	stats->n_lost++;
-	u64_stats_update_end(&stats->sync);
-
+	upcall_lost(dp, 1);
 	return err;
 }
 
-static int queue_gso_packets(struct net *net, int dp_ifindex,
+static int queue_gso_packets(struct datapath *dp, int dp_ifindex,
 			     struct sk_buff *skb,
 			     const struct dp_upcall_info *upcall_info)
 {
@@ -308,7 +576,7 @@ static int queue_gso_packets(struct net *net, int dp_ifindex,
 	/* Queue all of the segments. */
 	skb = segs;
 	do {
-		err = queue_userspace_packet(net, dp_ifindex, skb, upcall_info);
+		err = queue_userspace_packet(dp, dp_ifindex, skb, upcall_info);
 		if (err)
 			break;
 
@@ -338,7 +606,7 @@ static int queue_gso_packets(struct net *net, int dp_ifindex,
 	return err;
 }
 
-static int queue_userspace_packet(struct net *net, int dp_ifindex,
+static int queue_userspace_packet(struct datapath *dp, int dp_ifindex,
 				  struct sk_buff *skb,
 				  const struct dp_upcall_info *upcall_info)
 {
@@ -346,6 +614,7 @@ static int queue_userspace_packet(struct net *net, int dp_ifindex,
 	struct sk_buff *nskb = NULL;
 	struct sk_buff *user_skb; /* to be queued to userspace */
 	struct nlattr *nla;
+	unsigned int pkt_len;
 	unsigned int len;
 	int err;
 
@@ -362,13 +631,20 @@ static int queue_userspace_packet(struct net *net, int dp_ifindex,
 		skb = nskb;
 	}
 
-	if (nla_attr_size(skb->len) > USHRT_MAX) {
+	/* A truncated packet cannot be executed again from userspace, so
+	 * upcall_trunc is only useful when userspace merely inspects them.
+	 */
+	pkt_len = skb->len;
+	if (upcall_trunc && pkt_len > upcall_trunc)
+		pkt_len = upcall_trunc;
+
+	if (nla_attr_size(pkt_len) > USHRT_MAX) {
 		err = -EFBIG;
 		goto out;
 	}
 
 	len = sizeof(struct ovs_header);
-	len += nla_total_size(skb->len);
+	len += nla_total_size(pkt_len);
 	len += nla_total_size(FLOW_BUFSIZE);
 	if (upcall_info->cmd == OVS_PACKET_CMD_ACTION)
 		len += nla_total_size(8);
@@ -391,11 +667,14 @@ static int queue_userspace_packet(struct net *net, int dp_ifindex,
 		nla_put_u64(user_skb, OVS_PACKET_ATTR_USERDATA,
 			    nla_get_u64(upcall_info->userdata));
 
-	nla = __nla_reserve(user_skb, OVS_PACKET_ATTR_PACKET, skb->len);
+	nla = __nla_reserve(user_skb, OVS_PACKET_ATTR_PACKET, pkt_len);
 
-	skb_copy_and_csum_dev(skb, nla_data(nla));
+	if (pkt_len < skb->len)
+		skb_copy_bits(skb, 0, nla_data(nla), pkt_len);
+	else
+		skb_copy_and_csum_dev(skb, nla_data(nla));
 
-	err = genlmsg_unicast(net, user_skb, upcall_info->portid);
+	err = upcall_deliver(dp, user_skb, upcall_info);
 
 out:
 	kfree_skb(nskb);
@@ -638,14 +917,6 @@ static int validate_actions(const struct nlattr *attr,
 	return 0;
 }
 
-static void clear_stats(struct sw_flow *flow)
-{
-	flow->used = 0;
-	flow->tcp_flags = 0;
-	flow->packet_count = 0;
-	flow->byte_count = 0;
-}
-
 static int ovs_packet_cmd_execute(struct sk_buff *skb, struct genl_info *info)
 {
 	struct ovs_header *ovs_header = info->userhdr;
@@ -832,12 +1103,7 @@ static int ovs_flow_cmd_fill_info(struct sw_flow *flow, struct datapath *dp,
 		goto error;
 	nla_nest_end(skb, nla);
 
-	spin_lock_bh(&flow->lock);
-	used = flow->used;
-	stats.n_packets = flow->packet_count;
-	stats.n_bytes = flow->byte_count;
-	tcp_flags = flow->tcp_flags;
-	spin_unlock_bh(&flow->lock);
+	ovs_flow_stats_get(flow, &stats, &used, &tcp_flags);
 
 	if (used &&
 	    nla_put_u64(skb, OVS_FLOW_ATTR_USED, ovs_flow_used_time(used)))
@@ -980,7 +1246,6 @@ static int ovs_flow_cmd_new_or_set(struct sk_buff *skb, struct genl_info *info)
 			goto error;
 		}
 		flow->key = key;
-		clear_stats(flow);
 
 		/* Obtain actions. */
 		acts = ovs_flow_actions_alloc(a[OVS_FLOW_ATTR_ACTIONS]);
@@ -1035,11 +1300,8 @@ static int ovs_flow_cmd_new_or_set(struct sk_buff *skb, struct genl_info *info)
 					       info->snd_seq, OVS_FLOW_CMD_NEW);
 
 		/* Clear stats. */
-		if (a[OVS_FLOW_ATTR_CLEAR]) {
-			spin_lock_bh(&flow->lock);
-			clear_stats(flow);
-			spin_unlock_bh(&flow->lock);
-		}
+		if (a[OVS_FLOW_ATTR_CLEAR])
+			ovs_flow_stats_clear(flow);
 	}
 
 	if (!IS_ERR(reply))
@@ -1318,11 +1580,15 @@ static int ovs_dp_cmd_new(struct sk_buff *skb, struct genl_info *info)
 		goto err_destroy_table;
 	}
 
+	err = upcall_init(dp);
+	if (err)
+		goto err_destroy_percpu;
+
 	dp->ports = kmalloc(DP_VPORT_HASH_BUCKETS * sizeof(struct hlist_head),
 			GFP_KERNEL);
 	if (!dp->ports) {
 		err = -ENOMEM;
-		goto err_destroy_percpu;
+		goto err_destroy_upcall;
 	}
 
 	for (i = 0; i < DP_VPORT_HASH_BUCKETS; i++)
@@ -1364,6 +1630,9 @@ err_destroy_local_port:
 	ovs_dp_detach_port(ovs_vport_rtnl(dp, OVSP_LOCAL));
 err_destroy_ports_array:
 	kfree(dp->ports);
+err_destroy_upcall:
+	upcall_stop(dp);
+	free_percpu(dp->upcall_cpu);
 err_destroy_percpu:
 	free_percpu(dp->stats_percpu);
 err_destroy_table:
@@ -1395,6 +1664,7 @@ static void __dp_destroy(struct datapath *dp)
 
 	list_del(&dp->list_node);
 	ovs_dp_detach_port(ovs_vport_rtnl(dp, OVSP_LOCAL));
+	upcall_stop(dp);
 
 	/* rtnl_unlock() will wait until all the references to devices that
 	 * are pending unregistration have been dropped.  We do it here to
@@ -53,6 +53,8 @@ struct dp_stats_percpu {
 	struct u64_stats_sync sync;
 };
 
+struct dp_upcall_cpu;
+
 /**
  * struct datapath - datapath for flow-based packet switching
  * @rcu: RCU callback head for deferred destruction.
@@ -62,6 +64,7 @@ struct dp_stats_percpu {
  * @ports: Hash table for ports.  %OVSP_LOCAL port always exists.  Protected by
  * RTNL and RCU.
  * @stats_percpu: Per-CPU datapath statistics.
+ * @upcall_cpu: Per-CPU state for draining queued upcalls to userspace.
  * @net: Reference to net namespace.
  *
  * Context: See the comment on locking at the top of datapath.c for additional
@@ -80,6 +83,9 @@ struct datapath {
 	/* Stats. */
 	struct dp_stats_percpu __percpu *stats_percpu;
 
+	/* Upcall queues. */
+	struct dp_upcall_cpu __percpu *upcall_cpu;
+
 #ifdef CONFIG_NET_NS
 	/* Network namespace ref. */
 	struct net *net;
@@ -39,6 +39,7 @@
 #include <linux/icmp.h>
 #include <linux/icmpv6.h>
 #include <linux/rculist.h>
+#include <linux/percpu.h>
 #include <net/ip.h>
 #include <net/ipv6.h>
 #include <net/ndisc.h>
@@ -178,8 +179,13 @@ static bool icmp6hdr_ok(struct sk_buff *skb)
 #define TCP_FLAGS_OFFSET 13
 #define TCP_FLAG_MASK 0x3f
 
+/* Called with rcu_read_lock and bottom halves disabled.  The counters are
+ * per-CPU, so that a flow hit from every receive queue does not bounce a
+ * cache line between the CPUs.
+ */
 void ovs_flow_used(struct sw_flow *flow, struct sk_buff *skb)
 {
+	struct sw_flow_stats *stats = this_cpu_ptr(flow->stats);
 	u8 tcp_flags = 0;
 
 	if ((flow->key.eth.type == htons(ETH_P_IP) ||
@@ -190,12 +196,60 @@ void ovs_flow_used(struct sw_flow *flow, struct sk_buff *skb)
 		tcp_flags = *(tcp + TCP_FLAGS_OFFSET) & TCP_FLAG_MASK;
 	}
 
-	spin_lock(&flow->lock);
-	flow->used = jiffies;
-	flow->packet_count++;
-	flow->byte_count += skb->len;
-	flow->tcp_flags |= tcp_flags;
-	spin_unlock(&flow->lock);
+	u64_stats_update_begin(&stats->sync);
+	stats->used = jiffies;
+	stats->packet_count++;
+	stats->byte_count += skb->len;
+	stats->tcp_flags |= tcp_flags;
+	u64_stats_update_end(&stats->sync);
+}
+
+void ovs_flow_stats_get(const struct sw_flow *flow,
+			struct ovs_flow_stats *ovs_stats,
+			unsigned long *used, u8 *tcp_flags)
+{
+	int cpu;
+
+	*used = 0;
+	*tcp_flags = 0;
+	memset(ovs_stats, 0, sizeof(*ovs_stats));
+
+	for_each_possible_cpu(cpu) {
+		const struct sw_flow_stats *stats;
+		struct sw_flow_stats local_stats;
+		unsigned int start;
+
+		stats = per_cpu_ptr(flow->stats, cpu);
+
+		do {
+			start = u64_stats_fetch_begin_bh(&stats->sync);
+			local_stats = *stats;
+		} while (u64_stats_fetch_retry_bh(&stats->sync, start));
+
+		if (local_stats.used &&
+		    (!*used || time_after(local_stats.used, *used)))
+			*used = local_stats.used;
+		*tcp_flags |= local_stats.tcp_flags;
+		ovs_stats->n_packets += local_stats.packet_count;
+		ovs_stats->n_bytes += local_stats.byte_count;
+	}
+}
+
+/* Packets counted concurrently on other CPUs may survive the clear.  The
+ * seqcount of a remote CPU belongs to that CPU's writer, so it is not taken.
+ */
+void ovs_flow_stats_clear(struct sw_flow *flow)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct sw_flow_stats *stats = per_cpu_ptr(flow->stats, cpu);
+
+		stats->used = 0;
+		stats->packet_count = 0;
+		stats->byte_count = 0;
+		stats->tcp_flags = 0;
+	}
 }
 
 struct sw_flow_actions *ovs_flow_actions_alloc(const struct nlattr *actions)
@@ -223,7 +277,12 @@ struct sw_flow *ovs_flow_alloc(void)
 	if (!flow)
 		return ERR_PTR(-ENOMEM);
 
-	spin_lock_init(&flow->lock);
+	flow->stats = alloc_percpu(struct sw_flow_stats);
+	if (!flow->stats) {
+		kmem_cache_free(flow_cache, flow);
+		return ERR_PTR(-ENOMEM);
+	}
+
 	flow->sf_acts = NULL;
 
 	return flow;
@@ -406,6 +465,7 @@ void ovs_flow_free(struct sw_flow *flow)
 		return;
 
 	kfree((struct sf_flow_acts __force *)flow->sf_acts);
+	free_percpu(flow->stats);
 	kmem_cache_free(flow_cache, flow);
 }
 
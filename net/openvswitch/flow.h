@@ -22,8 +22,9 @@
 #include <linux/kernel.h>
 #include <linux/netlink.h>
 #include <linux/openvswitch.h>
-#include <linux/spinlock.h>
+#include <linux/percpu.h>
 #include <linux/types.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/rcupdate.h>
 #include <linux/if_ether.h>
 #include <linux/in6.h>
@@ -94,6 +95,15 @@ struct sw_flow_key {
 	};
 };
 
+/* Statistics of one flow on one CPU, summed by ovs_flow_stats_get(). */
+struct sw_flow_stats {
+	u64 packet_count;	/* Number of packets matched. */
+	u64 byte_count;		/* Number of bytes matched. */
+	unsigned long used;	/* Last used time (in jiffies). */
+	u8 tcp_flags;		/* Union of seen TCP flags. */
+	struct u64_stats_sync sync;
+};
+
 struct sw_flow {
 	struct rcu_head rcu;
 	struct hlist_node hash_node[2];
@@ -102,11 +112,7 @@ struct sw_flow {
 	struct sw_flow_key key;
 	struct sw_flow_actions __rcu *sf_acts;
 
-	spinlock_t lock;	/* Lock for values below. */
-	unsigned long used;	/* Last used time (in jiffies). */
-	u64 packet_count;	/* Number of packets matched. */
-	u64 byte_count;		/* Number of bytes matched. */
-	u8 tcp_flags;		/* Union of seen TCP flags. */
+	struct sw_flow_stats __percpu *stats;
 };
 
 struct arp_eth_header {
@@ -136,6 +142,9 @@ void ovs_flow_deferred_free_acts(struct sw_flow_actions *);
 int ovs_flow_extract(struct sk_buff *, u16 in_port, struct sw_flow_key *,
 		     int *key_lenp);
 void ovs_flow_used(struct sw_flow *, struct sk_buff *);
+void ovs_flow_stats_get(const struct sw_flow *, struct ovs_flow_stats *,
+			unsigned long *used, u8 *tcp_flags);
+void ovs_flow_stats_clear(struct sw_flow *);
 u64 ovs_flow_used_time(unsigned long flow_jiffies);
 
 /* Upper bound on the length of a nlattr-formatted flow key.  The longest
@@ -112,6 +112,7 @@ struct vport *ovs_vport_alloc(int priv_size, const struct vport_ops *ops,
 {
 	struct vport *vport;
 	size_t alloc_size;
+	int i;
 
 	alloc_size = sizeof(struct vport);
 	if (priv_size) {
@@ -135,6 +136,20 @@ struct vport *ovs_vport_alloc(int priv_size, const struct vport_ops *ops,
 		return ERR_PTR(-ENOMEM);
 	}
 
+	vport->upcall_queue = alloc_percpu(struct vport_upcall_queue);
+	if (!vport->upcall_queue) {
+		free_percpu(vport->percpu_stats);
+		kfree(vport);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	for_each_possible_cpu(i) {
+		struct vport_upcall_queue *q = per_cpu_ptr(vport->upcall_queue, i);
+
+		skb_queue_head_init(&q->skbs);
+		INIT_LIST_HEAD(&q->node);
+	}
+
 	spin_lock_init(&vport->stats_lock);
 
 	return vport;
@@ -152,6 +167,7 @@ struct vport *ovs_vport_alloc(int priv_size, const struct vport_ops *ops,
  */
 void ovs_vport_free(struct vport *vport)
 {
+	free_percpu(vport->upcall_queue);
 	free_percpu(vport->percpu_stats);
 	kfree(vport);
 }
@@ -65,6 +65,20 @@ struct vport_err_stats {
 	u64 tx_errors;
 };
 
+/**
+ * struct vport_upcall_queue - per-CPU queue of upcalls for one vport
+ * @skbs: Netlink messages waiting to be sent to userspace.
+ * @node: Element in the owning CPU's list of vports with pending upcalls.
+ * @dead: Set once the vport has been detached; nothing more is queued.
+ *
+ * Protected by the lock of the datapath's per-CPU upcall state.
+ */
+struct vport_upcall_queue {
+	struct sk_buff_head skbs;
+	struct list_head node;
+	bool dead;
+};
+
 /**
  * struct vport - one port within a datapath
  * @rcu: RCU callback head for deferred destruction.
@@ -76,6 +90,7 @@ struct vport_err_stats {
  * @dp_hash_node: Element in @datapath->ports hash table in datapath.c.
  * @ops: Class structure.
  * @percpu_stats: Points to per-CPU statistics used and maintained by vport
+ * @upcall_queue: Per-CPU queues of upcalls for packets received on this vport
  * @stats_lock: Protects @err_stats;
  * @err_stats: Points to error statistics used and maintained by vport
  */
@@ -90,6 +105,7 @@ struct vport {
 	const struct vport_ops *ops;
 
 	struct vport_percpu_stats __percpu *percpu_stats;
+	struct vport_upcall_queue __percpu *upcall_queue;
 
 	spinlock_t stats_lock;
 	struct vport_err_stats err_stats;
@@ -19,6 +19,8 @@
 #include <linux/rtnetlink.h>
 #include <linux/init.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
 #include <net/act_api.h>
 #include <net/netlink.h>
 
@@ -47,6 +49,52 @@ struct tc_police_compat {
 	struct tc_ratespec	peakrate;
 };
 
+/*
+ * Per-CPU policing.
+ *
+ * With police_percpu set, a policer without peakrate, avrate or rate
+ * estimator stops taking tcf_lock for every packet.  Bytes, packets,
+ * overlimits and drops are counted per CPU and folded into tcf_bstats
+ * and tcf_qstats from ->get_stats, which tcf_action_copy_stats() calls
+ * with tcf_lock held.  Each CPU is handed a slice of the shared token
+ * bucket and spends it locklessly.
+ * Only when its slice runs dry does a CPU take the lock, refill the
+ * shared bucket and grab a new slice.  A CPU that finds the shared
+ * bucket empty reclaims the slices left on other CPUs, at most once
+ * per TCF_POLICE_REBALANCE, so idle CPUs do not hold tokens hostage.
+ * Slices are at most burst/(4*cpus), which bounds the extra burst.
+ */
+static int police_percpu __read_mostly = 0;
+module_param(police_percpu, int, 0640);
+MODULE_PARM_DESC(police_percpu, "Police with per-CPU token slices");
+
+#define TCF_POLICE_REBALANCE	(HZ / 100 ? : 1)
+
+struct tcf_police_stats {
+	u64			bytes;
+	u32			packets;
+	u32			overlimits;
+	u32			drops;
+};
+
+struct tcf_police_cpu {
+	atomic_long_t		toks;	/* token slice owned by this cpu */
+	struct tcf_police_stats	stats;
+	struct u64_stats_sync	syncp;
+	unsigned long		lastuse;
+};
+
+struct tcf_police_ext {
+	struct tcf_police		police;
+	struct tcf_police_cpu __percpu	*cpu;
+	struct tcf_police_stats		folded;	/* already in tcf_bstats */
+	unsigned long			rebalanced;
+	long				quantum;
+	int				percpu;
+};
+
+#define to_police_ext(p)	container_of(p, struct tcf_police_ext, police)
+
 /* Each policer is serialized by its individual spinlock */
 
 static int tcf_act_police_walker(struct sk_buff *skb, struct netlink_callback *cb,
@@ -96,6 +144,15 @@ nla_put_failure:
 	goto done;
 }
 
+static void tcf_police_free_rcu(struct rcu_head *head)
+{
+	struct tcf_police *p = container_of(head, struct tcf_police, tcf_rcu);
+	struct tcf_police_ext *pe = to_police_ext(p);
+
+	free_percpu(pe->cpu);
+	kfree(pe);
+}
+
 static void tcf_police_destroy(struct tcf_police *p)
 {
 	unsigned int h = tcf_hash(p->tcf_index, POL_TAB_MASK);
@@ -116,13 +173,24 @@ static void tcf_police_destroy(struct tcf_police *p)
 			 * gen_estimator est_timer() might access p->tcf_lock
 			 * or bstats, wait a RCU grace period before freeing p
 			 */
-			kfree_rcu(p, tcf_rcu);
+			call_rcu(&p->tcf_rcu, tcf_police_free_rcu);
 			return;
 		}
 	}
 	WARN_ON(1);
 }
 
+/* Take back the token slices left on every cpu, called with tcf_lock held */
+static long tcf_police_reclaim(struct tcf_police_ext *pe)
+{
+	long toks = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		toks += atomic_long_xchg(&per_cpu_ptr(pe->cpu, cpu)->toks, 0);
+	return toks;
+}
+
 static const struct nla_policy police_policy[TCA_POLICE_MAX + 1] = {
 	[TCA_POLICE_RATE]	= { .len = TC_RTAB_SIZE },
 	[TCA_POLICE_PEAKRATE]	= { .len = TC_RTAB_SIZE },
@@ -138,8 +206,10 @@ static int tcf_act_police_locate(struct nlattr *nla, struct nlattr *est,
 	struct nlattr *tb[TCA_POLICE_MAX + 1];
 	struct tc_police *parm;
 	struct tcf_police *police;
+	struct tcf_police_ext *pe;
 	struct qdisc_rate_table *R_tab = NULL, *P_tab = NULL;
-	int size;
+	struct qdisc_rate_table *old_R_tab = NULL, *old_P_tab = NULL;
+	int size, was_percpu, cpu;
 
 	if (nla == NULL)
 		return -EINVAL;
@@ -172,11 +242,20 @@ static int tcf_act_police_locate(struct nlattr *nla, struct nlattr *est,
 		}
 	}
 
-	police = kzalloc(sizeof(*police), GFP_KERNEL);
-	if (police == NULL)
+	pe = kzalloc(sizeof(*pe), GFP_KERNEL);
+	if (pe == NULL)
+		return -ENOMEM;
+	pe->cpu = alloc_percpu(struct tcf_police_cpu);
+	if (pe->cpu == NULL) {
+		kfree(pe);
 		return -ENOMEM;
+	}
+	police = &pe->police;
 	ret = ACT_P_CREATED;
 	police->tcf_refcnt = 1;
+	police->tcf_tm.lastuse = jiffies;
+	for_each_possible_cpu(cpu)
+		per_cpu_ptr(pe->cpu, cpu)->lastuse = police->tcf_tm.lastuse;
 	spin_lock_init(&police->tcf_lock);
 	if (bind)
 		police->tcf_bindcnt = 1;
@@ -195,7 +274,9 @@ override:
 		}
 	}
 
+	pe = to_police_ext(police);
 	spin_lock_bh(&police->tcf_lock);
+	was_percpu = pe->percpu;
 	if (est) {
 		err = gen_replace_estimator(&police->tcf_bstats,
 					    &police->tcf_rate_est,
@@ -212,11 +293,11 @@ override:
 
 	/* No failure allowed after this point */
 	if (R_tab != NULL) {
-		qdisc_put_rtab(police->tcfp_R_tab);
+		old_R_tab = police->tcfp_R_tab;
 		police->tcfp_R_tab = R_tab;
 	}
 	if (P_tab != NULL) {
-		qdisc_put_rtab(police->tcfp_P_tab);
+		old_P_tab = police->tcfp_P_tab;
 		police->tcfp_P_tab = P_tab;
 	}
 
@@ -236,7 +317,25 @@ override:
 	if (tb[TCA_POLICE_AVRATE])
 		police->tcfp_ewma_rate = nla_get_u32(tb[TCA_POLICE_AVRATE]);
 
+	/* Slices handed out under the old parameters are forfeited */
+	tcf_police_reclaim(pe);
+	pe->quantum = police->tcfp_burst / (4 * num_online_cpus());
+	pe->rebalanced = jiffies;
+	pe->percpu = police_percpu && !police->tcfp_P_tab &&
+		     !police->tcfp_ewma_rate &&
+		     !gen_estimator_active(&police->tcf_bstats,
+					   &police->tcf_rate_est);
+
 	spin_unlock_bh(&police->tcf_lock);
+
+	/* Lockless users may still look at the old rate tables */
+	if (was_percpu && (old_R_tab || old_P_tab))
+		synchronize_net();
+	if (old_R_tab)
+		qdisc_put_rtab(old_R_tab);
+	if (old_P_tab)
+		qdisc_put_rtab(old_P_tab);
+
 	if (ret != ACT_P_CREATED)
 		return ret;
 
@@ -259,8 +358,10 @@ failure:
 		qdisc_put_rtab(P_tab);
 	if (R_tab)
 		qdisc_put_rtab(R_tab);
-	if (ret == ACT_P_CREATED)
-		kfree(police);
+	if (ret == ACT_P_CREATED) {
+		free_percpu(pe->cpu);
+		kfree(pe);
+	}
 	return err;
 }
 
@@ -282,6 +383,111 @@ static int tcf_act_police_cleanup(struct tc_action *a, int bind)
 	return ret;
 }
 
+static void tcf_police_cpu_update(struct tcf_police_cpu *c,
+				  const struct sk_buff *skb, int over, int drop)
+{
+	u64_stats_update_begin(&c->syncp);
+	c->stats.bytes += qdisc_pkt_len(skb);
+	c->stats.packets++;
+	c->stats.overlimits += over;
+	c->stats.drops += drop;
+	u64_stats_update_end(&c->syncp);
+	c->lastuse = jiffies;
+}
+
+/* Spend cost tokens from this cpu's slice, if it holds enough */
+static bool tcf_police_take(atomic_long_t *v, long cost)
+{
+	long old, toks = atomic_long_read(v);
+
+	while (toks >= cost) {
+		old = atomic_long_cmpxchg(v, toks, toks - cost);
+		if (old == toks)
+			return true;
+		toks = old;
+	}
+	return false;
+}
+
+/* Slow path of the per-CPU mode: refill from the shared bucket */
+static bool tcf_police_refill(struct tcf_police_ext *pe,
+			      struct tcf_police_cpu *c, long cost)
+{
+	struct tcf_police *police = &pe->police;
+	psched_time_t now;
+	long toks, grant;
+	bool ok = false;
+
+	spin_lock(&police->tcf_lock);
+	now = psched_get_time();
+	toks = psched_tdiff_bounded(now, police->tcfp_t_c,
+				    police->tcfp_burst);
+	toks += police->tcfp_toks;
+	if (toks < cost &&
+	    time_after_eq(jiffies, pe->rebalanced + TCF_POLICE_REBALANCE)) {
+		toks += tcf_police_reclaim(pe);
+		pe->rebalanced = jiffies;
+	}
+	if (toks > (long)police->tcfp_burst)
+		toks = police->tcfp_burst;
+	police->tcfp_t_c = now;
+
+	if (toks >= cost) {
+		toks -= cost;
+		grant = min(toks, pe->quantum);
+		toks -= grant;
+		atomic_long_add(grant, &c->toks);
+		ok = true;
+	}
+	police->tcfp_toks = toks;
+	spin_unlock(&police->tcf_lock);
+	return ok;
+}
+
+/*
+ * Returns 1 if the packet was handled without tcf_lock, with the verdict
+ * in *result, or 0 if it has to go through the locked path.
+ */
+static int tcf_act_police_percpu(struct sk_buff *skb,
+				 struct tcf_police_ext *pe, int *result)
+{
+	struct tcf_police *police = &pe->police;
+	struct qdisc_rate_table *R_tab;
+	struct tcf_police_cpu *c;
+	int action, ret = 1;
+	long cost;
+
+	rcu_read_lock();
+	if (!ACCESS_ONCE(pe->percpu)) {
+		ret = 0;
+		goto out;
+	}
+
+	c = this_cpu_ptr(pe->cpu);
+	action = ACCESS_ONCE(police->tcf_action);
+	if (qdisc_pkt_len(skb) > police->tcfp_mtu)
+		goto over;
+
+	R_tab = ACCESS_ONCE(police->tcfp_R_tab);
+	if (R_tab == NULL)
+		goto conform;
+
+	cost = qdisc_l2t(R_tab, qdisc_pkt_len(skb));
+	if (tcf_police_take(&c->toks, cost) ||
+	    tcf_police_refill(pe, c, cost))
+		goto conform;
+over:
+	tcf_police_cpu_update(c, skb, 1, action == TC_ACT_SHOT);
+	*result = action;
+	goto out;
+conform:
+	tcf_police_cpu_update(c, skb, 0, 0);
+	*result = police->tcfp_result;
+out:
+	rcu_read_unlock();
+	return ret;
+}
+
 static int tcf_act_police(struct sk_buff *skb, const struct tc_action *a,
 			  struct tcf_result *res)
 {
@@ -289,9 +495,14 @@ static int tcf_act_police(struct sk_buff *skb, const struct tc_action *a,
 	psched_time_t now;
 	long toks;
 	long ptoks = 0;
+	int result;
+
+	if (tcf_act_police_percpu(skb, to_police_ext(police), &result))
+		return result;
 
 	spin_lock(&police->tcf_lock);
 
+	police->tcf_tm.lastuse = jiffies;
 	bstats_update(&police->tcf_bstats, skb);
 
 	if (police->tcfp_ewma_rate &&
@@ -338,6 +549,41 @@ static int tcf_act_police(struct sk_buff *skb, const struct tc_action *a,
 	return police->tcf_action;
 }
 
+/* Fold the per-CPU counters in, tcf_action_copy_stats() holds tcf_lock */
+static int tcf_act_police_get_stats(struct sk_buff *skb, struct tc_action *a)
+{
+	struct tcf_police *police = a->priv;
+	struct tcf_police_ext *pe = to_police_ext(police);
+	struct tcf_police_stats sum = { 0 };
+	unsigned int start;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct tcf_police_cpu *c = per_cpu_ptr(pe->cpu, cpu);
+		struct tcf_police_stats st;
+		unsigned long lastuse = ACCESS_ONCE(c->lastuse);
+
+		do {
+			start = u64_stats_fetch_begin_bh(&c->syncp);
+			st = c->stats;
+		} while (u64_stats_fetch_retry_bh(&c->syncp, start));
+
+		sum.bytes += st.bytes;
+		sum.packets += st.packets;
+		sum.overlimits += st.overlimits;
+		sum.drops += st.drops;
+		if (time_after(lastuse, police->tcf_tm.lastuse))
+			police->tcf_tm.lastuse = lastuse;
+	}
+
+	police->tcf_bstats.bytes += sum.bytes - pe->folded.bytes;
+	police->tcf_bstats.packets += sum.packets - pe->folded.packets;
+	police->tcf_qstats.overlimits += sum.overlimits - pe->folded.overlimits;
+	police->tcf_qstats.drops += sum.drops - pe->folded.drops;
+	pe->folded = sum;
+	return 0;
+}
+
 static int
 tcf_act_police_dump(struct sk_buff *skb, struct tc_action *a, int bind, int ref)
 {
@@ -382,6 +628,7 @@ static struct tc_action_ops act_police_ops = {
 	.capab		=	TCA_CAP_NONE,
 	.owner		=	THIS_MODULE,
 	.act		=	tcf_act_police,
+	.get_stats	=	tcf_act_police_get_stats,
 	.dump		=	tcf_act_police_dump,
 	.cleanup	=	tcf_act_police_cleanup,
 	.lookup		=	tcf_hash_search,
@@ -399,6 +646,8 @@ static void __exit
 police_cleanup_module(void)
 {
 	tcf_unregister_action(&act_police_ops);
+	/* Wait for tcf_police_free_rcu() of the policers just destroyed */
+	rcu_barrier();
 }
 
 module_init(police_init_module);
@@ -0,0 +1,724 @@
+/*
+ * net/sched/cls_exact.c	Exact match hash classifier
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * Each filter keys packets on a fixed set of fields (addresses, protocol,
+ * ports, mark) and maps them to a classid with a single lookup in a hash
+ * table of exact entries.  Entries are loaded and removed in bulk, a few
+ * thousand per netlink message, and the table grows as they are added.
+ *
+ * Lookups run under RCU only.  The table is resized by linking every
+ * entry into the new table through its second hash node and publishing
+ * the new table, the same way the openvswitch flow table is rehashed.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/errno.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/vmalloc.h>
+#include <linux/rtnetlink.h>
+#include <linux/skbuff.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/pkt_cls.h>
+#include <net/ip.h>
+#include <net/netlink.h>
+#include <net/act_api.h>
+#include <net/pkt_cls.h>
+
+/* Options of the "exact" classifier */
+enum {
+	TCA_EXACT_UNSPEC,
+	TCA_EXACT_KEYS,		/* u32: FLOW_KEY_* bitmap */
+	TCA_EXACT_ADD,		/* array of struct tc_exact_entry */
+	TCA_EXACT_DEL,		/* array of struct tc_exact_entry */
+	TCA_EXACT_FLUSH,	/* flag: drop all entries first */
+	TCA_EXACT_ACT,
+	TCA_EXACT_POLICE,
+	TCA_EXACT_COUNT,	/* u32: number of entries, dump only */
+	__TCA_EXACT_MAX
+};
+
+#define TCA_EXACT_MAX (__TCA_EXACT_MAX - 1)
+
+/*
+ * An entry as passed from user space.  Fields not selected by the keys
+ * of the filter are ignored; addresses are in network byte order, IPv4
+ * addresses in the first word.
+ */
+struct tc_exact_entry {
+	__be32	src[4];
+	__be32	dst[4];
+	__be16	sport;
+	__be16	dport;
+	__u32	mark;
+	__u8	proto;
+	__u8	family;		/* AF_INET or AF_INET6 if any L3/L4 key */
+	__u16	pad;
+	__u32	classid;
+};
+
+#define EXACT_KEY(k)		(1 << FLOW_KEY_##k)
+#define EXACT_KEYS_PORTS	(EXACT_KEY(PROTO_SRC) | EXACT_KEY(PROTO_DST))
+#define EXACT_KEYS_IP		(EXACT_KEY(SRC) | EXACT_KEY(DST) | \
+				 EXACT_KEY(PROTO) | EXACT_KEYS_PORTS)
+#define EXACT_KEYS_ALL		(EXACT_KEYS_IP | EXACT_KEY(MARK))
+
+#define EXACT_MIN_BUCKETS	64
+#define EXACT_MAX_BUCKETS	(1 << 22)
+
+struct exact_key {
+	__be32			src[4];
+	__be32			dst[4];
+	__be16			sport;
+	__be16			dport;
+	u32			mark;
+	u8			proto;
+	u8			family;
+	u16			pad;
+};
+
+struct exact_entry {
+	struct hlist_node	node[2];
+	struct exact_key	key;
+	u32			classid;
+	struct rcu_head		rcu;
+};
+
+struct exact_table {
+	unsigned int		size;	/* power of two */
+	unsigned int		count;
+	int			ver;	/* entry node used by this table */
+	u32			seed;
+	struct hlist_head	buckets[0];
+};
+
+struct exact_head {
+	struct list_head	filters;
+	u32			hgenerator;
+};
+
+struct exact_filter {
+	struct list_head	list;
+	struct tcf_exts		exts;
+	u32			handle;
+	u32			keymask;
+	struct exact_table __rcu *table;
+};
+
+static const struct tcf_ext_map exact_ext_map = {
+	.action	= TCA_EXACT_ACT,
+	.police	= TCA_EXACT_POLICE,
+};
+
+static struct hlist_head *exact_bucket(const struct exact_table *t,
+				       const struct exact_key *key)
+{
+	u32 hash = jhash2((const u32 *)key, sizeof(*key) / sizeof(u32),
+			  t->seed);
+
+	return (struct hlist_head *)&t->buckets[hash & (t->size - 1)];
+}
+
+static struct exact_entry *exact_lookup(const struct exact_table *t,
+					const struct exact_key *key)
+{
+	struct exact_entry *e;
+	struct hlist_node *n;
+
+	hlist_for_each_entry_rcu(e, n, exact_bucket(t, key), node[t->ver])
+		if (!memcmp(&e->key, key, sizeof(*key)))
+			return e;
+	return NULL;
+}
+
+static bool exact_get_key(const struct sk_buff *skb, u32 keymask,
+			  struct exact_key *key)
+{
+	int nhoff = skb_network_offset(skb);
+	int poff = -1;
+	u8 proto;
+
+	memset(key, 0, sizeof(*key));
+	if (keymask & EXACT_KEY(MARK))
+		key->mark = skb->mark;
+	if (!(keymask & EXACT_KEYS_IP))
+		return true;
+
+	switch (skb->protocol) {
+	case htons(ETH_P_IP): {
+		const struct iphdr *iph;
+		struct iphdr _iph;
+
+		iph = skb_header_pointer(skb, nhoff, sizeof(_iph), &_iph);
+		if (iph == NULL || iph->ihl < 5)
+			return false;
+		key->family = AF_INET;
+		if (keymask & EXACT_KEY(SRC))
+			key->src[0] = iph->saddr;
+		if (keymask & EXACT_KEY(DST))
+			key->dst[0] = iph->daddr;
+		proto = iph->protocol;
+		if (!ip_is_fragment(iph))
+			poff = nhoff + iph->ihl * 4;
+		break;
+	}
+	case htons(ETH_P_IPV6): {
+		const struct ipv6hdr *iph;
+		struct ipv6hdr _iph;
+
+		iph = skb_header_pointer(skb, nhoff, sizeof(_iph), &_iph);
+		if (iph == NULL)
+			return false;
+		key->family = AF_INET6;
+		if (keymask & EXACT_KEY(SRC))
+			memcpy(key->src, &iph->saddr, sizeof(key->src));
+		if (keymask & EXACT_KEY(DST))
+			memcpy(key->dst, &iph->daddr, sizeof(key->dst));
+		proto = iph->nexthdr;
+		poff = nhoff + sizeof(*iph);
+		break;
+	}
+	default:
+		return false;
+	}
+
+	if (keymask & EXACT_KEY(PROTO))
+		key->proto = proto;
+	if (keymask & EXACT_KEYS_PORTS) {
+		const __be16 *ports;
+		__be16 _ports[2];
+		int off = proto_ports_offset(proto);
+
+		if (poff < 0 || off < 0)
+			return false;
+		ports = skb_header_pointer(skb, poff + off, sizeof(_ports),
+					   _ports);
+		if (ports == NULL)
+			return false;
+		if (keymask & EXACT_KEY(PROTO_SRC))
+			key->sport = ports[0];
+		if (keymask & EXACT_KEY(PROTO_DST))
+			key->dport = ports[1];
+	}
+	return true;
+}
+
+static int exact_classify(struct sk_buff *skb, const struct tcf_proto *tp,
+			  struct tcf_result *res)
+{
+	struct exact_head *head = tp->root;
+	const struct exact_table *t;
+	struct exact_filter *f;
+	struct exact_entry *e;
+	struct exact_key key;
+	int r;
+
+	list_for_each_entry_rcu(f, &head->filters, list) {
+		if (!exact_get_key(skb, f->keymask, &key))
+			continue;
+		t = rcu_dereference_bh(f->table);
+		e = exact_lookup(t, &key);
+		if (e == NULL)
+			continue;
+
+		res->class = 0;
+		res->classid = ACCESS_ONCE(e->classid);
+
+		r = tcf_exts_exec(skb, &f->exts, res);
+		if (r < 0)
+			continue;
+		return r;
+	}
+	return -1;
+}
+
+static struct exact_table *exact_table_alloc(unsigned int size)
+{
+	struct exact_table *t;
+	size_t sz = sizeof(*t) + size * sizeof(struct hlist_head);
+
+	t = kzalloc(sz, GFP_KERNEL | __GFP_NOWARN);
+	if (t == NULL)
+		t = vzalloc(sz);
+	if (t == NULL)
+		return NULL;
+	t->size = size;
+	return t;
+}
+
+static void exact_table_free(struct exact_table *t)
+{
+	if (is_vmalloc_addr(t))
+		vfree(t);
+	else
+		kfree(t);
+}
+
+/* Called under RTNL; readers keep walking the old table meanwhile */
+static int exact_table_resize(struct exact_filter *f, unsigned int size)
+{
+	struct exact_table *old = rtnl_dereference(f->table);
+	struct exact_table *new;
+	struct exact_entry *e;
+	struct hlist_node *n;
+	unsigned int i;
+
+	new = exact_table_alloc(size);
+	if (new == NULL)
+		return -ENOMEM;
+	new->ver = !old->ver;
+	new->count = old->count;
+	get_random_bytes(&new->seed, sizeof(new->seed));
+
+	for (i = 0; i < old->size; i++)
+		hlist_for_each_entry(e, n, &old->buckets[i], node[old->ver])
+			hlist_add_head_rcu(&e->node[new->ver],
+					   exact_bucket(new, &e->key));
+
+	rcu_assign_pointer(f->table, new);
+	synchronize_net();
+	exact_table_free(old);
+	return 0;
+}
+
+static void exact_table_flush(struct exact_table *t)
+{
+	struct exact_entry *e;
+	struct hlist_node *n, *next;
+	unsigned int i;
+
+	for (i = 0; i < t->size; i++) {
+		hlist_for_each_entry_safe(e, n, next, &t->buckets[i],
+					  node[t->ver]) {
+			hlist_del_rcu(&e->node[t->ver]);
+			kfree_rcu(e, rcu);
+		}
+	}
+	t->count = 0;
+}
+
+static void exact_entry_key(const struct tc_exact_entry *ent, u32 keymask,
+			    struct exact_key *key)
+{
+	memset(key, 0, sizeof(*key));
+	if (keymask & EXACT_KEY(MARK))
+		key->mark = ent->mark;
+	if (!(keymask & EXACT_KEYS_IP))
+		return;
+
+	key->family = ent->family;
+	if (keymask & EXACT_KEY(SRC))
+		memcpy(key->src, ent->src,
+		       ent->family == AF_INET ? 4 : sizeof(key->src));
+	if (keymask & EXACT_KEY(DST))
+		memcpy(key->dst, ent->dst,
+		       ent->family == AF_INET ? 4 : sizeof(key->dst));
+	if (keymask & EXACT_KEY(PROTO))
+		key->proto = ent->proto;
+	if (keymask & EXACT_KEY(PROTO_SRC))
+		key->sport = ent->sport;
+	if (keymask & EXACT_KEY(PROTO_DST))
+		key->dport = ent->dport;
+}
+
+static int exact_check_entries(const struct nlattr *attr, u32 keymask)
+{
+	const struct tc_exact_entry *ent = nla_data(attr);
+	unsigned int i, n;
+
+	if (nla_len(attr) % sizeof(*ent))
+		return -EINVAL;
+	n = nla_len(attr) / sizeof(*ent);
+
+	if (!(keymask & EXACT_KEYS_IP))
+		return n;
+	for (i = 0; i < n; i++)
+		if (ent[i].family != AF_INET && ent[i].family != AF_INET6)
+			return -EAFNOSUPPORT;
+	return n;
+}
+
+static void exact_del_entries(struct exact_filter *f, const struct nlattr *attr)
+{
+	struct exact_table *t = rtnl_dereference(f->table);
+	const struct tc_exact_entry *ent = nla_data(attr);
+	unsigned int i, n = nla_len(attr) / sizeof(*ent);
+	struct exact_entry *e;
+	struct exact_key key;
+
+	for (i = 0; i < n; i++) {
+		exact_entry_key(&ent[i], f->keymask, &key);
+		e = exact_lookup(t, &key);
+		if (e == NULL)
+			continue;
+		hlist_del_rcu(&e->node[t->ver]);
+		kfree_rcu(e, rcu);
+		t->count--;
+	}
+}
+
+/*
+ * Entries are allocated before the filter is touched, so that a load
+ * that fails leaves it as it was.  Returns the number of entries in
+ * *entries, keyed for keymask.
+ */
+static int exact_alloc_entries(const struct nlattr *attr, u32 keymask,
+			       struct exact_entry ***entries)
+{
+	const struct tc_exact_entry *ent = nla_data(attr);
+	unsigned int i, n = nla_len(attr) / sizeof(*ent);
+	struct exact_entry **new;
+
+	*entries = NULL;
+	if (n == 0)
+		return 0;
+	new = kcalloc(n, sizeof(*new), GFP_KERNEL);
+	if (new == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		new[i] = kmalloc(sizeof(*new[i]), GFP_KERNEL);
+		if (new[i] == NULL) {
+			while (i-- > 0)
+				kfree(new[i]);
+			kfree(new);
+			return -ENOMEM;
+		}
+		exact_entry_key(&ent[i], keymask, &new[i]->key);
+		new[i]->classid = ent[i].classid;
+	}
+
+	*entries = new;
+	return n;
+}
+
+/*
+ * Link entries from exact_alloc_entries() and free the array.  Cannot
+ * fail: existing keys just get their classid updated, and growing the
+ * table is best effort.
+ */
+static void exact_add_entries(struct exact_filter *f,
+			      struct exact_entry **new, unsigned int n)
+{
+	struct exact_table *t = rtnl_dereference(f->table);
+	struct exact_entry *e;
+	unsigned int i, size;
+
+	for (i = 0; i < n; i++) {
+		e = exact_lookup(t, &new[i]->key);
+		if (e != NULL) {
+			ACCESS_ONCE(e->classid) = new[i]->classid;
+			continue;
+		}
+		hlist_add_head_rcu(&new[i]->node[t->ver],
+				   exact_bucket(t, &new[i]->key));
+		new[i] = NULL;
+		t->count++;
+	}
+
+	/* Keep about one entry per bucket */
+	size = t->size;
+	while (size < t->count && size < EXACT_MAX_BUCKETS)
+		size <<= 1;
+	if (size != t->size)
+		exact_table_resize(f, size);
+
+	for (i = 0; i < n; i++)
+		kfree(new[i]);
+	kfree(new);
+}
+
+static unsigned long exact_get(struct tcf_proto *tp, u32 handle)
+{
+	struct exact_head *head = tp->root;
+	struct exact_filter *f;
+
+	list_for_each_entry(f, &head->filters, list)
+		if (f->handle == handle)
+			return (unsigned long)f;
+	return 0;
+}
+
+static void exact_put(struct tcf_proto *tp, unsigned long f)
+{
+}
+
+static int exact_init(struct tcf_proto *tp)
+{
+	struct exact_head *head;
+
+	head = kzalloc(sizeof(*head), GFP_KERNEL);
+	if (head == NULL)
+		return -ENOBUFS;
+	INIT_LIST_HEAD(&head->filters);
+	tp->root = head;
+	return 0;
+}
+
+static void exact_destroy_filter(struct tcf_proto *tp, struct exact_filter *f)
+{
+	struct exact_table *t = rtnl_dereference(f->table);
+
+	tcf_exts_destroy(tp, &f->exts);
+	exact_table_flush(t);
+	synchronize_net();
+	exact_table_free(t);
+	kfree(f);
+}
+
+static void exact_destroy(struct tcf_proto *tp)
+{
+	struct exact_head *head = tp->root;
+	struct exact_filter *f, *next;
+
+	list_for_each_entry_safe(f, next, &head->filters, list) {
+		list_del(&f->list);
+		exact_destroy_filter(tp, f);
+	}
+	kfree(head);
+}
+
+static int exact_delete(struct tcf_proto *tp, unsigned long arg)
+{
+	struct exact_filter *f = (struct exact_filter *)arg;
+
+	tcf_tree_lock(tp);
+	list_del_rcu(&f->list);
+	tcf_tree_unlock(tp);
+	synchronize_net();
+
+	exact_destroy_filter(tp, f);
+	return 0;
+}
+
+static const struct nla_policy exact_policy[TCA_EXACT_MAX + 1] = {
+	[TCA_EXACT_KEYS]	= { .type = NLA_U32 },
+	[TCA_EXACT_ADD]		= { .type = NLA_BINARY },
+	[TCA_EXACT_DEL]		= { .type = NLA_BINARY },
+	[TCA_EXACT_FLUSH]	= { .type = NLA_FLAG },
+	[TCA_EXACT_ACT]		= { .type = NLA_NESTED },
+	[TCA_EXACT_POLICE]	= { .type = NLA_NESTED },
+};
+
+static int exact_change(struct sk_buff *in_skb,
+			struct tcf_proto *tp, unsigned long base,
+			u32 handle, struct nlattr **tca,
+			unsigned long *arg)
+{
+	struct exact_head *head = tp->root;
+	struct exact_filter *f = (struct exact_filter *)*arg;
+	struct nlattr *opt = tca[TCA_OPTIONS];
+	struct nlattr *tb[TCA_EXACT_MAX + 1];
+	struct exact_table *t;
+	struct exact_entry **entries = NULL;
+	struct tcf_exts e;
+	u32 keymask = 0;
+	int nadd = 0;
+	int err;
+
+	if (opt == NULL)
+		return -EINVAL;
+
+	err = nla_parse_nested(tb, TCA_EXACT_MAX, opt, exact_policy);
+	if (err < 0)
+		return err;
+
+	if (f != NULL) {
+		if (handle && f->handle != handle)
+			return -EINVAL;
+		keymask = f->keymask;
+		t = rtnl_dereference(f->table);
+		if (tb[TCA_EXACT_KEYS] &&
+		    nla_get_u32(tb[TCA_EXACT_KEYS]) != keymask &&
+		    t->count && !tb[TCA_EXACT_FLUSH])
+			return -EBUSY;
+	} else if (!tb[TCA_EXACT_KEYS])
+		return -EINVAL;
+
+	if (tb[TCA_EXACT_KEYS]) {
+		keymask = nla_get_u32(tb[TCA_EXACT_KEYS]);
+		if (!keymask || keymask & ~EXACT_KEYS_ALL)
+			return -EOPNOTSUPP;
+	}
+
+	if (tb[TCA_EXACT_ADD]) {
+		err = exact_check_entries(tb[TCA_EXACT_ADD], keymask);
+		if (err < 0)
+			return err;
+	}
+	if (tb[TCA_EXACT_DEL]) {
+		err = exact_check_entries(tb[TCA_EXACT_DEL], keymask);
+		if (err < 0)
+			return err;
+	}
+
+	err = tcf_exts_validate(tp, tb, tca[TCA_RATE], &e, &exact_ext_map);
+	if (err < 0)
+		return err;
+
+	/* Nothing below may fail once the filter has been modified */
+	if (tb[TCA_EXACT_ADD]) {
+		nadd = exact_alloc_entries(tb[TCA_EXACT_ADD], keymask,
+					   &entries);
+		if (nadd < 0) {
+			err = nadd;
+			goto err1;
+		}
+	}
+
+	if (f == NULL) {
+		err = -ENOBUFS;
+		f = kzalloc(sizeof(*f), GFP_KERNEL);
+		if (f == NULL)
+			goto err1;
+		t = exact_table_alloc(EXACT_MIN_BUCKETS);
+		if (t == NULL)
+			goto err2;
+		get_random_bytes(&t->seed, sizeof(t->seed));
+		RCU_INIT_POINTER(f->table, t);
+		f->keymask = keymask;
+
+		err = -EINVAL;
+		if (handle)
+			f->handle = handle;
+		else {
+			unsigned int i = 0x80000000;
+
+			do {
+				if (++head->hgenerator == 0x7FFFFFFF)
+					head->hgenerator = 1;
+			} while (--i > 0 && exact_get(tp, head->hgenerator));
+
+			if (i == 0)
+				goto err3;
+			f->handle = head->hgenerator;
+		}
+	}
+
+	t = rtnl_dereference(f->table);
+	if (tb[TCA_EXACT_FLUSH])
+		exact_table_flush(t);
+	f->keymask = keymask;
+	if (tb[TCA_EXACT_DEL])
+		exact_del_entries(f, tb[TCA_EXACT_DEL]);
+	if (entries != NULL)
+		exact_add_entries(f, entries, nadd);
+
+	tcf_exts_change(tp, &f->exts, &e);
+
+	if (*arg == 0) {
+		tcf_tree_lock(tp);
+		list_add_tail_rcu(&f->list, &head->filters);
+		tcf_tree_unlock(tp);
+	}
+
+	*arg = (unsigned long)f;
+	return 0;
+
+err3:
+	exact_table_free(t);
+err2:
+	kfree(f);
+err1:
+	if (entries != NULL) {
+		while (nadd-- > 0)
+			kfree(entries[nadd]);
+		kfree(entries);
+	}
+	tcf_exts_destroy(tp, &e);
+	return err;
+}
+
+static int exact_dump(struct tcf_proto *tp, unsigned long fh,
+		      struct sk_buff *skb, struct tcmsg *t)
+{
+	struct exact_filter *f = (struct exact_filter *)fh;
+	struct nlattr *nest;
+
+	if (f == NULL)
+		return skb->len;
+
+	t->tcm_handle = f->handle;
+
+	nest = nla_nest_start(skb, TCA_OPTIONS);
+	if (nest == NULL)
+		goto nla_put_failure;
+
+	/* Entries are not dumped, there may be millions of them */
+	if (nla_put_u32(skb, TCA_EXACT_KEYS, f->keymask) ||
+	    nla_put_u32(skb, TCA_EXACT_COUNT,
+			rtnl_dereference(f->table)->count))
+		goto nla_put_failure;
+
+	if (tcf_exts_dump(skb, &f->exts, &exact_ext_map) < 0)
+		goto nla_put_failure;
+
+	nla_nest_end(skb, nest);
+
+	if (tcf_exts_dump_stats(skb, &f->exts, &exact_ext_map) < 0)
+		goto nla_put_failure;
+
+	return skb->len;
+
+nla_put_failure:
+	nla_nest_cancel(skb, nest);
+	return -1;
+}
+
+static void exact_walk(struct tcf_proto *tp, struct tcf_walker *arg)
+{
+	struct exact_head *head = tp->root;
+	struct exact_filter *f;
+
+	list_for_each_entry(f, &head->filters, list) {
+		if (arg->count < arg->skip)
+			goto skip;
+		if (arg->fn(tp, (unsigned long)f, arg) < 0) {
+			arg->stop = 1;
+			break;
+		}
+skip:
+		arg->count++;
+	}
+}
+
+static struct tcf_proto_ops cls_exact_ops __read_mostly = {
+	.kind		= "exact",
+	.classify	= exact_classify,
+	.init		= exact_init,
+	.destroy	= exact_destroy,
+	.get		= exact_get,
+	.put		= exact_put,
+	.change		= exact_change,
+	.delete		= exact_delete,
+	.walk		= exact_walk,
+	.dump		= exact_dump,
+	.owner		= THIS_MODULE,
+};
+
+static int __init cls_exact_init(void)
+{
+	return register_tcf_proto_ops(&cls_exact_ops);
+}
+
+static void __exit cls_exact_exit(void)
+{
+	unregister_tcf_proto_ops(&cls_exact_ops);
+}
+
+module_init(cls_exact_init);
+module_exit(cls_exact_exit);
+
+MODULE_DESCRIPTION("TC exact match hash classifier");
+MODULE_LICENSE("GPL");
@@ -29,12 +29,15 @@
 #include <linux/hrtimer.h>
 #include <linux/lockdep.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 
 #include <net/net_namespace.h>
 #include <net/sock.h>
 #include <net/netlink.h>
 #include <net/pkt_sched.h>
 
+#include "sch_class_hash.h"
+
 static int qdisc_notify(struct net *net, struct sk_buff *oskb,
 			struct nlmsghdr *n, u32 clid,
 			struct Qdisc *old, struct Qdisc *new);
@@ -521,9 +524,16 @@ static struct hlist_head *qdisc_class_hash_alloc(unsigned int n)
 
 	if (size <= PAGE_SIZE)
 		h = kmalloc(size, GFP_KERNEL);
-	else
+	else {
 		h = (struct hlist_head *)
-			__get_free_pages(GFP_KERNEL, get_order(size));
+			__get_free_pages(GFP_KERNEL | __GFP_NOWARN,
+					 get_order(size));
+		/* Tables for tens of thousands of classes: don't need
+		 * contiguous pages.
+		 */
+		if (h == NULL)
+			h = vmalloc(size);
+	}
 
 	if (h != NULL) {
 		for (i = 0; i < n; i++)
@@ -538,22 +548,22 @@ static void qdisc_class_hash_free(struct hlist_head *h, unsigned int n)
 
 	if (size <= PAGE_SIZE)
 		kfree(h);
+	else if (is_vmalloc_addr(h))
+		vfree(h);
 	else
 		free_pages((unsigned long)h, get_order(size));
 }
 
-void qdisc_class_hash_grow(struct Qdisc *sch, struct Qdisc_class_hash *clhash)
+static void qdisc_class_hash_rehash(struct Qdisc *sch,
+				    struct Qdisc_class_hash *clhash,
+				    unsigned int nsize)
 {
 	struct Qdisc_class_common *cl;
 	struct hlist_node *n, *next;
 	struct hlist_head *nhash, *ohash;
-	unsigned int nsize, nmask, osize;
+	unsigned int nmask, osize;
 	unsigned int i, h;
 
-	/* Rehash when load factor exceeds 0.75 */
-	if (clhash->hashelems * 4 <= clhash->hashsize * 3)
-		return;
-	nsize = clhash->hashsize * 2;
 	nmask = nsize - 1;
 	nhash = qdisc_class_hash_alloc(nsize);
 	if (nhash == NULL)
@@ -576,8 +586,31 @@ void qdisc_class_hash_grow(struct Qdisc *sch, struct Qdisc_class_hash *clhash)
 
 	qdisc_class_hash_free(ohash, osize);
 }
+
+void qdisc_class_hash_grow(struct Qdisc *sch, struct Qdisc_class_hash *clhash)
+{
+	/* Rehash when load factor exceeds 0.75 */
+	if (clhash->hashelems * 4 <= clhash->hashsize * 3)
+		return;
+	qdisc_class_hash_rehash(sch, clhash, clhash->hashsize * 2);
+}
 EXPORT_SYMBOL(qdisc_class_hash_grow);
 
+/*
+ * Halve the class hash when its load factor drops below 0.125.  Called
+ * after classes are removed, outside the tree lock, by the qdiscs that
+ * expect their class count to shrink a lot (drr, qfq).
+ */
+void qdisc_class_hash_shrink(struct Qdisc *sch,
+			     struct Qdisc_class_hash *clhash)
+{
+	if (clhash->hashelems * 8 >= clhash->hashsize ||
+	    clhash->hashsize <= 4)
+		return;
+	qdisc_class_hash_rehash(sch, clhash, clhash->hashsize / 2);
+}
+EXPORT_SYMBOL(qdisc_class_hash_shrink);
+
 int qdisc_class_hash_init(struct Qdisc_class_hash *clhash)
 {
 	unsigned int size = 4;
@@ -0,0 +1,13 @@
+#ifndef _SCH_CLASS_HASH_H
+#define _SCH_CLASS_HASH_H
+
+#include <net/sch_generic.h>
+
+/*
+ * qdisc_class_hash_grow() only ever doubles a class hash.  Qdiscs whose
+ * class count can also drop a lot call this after deleting classes.
+ */
+extern void qdisc_class_hash_shrink(struct Qdisc *sch,
+				    struct Qdisc_class_hash *clhash);
+
+#endif
@@ -18,21 +18,27 @@
 #include <net/pkt_sched.h>
 #include <net/pkt_cls.h>
 
+#include "sch_class_hash.h"
+
+/* Fields used per packet come right after the hash linkage */
 struct drr_class {
 	struct Qdisc_class_common	common;
-	unsigned int			refcnt;
-	unsigned int			filter_cnt;
-
-	struct gnet_stats_basic_packed		bstats;
-	struct gnet_stats_queue		qstats;
-	struct gnet_stats_rate_est	rate_est;
 	struct list_head		alist;
 	struct Qdisc			*qdisc;
-
 	u32				quantum;
 	u32				deficit;
+
+	struct gnet_stats_basic_packed		bstats;
+	struct gnet_stats_queue		qstats;
+
+	unsigned int			refcnt;
+	unsigned int			filter_cnt;
+	struct gnet_stats_rate_est	rate_est;
 };
 
+/* Classes come from their own cache so that many of them pack densely */
+static struct kmem_cache *drr_class_cachep __read_mostly;
+
 struct drr_sched {
 	struct list_head		active;
 	struct tcf_proto		*filter_list;
@@ -103,7 +109,7 @@ static int drr_change_class(struct Qdisc *sch, u32 classid, u32 parentid,
 		return 0;
 	}
 
-	cl = kzalloc(sizeof(struct drr_class), GFP_KERNEL);
+	cl = kmem_cache_zalloc(drr_class_cachep, GFP_KERNEL);
 	if (cl == NULL)
 		return -ENOBUFS;
 
@@ -121,7 +127,7 @@ static int drr_change_class(struct Qdisc *sch, u32 classid, u32 parentid,
 					    tca[TCA_RATE]);
 		if (err) {
 			qdisc_destroy(cl->qdisc);
-			kfree(cl);
+			kmem_cache_free(drr_class_cachep, cl);
 			return err;
 		}
 	}
@@ -140,7 +146,7 @@ static void drr_destroy_class(struct Qdisc *sch, struct drr_class *cl)
 {
 	gen_kill_estimator(&cl->bstats, &cl->rate_est);
 	qdisc_destroy(cl->qdisc);
-	kfree(cl);
+	kmem_cache_free(drr_class_cachep, cl);
 }
 
 static int drr_delete_class(struct Qdisc *sch, unsigned long arg)
@@ -163,6 +169,8 @@ static int drr_delete_class(struct Qdisc *sch, unsigned long arg)
 	 */
 
 	sch_tree_unlock(sch);
+
+	qdisc_class_hash_shrink(sch, &q->clhash);
 	return 0;
 }
 
@@ -513,12 +521,22 @@ static struct Qdisc_ops drr_qdisc_ops __read_mostly = {
 
 static int __init drr_init(void)
 {
-	return register_qdisc(&drr_qdisc_ops);
+	int err;
+
+	drr_class_cachep = KMEM_CACHE(drr_class, 0);
+	if (drr_class_cachep == NULL)
+		return -ENOMEM;
+
+	err = register_qdisc(&drr_qdisc_ops);
+	if (err)
+		kmem_cache_destroy(drr_class_cachep);
+	return err;
 }
 
 static void __exit drr_exit(void)
 {
 	unregister_qdisc(&drr_qdisc_ops);
+	kmem_cache_destroy(drr_class_cachep);
 }
 
 module_init(drr_init);
@@ -25,8 +25,11 @@
 #include <linux/rcupdate.h>
 #include <linux/list.h>
 #include <linux/slab.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <net/pkt_sched.h>
 #include <net/dst.h>
+#include <net/net_namespace.h>
 
 /* Main transmission queue. */
 
@@ -39,9 +42,56 @@
  * - updates to tree and tree walking are only done under the rtnl mutex.
  */
 
+/*
+ * Bulk dequeue: a root qdisc feeding a single TX queue hands the driver
+ * several skbs per qdisc_restart(), up to qdisc_bulk_bytes (and to what
+ * BQL says the queue can take), all dequeued under one root lock hold
+ * and transmitted under one TX lock hold.  The skb the driver refuses is
+ * requeued on q->gso_skb as usual, the rest of the bulk on the requeue
+ * list behind it.  Off by default.
+ */
+static int qdisc_bulk_bytes __read_mostly;
+module_param(qdisc_bulk_bytes, int, 0644);
+MODULE_PARM_DESC(qdisc_bulk_bytes, "Byte budget of a bulk dequeue, 0 to disable");
+
+struct qdisc_bulk_stats {
+	u64	batches;
+	u64	packets;
+	u64	bytes;
+	u32	max;
+};
+
+/* Lives behind the private area of every qdisc from qdisc_alloc() */
+struct qdisc_bulk {
+	struct sk_buff_head	requeue;	/* behind q->gso_skb */
+	struct qdisc_bulk_stats	stats;
+};
+
+static inline struct qdisc_bulk *qdisc_bulk(const struct Qdisc *q)
+{
+	return (struct qdisc_bulk *)
+		((char *)qdisc_priv((struct Qdisc *)q) +
+		 QDISC_ALIGN(q->ops->priv_size));
+}
+
+static inline struct qdisc_bulk_stats *qdisc_bulk_stats(const struct Qdisc *q)
+{
+	return &qdisc_bulk(q)->stats;
+}
+
+/*
+ * The skb always came off q->gso_skb, so it goes back in front of
+ * whatever dequeue_skb() moved up there from the requeue list.  Only
+ * q->gso_skb may carry GSO segments on skb->next, the skbs on the
+ * requeue list were never handed to the driver.  Child qdiscs use
+ * q->gso_skb for qdisc_peek_dequeued() and never requeue here, so
+ * their requeue list stays empty.
+ */
 static inline int dev_requeue_skb(struct sk_buff *skb, struct Qdisc *q)
 {
 	skb_dst_force(skb);
+	if (q->gso_skb)
+		__skb_queue_head(&qdisc_bulk(q)->requeue, q->gso_skb);
 	q->gso_skb = skb;
 	q->qstats.requeues++;
 	q->q.qlen++;	/* it's still part of the queue */
@@ -50,6 +100,30 @@ static inline int dev_requeue_skb(struct sk_buff *skb, struct Qdisc *q)
 	return 0;
 }
 
+/* Requeue skb and, behind it, what is left of a bulk */
+static int dev_requeue_bulk(struct sk_buff *skb, struct sk_buff_head *rest,
+			    struct Qdisc *q)
+{
+	struct sk_buff *n;
+
+	skb_queue_walk(rest, n)
+		skb_dst_force(n);
+	q->q.qlen += skb_queue_len(rest);
+	skb_queue_splice_init(rest, &qdisc_bulk(q)->requeue);
+
+	return dev_requeue_skb(skb, q);
+}
+
+/* The requeue list is only used while q->gso_skb is set */
+static void qdisc_free_requeued(struct Qdisc *q)
+{
+	if (!q->gso_skb)
+		return;
+	kfree_skb(q->gso_skb);
+	q->gso_skb = NULL;
+	__skb_queue_purge(&qdisc_bulk(q)->requeue);
+}
+
 static inline struct sk_buff *dequeue_skb(struct Qdisc *q)
 {
 	struct sk_buff *skb = q->gso_skb;
@@ -59,7 +133,7 @@ static inline struct sk_buff *dequeue_skb(struct Qdisc *q)
 		/* check the reason of requeuing without tx lock first */
 		txq = netdev_get_tx_queue(txq->dev, skb_get_queue_mapping(skb));
 		if (!netif_xmit_frozen_or_stopped(txq)) {
-			q->gso_skb = NULL;
+			q->gso_skb = __skb_dequeue(&qdisc_bulk(q)->requeue);
 			q->q.qlen--;
 		} else
 			skb = NULL;
@@ -147,6 +221,88 @@ int sch_direct_xmit(struct sk_buff *skb, struct Qdisc *q,
 	return ret;
 }
 
+static int qdisc_bulk_budget(const struct Qdisc *q,
+			     const struct net_device *dev,
+			     const struct netdev_queue *txq)
+{
+	int budget = qdisc_bulk_bytes;
+
+	if (budget <= 0 || !(q->flags & TCQ_F_ONETXQUEUE) ||
+	    (q->flags & TCQ_F_BUILTIN) || (dev->features & NETIF_F_LLTX))
+		return 0;
+#ifdef CONFIG_BQL
+	budget = min_t(int, budget, dql_avail(&txq->dql));
+#endif
+	return budget;
+}
+
+/* Dequeue behind the skb already on bulk, returns the number of skbs */
+static int qdisc_dequeue_bulk(struct Qdisc *q, struct sk_buff_head *bulk,
+			      int budget)
+{
+	struct qdisc_bulk_stats *st = qdisc_bulk_stats(q);
+	struct sk_buff *skb = skb_peek(bulk);
+	int bytes = skb->len;
+
+	while (bytes < budget) {
+		skb = q->dequeue(q);
+		if (skb == NULL)
+			break;
+		__skb_queue_tail(bulk, skb);
+		bytes += skb->len;
+	}
+
+	st->batches++;
+	st->packets += skb_queue_len(bulk);
+	st->bytes += bytes;
+	if (skb_queue_len(bulk) > st->max)
+		st->max = skb_queue_len(bulk);
+	return skb_queue_len(bulk);
+}
+
+/*
+ * sch_direct_xmit() for a bulk: the driver gets every skb under a single
+ * TX lock hold.  Same return values as sch_direct_xmit().
+ */
+static int sch_bulk_xmit(struct sk_buff_head *bulk, struct Qdisc *q,
+			 struct net_device *dev, struct netdev_queue *txq,
+			 spinlock_t *root_lock)
+{
+	struct sk_buff *skb;
+	int ret = NETDEV_TX_OK;
+
+	/* And release qdisc */
+	spin_unlock(root_lock);
+
+	HARD_TX_LOCK(dev, txq, smp_processor_id());
+	while ((skb = __skb_dequeue(bulk)) != NULL) {
+		ret = NETDEV_TX_BUSY;
+		if (!netif_xmit_frozen_or_stopped(txq))
+			ret = dev_hard_start_xmit(skb, dev, txq);
+		if (!dev_xmit_complete(ret))
+			break;
+	}
+	HARD_TX_UNLOCK(dev, txq);
+
+	spin_lock(root_lock);
+
+	if (skb == NULL) {
+		ret = qdisc_qlen(q);
+	} else {
+		/* Driver returned NETDEV_TX_BUSY - requeue the rest */
+		if (unlikely(ret != NETDEV_TX_BUSY))
+			net_warn_ratelimited("BUG %s code %d qlen %d\n",
+					     dev->name, ret, q->q.qlen);
+
+		ret = dev_requeue_bulk(skb, bulk, q);
+	}
+
+	if (ret && netif_xmit_frozen_or_stopped(txq))
+		ret = 0;
+
+	return ret;
+}
+
 /*
  * NOTE: Called under qdisc_lock(q) with locally disabled BH.
  *
@@ -161,17 +317,22 @@ int sch_direct_xmit(struct sk_buff *skb, struct Qdisc *q,
  *
  * Note, that this procedure can be called by a watchdog timer
  *
+ * *packets is set to the number of skbs handed to the driver.
+ *
  * Returns to the caller:
  *				0  - queue is empty or throttled.
  *				>0 - queue is not empty.
  *
  */
-static inline int qdisc_restart(struct Qdisc *q)
+static inline int qdisc_restart(struct Qdisc *q, int *packets)
 {
 	struct netdev_queue *txq;
 	struct net_device *dev;
 	spinlock_t *root_lock;
+	struct sk_buff_head bulk;
 	struct sk_buff *skb;
+	bool requeued = q->gso_skb != NULL;
+	int budget;
 
 	/* Dequeue packet */
 	skb = dequeue_skb(q);
@@ -182,20 +343,31 @@ static inline int qdisc_restart(struct Qdisc *q)
 	dev = qdisc_dev(q);
 	txq = netdev_get_tx_queue(dev, skb_get_queue_mapping(skb));
 
-	return sch_direct_xmit(skb, q, dev, txq, root_lock);
+	*packets = 1;
+	budget = requeued ? 0 : qdisc_bulk_budget(q, dev, txq);
+	if (budget <= (int)skb->len)
+		return sch_direct_xmit(skb, q, dev, txq, root_lock);
+
+	__skb_queue_head_init(&bulk);
+	__skb_queue_tail(&bulk, skb);
+	*packets = qdisc_dequeue_bulk(q, &bulk, budget);
+
+	return sch_bulk_xmit(&bulk, q, dev, txq, root_lock);
 }
 
 void __qdisc_run(struct Qdisc *q)
 {
 	int quota = weight_p;
+	int packets;
 
-	while (qdisc_restart(q)) {
+	while (qdisc_restart(q, &packets)) {
 		/*
 		 * Ordered by possible occurrence: Postpone processing if
 		 * 1. we've exceeded packet quota
 		 * 2. another process needs the CPU;
 		 */
-		if (--quota <= 0 || need_resched()) {
+		quota -= packets;
+		if (quota <= 0 || need_resched()) {
 			__netif_schedule(q);
 			break;
 		}
@@ -533,7 +705,9 @@ struct Qdisc *qdisc_alloc(struct netdev_queue *dev_queue,
 {
 	void *p;
 	struct Qdisc *sch;
-	unsigned int size = QDISC_ALIGN(sizeof(*sch)) + ops->priv_size;
+	unsigned int size = QDISC_ALIGN(sizeof(*sch)) +
+			    QDISC_ALIGN(ops->priv_size) +
+			    sizeof(struct qdisc_bulk);
 	int err = -ENOBUFS;
 	struct net_device *dev = dev_queue->dev;
 
@@ -561,6 +735,7 @@ struct Qdisc *qdisc_alloc(struct netdev_queue *dev_queue,
 			  dev->qdisc_tx_busylock ?: &qdisc_tx_busylock);
 
 	sch->ops = ops;
+	skb_queue_head_init(&qdisc_bulk(sch)->requeue);
 	sch->enqueue = ops->enqueue;
 	sch->dequeue = ops->dequeue;
 	sch->dev_queue = dev_queue;
@@ -601,8 +776,7 @@ void qdisc_reset(struct Qdisc *qdisc)
 		ops->reset(qdisc);
 
 	if (qdisc->gso_skb) {
-		kfree_skb(qdisc->gso_skb);
-		qdisc->gso_skb = NULL;
+		qdisc_free_requeued(qdisc);
 		qdisc->q.qlen = 0;
 	}
 }
@@ -637,7 +811,7 @@ void qdisc_destroy(struct Qdisc *qdisc)
 	module_put(ops->owner);
 	dev_put(qdisc_dev(qdisc));
 
-	kfree_skb(qdisc->gso_skb);
+	qdisc_free_requeued(qdisc);
 	/*
 	 * gen_estimator est_timer() might access qdisc->q.lock,
 	 * wait a RCU grace period before freeing qdisc.
@@ -896,3 +1070,83 @@ void dev_shutdown(struct net_device *dev)
 
 	WARN_ON(timer_pending(&dev->watchdog_timer));
 }
+
+#ifdef CONFIG_PROC_FS
+static void qdisc_bulk_show_queue(struct seq_file *seq,
+				  const struct net_device *dev,
+				  unsigned int i, struct Qdisc *q)
+{
+	struct qdisc_bulk_stats st;
+
+	if (q->flags & TCQ_F_BUILTIN)
+		return;
+
+	spin_lock_bh(qdisc_lock(q));
+	st = *qdisc_bulk_stats(q);
+	spin_unlock_bh(qdisc_lock(q));
+
+	seq_printf(seq, "%-16s %4u %08x %-16s %10llu %12llu %16llu %6u\n",
+		   dev->name, i, q->handle, q->ops->id,
+		   st.batches, st.packets, st.bytes, st.max);
+}
+
+static int qdisc_bulk_show(struct seq_file *seq, void *v)
+{
+	struct net *net = seq_file_net(seq);
+	struct net_device *dev;
+	struct Qdisc *q;
+	unsigned int i;
+
+	seq_puts(seq, "Device           TXQ  Handle   Qdisc               "
+		      "Batches      Packets            Bytes    Max\n");
+
+	rtnl_lock();
+	for_each_netdev(net, dev) {
+		for (i = 0; i < dev->num_tx_queues; i++) {
+			q = netdev_get_tx_queue(dev, i)->qdisc_sleeping;
+			/* A root shared by all queues is listed once */
+			if (i && q == netdev_get_tx_queue(dev, 0)->qdisc_sleeping)
+				break;
+			qdisc_bulk_show_queue(seq, dev, i, q);
+		}
+	}
+	rtnl_unlock();
+	return 0;
+}
+
+static int qdisc_bulk_open(struct inode *inode, struct file *file)
+{
+	return single_open_net(inode, file, qdisc_bulk_show);
+}
+
+static const struct file_operations qdisc_bulk_fops = {
+	.owner	 = THIS_MODULE,
+	.open	 = qdisc_bulk_open,
+	.read	 = seq_read,
+	.llseek	 = seq_lseek,
+	.release = single_release_net,
+};
+
+static int __net_init qdisc_bulk_net_init(struct net *net)
+{
+	if (!proc_net_fops_create(net, "qdisc_bulk", 0, &qdisc_bulk_fops))
+		return -ENOMEM;
+	return 0;
+}
+
+static void __net_exit qdisc_bulk_net_exit(struct net *net)
+{
+	proc_net_remove(net, "qdisc_bulk");
+}
+
+static struct pernet_operations qdisc_bulk_net_ops = {
+	.init = qdisc_bulk_net_init,
+	.exit = qdisc_bulk_net_exit,
+};
+
+static int __init qdisc_bulk_init(void)
+{
+	return register_pernet_subsys(&qdisc_bulk_net_ops);
+}
+subsys_initcall(qdisc_bulk_init);
+#endif /* CONFIG_PROC_FS */
@@ -37,6 +37,7 @@
 #include <linux/rbtree.h>
 #include <linux/workqueue.h>
 #include <linux/slab.h>
+#include <linux/rtnetlink.h>
 #include <net/netlink.h>
 #include <net/pkt_sched.h>
 
@@ -51,6 +52,15 @@
     Each class is assigned level. Leaf has ALWAYS level 0 and root
     classes have level TC_HTB_MAXDEPTH-1. Interior nodes has level
     one less than their parent.
+
+    Multiqueue sharing:
+    With htb_mq_share set, HTB qdiscs attached to the classes of the
+    same multiqueue root (mq, mqprio) form a group, one per TX queue
+    each with its own lock. Classes with the same minor id in the
+    group share their configured rate and ceil: each one gets a part
+    of them proportional to its recent demand (bytes sent and leaf
+    backlog), reconciled every HTB_MQ_SHARE_INTERVAL. Every member is
+    expected to be configured with the same hierarchy.
 */
 
 static int htb_hysteresis __read_mostly = 0; /* whether to use mode hysteresis for speedup */
@@ -60,9 +70,28 @@ static int htb_hysteresis __read_mostly = 0; /* whether to use mode hysteresis f
 #error "Mismatched sch_htb.c and pkt_sch.h"
 #endif
 
+static int htb_mq_share __read_mostly = 0; /* share class rates across TX queues */
+
 /* Module parameter and sysfs export */
 module_param    (htb_hysteresis, int, 0640);
 MODULE_PARM_DESC(htb_hysteresis, "Hysteresis mode, less CPU load, less accurate");
+module_param    (htb_mq_share, int, 0640);
+MODULE_PARM_DESC(htb_mq_share, "Share class rates between HTBs of a multiqueue root");
+
+#define HTB_MQ_SHARE_INTERVAL	(HZ / 4)
+
+/* HTB qdiscs sharing class rates under a multiqueue root, see above */
+struct htb_mq_group {
+	struct list_head list;		/* global list of groups */
+	struct net_device *dev;
+	u32 parent;			/* handle of the multiqueue root */
+	struct list_head members;	/* htb_sched.mq_node */
+	unsigned int nr_members;
+	struct delayed_work work;	/* rate reconciliation */
+};
+
+/* protected by RTNL */
+static LIST_HEAD(htb_mq_groups);
 
 /* used internaly to keep status of single class */
 enum htb_cmode {
@@ -130,6 +159,12 @@ struct htb_class {
 	psched_tdiff_t mbuffer;	/* max wait time */
 	s64 tokens, ctokens;	/* current number of tokens */
 	psched_time_t t_c;	/* checkpoint time */
+
+	/* configured rates; rate and ceil hold our share in a mq group */
+	u64 cfg_rate_bps, cfg_ceil_bps;
+	u64 share_bytes;	/* bstats.bytes at last reconciliation */
+	u64 share_demand;	/* bytes wanted since last reconciliation */
+	u64 share_sum;		/* demand of the group, in the first member */
 };
 
 struct htb_sched {
@@ -166,6 +201,9 @@ struct htb_sched {
 #define HTB_WARN_TOOMANYEVENTS	0x1
 	unsigned int warned;	/* only one warning */
 	struct work_struct work;
+
+	struct htb_mq_group *mq_group;	/* NULL if not sharing rates */
+	struct list_head mq_node;
 };
 
 static u64 l2t_ns(struct htb_rate_cfg *r, unsigned int len)
@@ -1036,6 +1074,173 @@ static void htb_work_func(struct work_struct *work)
 	__netif_schedule(qdisc_root(sch));
 }
 
+/* Set the share of the configured rates of cl, weight is in 1/65536 */
+static void htb_mq_share_set(struct htb_class *cl, u32 weight)
+{
+	cl->rate.rate_bps = max_t(u64, (cl->cfg_rate_bps * weight) >> 16, 8);
+	cl->ceil.rate_bps = max_t(u64, (cl->cfg_ceil_bps * weight) >> 16, 8);
+	htb_precompute_ratedata(&cl->rate);
+	htb_precompute_ratedata(&cl->ceil);
+}
+
+/* Returns the class of the first member sharing its rates with cl */
+static struct htb_class *htb_mq_share_peer(struct Qdisc *first,
+					   struct htb_class *cl)
+{
+	return htb_find(TC_H_MAKE(first->handle,
+				  TC_H_MIN(cl->common.classid)), first);
+}
+
+/* Record the demand of each class since the last reconciliation */
+static void htb_mq_share_gather(struct htb_sched *q)
+{
+	struct Qdisc *sch = q->watchdog.qdisc;
+	spinlock_t *root_lock = qdisc_root_sleeping_lock(sch);
+	struct htb_class *cl;
+	struct hlist_node *n;
+	unsigned int i;
+
+	spin_lock_bh(root_lock);
+	for (i = 0; i < q->clhash.hashsize; i++) {
+		hlist_for_each_entry(cl, n, &q->clhash.hash[i], common.hnode) {
+			cl->share_demand = cl->bstats.bytes - cl->share_bytes;
+			cl->share_bytes = cl->bstats.bytes;
+			if (!cl->level)
+				cl->share_demand += cl->un.leaf.q->qstats.backlog;
+			cl->share_sum = cl->share_demand;
+		}
+	}
+	spin_unlock_bh(root_lock);
+}
+
+/* Add the demand of the classes of q to their peers in first */
+static void htb_mq_share_sum(struct Qdisc *first, struct htb_sched *q)
+{
+	struct htb_class *cl, *peer;
+	struct hlist_node *n;
+	unsigned int i;
+
+	for (i = 0; i < q->clhash.hashsize; i++) {
+		hlist_for_each_entry(cl, n, &q->clhash.hash[i], common.hnode) {
+			peer = htb_mq_share_peer(first, cl);
+			if (peer)
+				peer->share_sum += cl->share_demand;
+		}
+	}
+}
+
+/* Give each class of q its part of the group demand. Idle members
+ * keep a floor so that they can start sending before the next run.
+ */
+static void htb_mq_share_apply(struct Qdisc *first, struct htb_sched *q,
+			       unsigned int nr_members)
+{
+	struct Qdisc *sch = q->watchdog.qdisc;
+	spinlock_t *root_lock = qdisc_root_sleeping_lock(sch);
+	struct htb_class *cl, *peer;
+	struct hlist_node *n;
+	unsigned int i;
+	u64 floor;
+
+	spin_lock_bh(root_lock);
+	for (i = 0; i < q->clhash.hashsize; i++) {
+		hlist_for_each_entry(cl, n, &q->clhash.hash[i], common.hnode) {
+			peer = htb_mq_share_peer(first, cl);
+			if (!peer) {
+				/* not in the first member: not shared */
+				htb_mq_share_set(cl, 1 << 16);
+				continue;
+			}
+			floor = div64_u64(peer->share_sum, nr_members * 8) + 1;
+			htb_mq_share_set(cl,
+				div64_u64((cl->share_demand + floor) << 16,
+					  peer->share_sum + nr_members * floor));
+		}
+	}
+	spin_unlock_bh(root_lock);
+}
+
+static void htb_mq_share_work(struct work_struct *work)
+{
+	struct htb_mq_group *g = container_of(work, struct htb_mq_group,
+					      work.work);
+	struct htb_sched *q;
+	struct Qdisc *first;
+
+	/* RTNL keeps the members and their classes; the destroy path
+	 * cancels us while holding it.
+	 */
+	if (!rtnl_trylock())
+		goto out;
+
+	list_for_each_entry(q, &g->members, mq_node)
+		htb_mq_share_gather(q);
+
+	q = list_first_entry(&g->members, struct htb_sched, mq_node);
+	first = q->watchdog.qdisc;
+	list_for_each_entry_continue(q, &g->members, mq_node)
+		htb_mq_share_sum(first, q);
+
+	list_for_each_entry(q, &g->members, mq_node)
+		htb_mq_share_apply(first, q, g->nr_members);
+
+	rtnl_unlock();
+out:
+	schedule_delayed_work(&g->work, HTB_MQ_SHARE_INTERVAL);
+}
+
+static int htb_mq_join(struct Qdisc *sch)
+{
+	struct htb_sched *q = qdisc_priv(sch);
+	struct net_device *dev = qdisc_dev(sch);
+	struct Qdisc *root = dev->qdisc;
+	struct htb_mq_group *g;
+
+	ASSERT_RTNL();
+
+	/* only for HTBs attached to the classes of a multiqueue root */
+	if (sch->parent == TC_H_ROOT || !root->ops->attach ||
+	    TC_H_MAJ(sch->parent) != root->handle)
+		return 0;
+
+	list_for_each_entry(g, &htb_mq_groups, list) {
+		if (g->dev == dev && g->parent == root->handle)
+			goto found;
+	}
+
+	g = kzalloc(sizeof(*g), GFP_KERNEL);
+	if (!g)
+		return -ENOMEM;
+	g->dev = dev;
+	g->parent = root->handle;
+	INIT_LIST_HEAD(&g->members);
+	INIT_DELAYED_WORK(&g->work, htb_mq_share_work);
+	list_add(&g->list, &htb_mq_groups);
+	schedule_delayed_work(&g->work, HTB_MQ_SHARE_INTERVAL);
+
+found:
+	list_add_tail(&q->mq_node, &g->members);
+	g->nr_members++;
+	q->mq_group = g;
+	return 0;
+}
+
+static void htb_mq_leave(struct htb_sched *q)
+{
+	struct htb_mq_group *g = q->mq_group;
+
+	ASSERT_RTNL();
+
+	list_del(&q->mq_node);
+	q->mq_group = NULL;
+	if (--g->nr_members)
+		return;
+
+	cancel_delayed_work_sync(&g->work);
+	list_del(&g->list);
+	kfree(g);
+}
+
 static int htb_init(struct Qdisc *sch, struct nlattr *opt)
 {
 	struct htb_sched *q = qdisc_priv(sch);
@@ -1080,6 +1285,14 @@ static int htb_init(struct Qdisc *sch, struct nlattr *opt)
 		q->rate2quantum = 1;
 	q->defcls = gopt->defcls;
 
+	if (htb_mq_share) {
+		err = htb_mq_join(sch);
+		if (err < 0) {
+			qdisc_class_hash_destroy(&q->clhash);
+			return err;
+		}
+	}
+
 	return 0;
 }
 
@@ -1134,9 +1347,9 @@ static int htb_dump_class(struct Qdisc *sch, unsigned long arg,
 
 	memset(&opt, 0, sizeof(opt));
 
-	opt.rate.rate = cl->rate.rate_bps >> 3;
+	opt.rate.rate = cl->cfg_rate_bps >> 3;
 	opt.buffer = cl->buffer;
-	opt.ceil.rate = cl->ceil.rate_bps >> 3;
+	opt.ceil.rate = cl->cfg_ceil_bps >> 3;
 	opt.cbuffer = cl->cbuffer;
 	opt.quantum = cl->quantum;
 	opt.prio = cl->prio;
@@ -1266,6 +1479,8 @@ static void htb_destroy(struct Qdisc *sch)
 	struct htb_class *cl;
 	unsigned int i;
 
+	if (q->mq_group)
+		htb_mq_leave(q);
 	cancel_work_sync(&q->work);
 	qdisc_watchdog_cancel(&q->watchdog);
 	/* This line used to be after htb_destroy_class call below
@@ -1506,11 +1721,12 @@ static int htb_change_class(struct Qdisc *sch, u32 classid,
 	cl->buffer = hopt->buffer;
 	cl->cbuffer = hopt->cbuffer;
 
-	cl->rate.rate_bps = (u64)hopt->rate.rate << 3;
-	cl->ceil.rate_bps = (u64)hopt->ceil.rate << 3;
+	cl->cfg_rate_bps = (u64)hopt->rate.rate << 3;
+	cl->cfg_ceil_bps = (u64)hopt->ceil.rate << 3;
 
-	htb_precompute_ratedata(&cl->rate);
-	htb_precompute_ratedata(&cl->ceil);
+	/* in a mq group, start with an even share until reconciled */
+	htb_mq_share_set(cl, q->mq_group ?
+			 (1 << 16) / q->mq_group->nr_members : 1 << 16);
 
 	cl->buffer = hopt->buffer << PSCHED_SHIFT;
 	cl->cbuffer = hopt->buffer << PSCHED_SHIFT;
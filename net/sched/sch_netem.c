@@ -23,6 +23,7 @@
 #include <linux/vmalloc.h>
 #include <linux/rtnetlink.h>
 #include <linux/reciprocal_div.h>
+#include <linux/rbtree.h>
 
 #include <net/netlink.h>
 #include <net/pkt_sched.h>
@@ -68,7 +69,11 @@
 */
 
 struct netem_sched_data {
-	/* internal t(ime)fifo qdisc uses sch->q and sch->limit */
+	/* internal t(ime)fifo qdisc uses t_root and sch->limit; sch->q
+	 * only holds reordered packets, which are sent first.
+	 */
+	struct rb_root t_root;
+	struct rb_node *t_head;		/* leftmost node of t_root */
 
 	/* optional qdisc for classful handling (NULL at netem init) */
 	struct Qdisc	*qdisc;
@@ -128,6 +133,7 @@ struct netem_sched_data {
  */
 struct netem_skb_cb {
 	psched_time_t	time_to_send;
+	ktime_t		tstamp_save;
 };
 
 static inline struct netem_skb_cb *netem_skb_cb(struct sk_buff *skb)
@@ -136,6 +142,26 @@ static inline struct netem_skb_cb *netem_skb_cb(struct sk_buff *skb)
 	return (struct netem_skb_cb *)qdisc_skb_cb(skb)->data;
 }
 
+/* While an skb sits in the tfifo rbtree, its rb_node overlays the
+ * next, prev and tstamp fields at the head of struct sk_buff, which
+ * are not used meanwhile. tstamp is saved in netem_skb_cb.
+ */
+static inline struct rb_node *netem_rb_node(struct sk_buff *skb)
+{
+	BUILD_BUG_ON(offsetof(struct sk_buff, next) != 0);
+	BUILD_BUG_ON(offsetof(struct sk_buff, prev) != sizeof(skb->next));
+	BUILD_BUG_ON(offsetof(struct sk_buff, tstamp) !=
+		     offsetof(struct sk_buff, prev) + sizeof(skb->prev));
+	BUILD_BUG_ON(sizeof(struct rb_node) >
+		     offsetof(struct sk_buff, tstamp) + sizeof(skb->tstamp));
+	return (struct rb_node *)skb;
+}
+
+static inline struct sk_buff *netem_rb_to_skb(struct rb_node *rb)
+{
+	return (struct sk_buff *)rb;
+}
+
 /* init_crandom - initialize correlated random number generator
  * Use entropy source for initial seed.
  */
@@ -331,22 +357,92 @@ static psched_time_t packet_len_2_sched_time(unsigned int len, struct netem_sche
 	return PSCHED_NS2TICKS(ticks);
 }
 
+/* Insert an skb in the time ordered tree, after the skbs with the same
+ * time_to_send, in O(log n).
+ */
 static void tfifo_enqueue(struct sk_buff *nskb, struct Qdisc *sch)
 {
-	struct sk_buff_head *list = &sch->q;
+	struct netem_sched_data *q = qdisc_priv(sch);
 	psched_time_t tnext = netem_skb_cb(nskb)->time_to_send;
-	struct sk_buff *skb = skb_peek_tail(list);
+	struct rb_node **p = &q->t_root.rb_node, *parent = NULL;
+	bool leftmost = true;
+
+	while (*p) {
+		struct sk_buff *skb;
+
+		parent = *p;
+		skb = netem_rb_to_skb(parent);
+		if (tnext >= netem_skb_cb(skb)->time_to_send) {
+			p = &parent->rb_right;
+			leftmost = false;
+		} else {
+			p = &parent->rb_left;
+		}
+	}
 
-	/* Optimize for add at tail */
-	if (likely(!skb || tnext >= netem_skb_cb(skb)->time_to_send))
-		return __skb_queue_tail(list, nskb);
+	netem_skb_cb(nskb)->tstamp_save = nskb->tstamp;
+	rb_link_node(netem_rb_node(nskb), parent, p);
+	rb_insert_color(netem_rb_node(nskb), &q->t_root);
+	if (leftmost)
+		q->t_head = netem_rb_node(nskb);
+	sch->q.qlen++;
+}
 
-	skb_queue_reverse_walk(list, skb) {
-		if (tnext >= netem_skb_cb(skb)->time_to_send)
-			break;
-	}
+/* Remove an skb from the time ordered tree and restore its fields */
+static void tfifo_erase(struct Qdisc *sch, struct sk_buff *skb)
+{
+	struct netem_sched_data *q = qdisc_priv(sch);
+	struct rb_node *p = netem_rb_node(skb);
+
+	if (q->t_head == p)
+		q->t_head = rb_next(p);
+	rb_erase(p, &q->t_root);
+	sch->q.qlen--;
+
+	skb->next = NULL;
+	skb->prev = NULL;
+	skb->tstamp = netem_skb_cb(skb)->tstamp_save;
+}
+
+/* Next skb to send: reordered packets first, then the earliest one */
+static struct sk_buff *tfifo_peek(struct Qdisc *sch)
+{
+	struct netem_sched_data *q = qdisc_priv(sch);
 
-	__skb_queue_after(list, skb, nskb);
+	if (!skb_queue_empty(&sch->q))
+		return skb_peek(&sch->q);
+	return q->t_head ? netem_rb_to_skb(q->t_head) : NULL;
+}
+
+/* Last skb to send */
+static struct sk_buff *tfifo_peek_tail(struct Qdisc *sch)
+{
+	struct netem_sched_data *q = qdisc_priv(sch);
+
+	if (q->t_head)
+		return netem_rb_to_skb(rb_last(&q->t_root));
+	return skb_peek_tail(&sch->q);
+}
+
+/* Unlink the skb returned by tfifo_peek() */
+static void tfifo_unlink(struct sk_buff *skb, struct Qdisc *sch)
+{
+	if (!skb_queue_empty(&sch->q))
+		__skb_unlink(skb, &sch->q);
+	else
+		tfifo_erase(sch, skb);
+}
+
+static void tfifo_reset(struct Qdisc *sch)
+{
+	struct netem_sched_data *q = qdisc_priv(sch);
+	struct sk_buff *skb;
+
+	while (q->t_head) {
+		skb = netem_rb_to_skb(q->t_head);
+		tfifo_erase(sch, skb);
+		kfree_skb(skb);
+	}
 }
 
 /*
@@ -436,19 +532,17 @@ static int netem_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 		now = psched_get_time();
 
 		if (q->rate) {
-			struct sk_buff_head *list = &sch->q;
-
 			delay += packet_len_2_sched_time(skb->len, q);
 
-			if (!skb_queue_empty(list)) {
+			if (sch->q.qlen) {
 				/*
 				 * Last packet in queue is reference point (now).
 				 * First packet in queue is already in flight,
 				 * calculate this time bonus and substract
 				 * from delay.
 				 */
-				delay -= now - netem_skb_cb(skb_peek(list))->time_to_send;
-				now = netem_skb_cb(skb_peek_tail(list))->time_to_send;
+				delay -= now - netem_skb_cb(tfifo_peek(sch))->time_to_send;
+				now = netem_skb_cb(tfifo_peek_tail(sch))->time_to_send;
 			}
 		}
 
@@ -473,9 +567,22 @@ static int netem_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 static unsigned int netem_drop(struct Qdisc *sch)
 {
 	struct netem_sched_data *q = qdisc_priv(sch);
+	struct sk_buff *skb;
 	unsigned int len;
 
-	len = qdisc_queue_drop(sch);
+	/* Drop the last packet to send, as a sorted list would */
+	skb = tfifo_peek_tail(sch);
+	if (skb) {
+		if (q->t_head)
+			tfifo_erase(sch, skb);
+		else
+			__skb_unlink(skb, &sch->q);
+		len = qdisc_pkt_len(skb);
+		sch->qstats.backlog -= len;
+		kfree_skb(skb);
+	} else {
+		len = 0;
+	}
 	if (!len && q->qdisc && q->qdisc->ops->drop)
 	    len = q->qdisc->ops->drop(q->qdisc);
 	if (len)
@@ -493,13 +600,13 @@ static struct sk_buff *netem_dequeue(struct Qdisc *sch)
 		return NULL;
 
 tfifo_dequeue:
-	skb = qdisc_peek_head(sch);
+	skb = tfifo_peek(sch);
 	if (skb) {
 		const struct netem_skb_cb *cb = netem_skb_cb(skb);
 
 		/* if more time remaining? */
 		if (cb->time_to_send <= psched_get_time()) {
-			__skb_unlink(skb, &sch->q);
+			tfifo_unlink(skb, sch);
 			sch->qstats.backlog -= qdisc_pkt_len(skb);
 
 #ifdef CONFIG_NET_CLS_ACT
@@ -549,6 +656,7 @@ static void netem_reset(struct Qdisc *sch)
 	struct netem_sched_data *q = qdisc_priv(sch);
 
 	qdisc_reset_queue(sch);
+	tfifo_reset(sch);
 	if (q->qdisc)
 		qdisc_reset(q->qdisc);
 	qdisc_watchdog_cancel(&q->watchdog);
@@ -795,6 +903,8 @@ static int netem_init(struct Qdisc *sch, struct nlattr *opt)
 
 	qdisc_watchdog_init(&q->watchdog, sch);
 
+	q->t_root = RB_ROOT;
+	q->t_head = NULL;
 	q->loss_model = CLG_RANDOM;
 	ret = netem_change(sch, opt);
 	if (ret)
@@ -12,6 +12,7 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/bitops.h>
+#include <linux/slab.h>
 #include <linux/errno.h>
 #include <linux/netdevice.h>
 #include <linux/pkt_sched.h>
@@ -19,6 +20,7 @@
 #include <net/pkt_sched.h>
 #include <net/pkt_cls.h>
 
+#include "sch_class_hash.h"
 
 /*  Quick Fair Queueing Plus
     ========================
@@ -133,16 +135,18 @@ struct qfq_aggregate;
 struct qfq_class {
 	struct Qdisc_class_common common;
 
-	unsigned int refcnt;
-	unsigned int filter_cnt;
-
-	struct gnet_stats_basic_packed bstats;
-	struct gnet_stats_queue qstats;
-	struct gnet_stats_rate_est rate_est;
+	/* Fields used per packet. */
 	struct Qdisc *qdisc;
 	struct list_head alist;		/* Link for active-classes list. */
 	struct qfq_aggregate *agg;	/* Parent aggregate. */
 	int deficit;			/* DRR deficit counter. */
+
+	struct gnet_stats_basic_packed bstats;
+	struct gnet_stats_queue qstats;
+
+	unsigned int refcnt;
+	unsigned int filter_cnt;
+	struct gnet_stats_rate_est rate_est;
 };
 
 struct qfq_aggregate {
@@ -170,6 +174,13 @@ struct qfq_aggregate {
 	struct hlist_node nonfull_next;	/* See nonfull_aggs in qfq_sched. */
 };
 
+/*
+ * Classes and aggregates come from their own caches, so that the
+ * hundreds of thousands of them a large setup needs pack densely.
+ */
+static struct kmem_cache *qfq_class_cachep __read_mostly;
+static struct kmem_cache *qfq_agg_cachep __read_mostly;
+
 struct qfq_group {
 	u64 S, F;			/* group timestamps (approx). */
 	unsigned int slot_shift;	/* Slot shift. */
@@ -339,7 +350,7 @@ static void qfq_destroy_agg(struct qfq_sched *q, struct qfq_aggregate *agg)
 		hlist_del_init(&agg->nonfull_next);
 	if (q->in_serv_agg == agg)
 		q->in_serv_agg = qfq_choose_next_agg(q);
-	kfree(agg);
+	kmem_cache_free(qfq_agg_cachep, agg);
 }
 
 /* Deschedule class from within its parent aggregate. */
@@ -383,7 +394,7 @@ static int qfq_change_agg(struct Qdisc *sch, struct qfq_class *cl, u32 weight,
 	struct qfq_aggregate *new_agg = qfq_find_agg(q, lmax, weight);
 
 	if (new_agg == NULL) { /* create new aggregate */
-		new_agg = kzalloc(sizeof(*new_agg), GFP_ATOMIC);
+		new_agg = kmem_cache_zalloc(qfq_agg_cachep, GFP_ATOMIC);
 		if (new_agg == NULL)
 			return -ENOBUFS;
 		qfq_init_agg(q, new_agg, lmax, weight);
@@ -462,7 +473,7 @@ static int qfq_change_class(struct Qdisc *sch, u32 classid, u32 parentid,
 	}
 
 	/* create and init new class */
-	cl = kzalloc(sizeof(struct qfq_class), GFP_KERNEL);
+	cl = kmem_cache_zalloc(qfq_class_cachep, GFP_KERNEL);
 	if (cl == NULL)
 		return -ENOBUFS;
 
@@ -494,7 +505,7 @@ set_change_agg:
 	new_agg = qfq_find_agg(q, lmax, weight);
 	if (new_agg == NULL) { /* create new aggregate */
 		sch_tree_unlock(sch);
-		new_agg = kzalloc(sizeof(*new_agg), GFP_KERNEL);
+		new_agg = kmem_cache_zalloc(qfq_agg_cachep, GFP_KERNEL);
 		if (new_agg == NULL) {
 			err = -ENOBUFS;
 			gen_kill_estimator(&cl->bstats, &cl->rate_est);
@@ -513,7 +524,7 @@ set_change_agg:
 
 destroy_class:
 	qdisc_destroy(cl->qdisc);
-	kfree(cl);
+	kmem_cache_free(qfq_class_cachep, cl);
 	return err;
 }
 
@@ -524,7 +535,7 @@ static void qfq_destroy_class(struct Qdisc *sch, struct qfq_class *cl)
 	qfq_rm_from_agg(q, cl);
 	gen_kill_estimator(&cl->bstats, &cl->rate_est);
 	qdisc_destroy(cl->qdisc);
-	kfree(cl);
+	kmem_cache_free(qfq_class_cachep, cl);
 }
 
 static int qfq_delete_class(struct Qdisc *sch, unsigned long arg)
@@ -547,6 +558,8 @@ static int qfq_delete_class(struct Qdisc *sch, unsigned long arg)
 	 */
 
 	sch_tree_unlock(sch);
+
+	qdisc_class_hash_shrink(sch, &q->clhash);
 	return 0;
 }
 
@@ -1523,12 +1536,33 @@ static struct Qdisc_ops qfq_qdisc_ops __read_mostly = {
 
 static int __init qfq_init(void)
 {
-	return register_qdisc(&qfq_qdisc_ops);
+	int err = -ENOMEM;
+
+	qfq_class_cachep = KMEM_CACHE(qfq_class, 0);
+	if (qfq_class_cachep == NULL)
+		goto err1;
+	qfq_agg_cachep = KMEM_CACHE(qfq_aggregate, 0);
+	if (qfq_agg_cachep == NULL)
+		goto err2;
+
+	err = register_qdisc(&qfq_qdisc_ops);
+	if (err)
+		goto err3;
+	return 0;
+
+err3:
+	kmem_cache_destroy(qfq_agg_cachep);
+err2:
+	kmem_cache_destroy(qfq_class_cachep);
+err1:
+	return err;
 }
 
 static void __exit qfq_exit(void)
 {
 	unregister_qdisc(&qfq_qdisc_ops);
+	kmem_cache_destroy(qfq_agg_cachep);
+	kmem_cache_destroy(qfq_class_cachep);
 }
 
 module_init(qfq_init);
@@ -18,6 +18,8 @@
 #include <linux/string.h>
 #include <linux/errno.h>
 #include <linux/skbuff.h>
+#include <linux/hrtimer.h>
+#include <linux/percpu.h>
 #include <net/netlink.h>
 #include <net/pkt_sched.h>
 
@@ -95,8 +97,52 @@
 	With classful TBF, limit is just kept for backwards compatibility.
 	It is passed to the default bfifo qdisc - if the inner qdisc is
 	changed the limit is not effective anymore.
+
+
+	EDT MODE.
+	---------
+
+	With tbf_edt set when the qdisc is created, the bucket is run at
+	enqueue instead: each packet is stamped in skb->tstamp with the
+	earliest time it may leave, and dequeue only compares the stamp of
+	the head packet with the clock.  Let E be the time at which the
+	bucket was (or will be) empty, so that N(t) = min{B/R, t - E}.
+	A packet of size S then departs at d = max{now, E + S/R} and moves
+	E to max{E, d - B/R} + S/R; the peak rate bucket works the same
+	with depth M.
+
+	A throttled instance does not arm its own watchdog but is put on a
+	per-CPU wheel of TBF_WHEEL_SLOTS slots, 2^TBF_WHEEL_SHIFT ns wide,
+	driven by a single hrtimer.  All instances due in the same slot
+	are woken by one timer interrupt.  Stamps only make sense with a
+	FIFO inner qdisc, as with the default bfifo.
 */
 
+static int tbf_edt __read_mostly = 0;
+module_param(tbf_edt, int, 0640);
+MODULE_PARM_DESC(tbf_edt, "Use departure time stamping for new tbf qdiscs");
+
+#define TBF_WHEEL_SHIFT		16	/* 65.536 us slots */
+#define TBF_WHEEL_SLOTS		256
+#define TBF_WHEEL_MASK		(TBF_WHEEL_SLOTS - 1)
+
+struct tbf_wheel {
+	spinlock_t		lock;
+	struct hrtimer		timer;
+	u64			next;	/* slot the timer is armed for */
+	unsigned int		pending;
+	struct list_head	slots[TBF_WHEEL_SLOTS];
+};
+
+static DEFINE_PER_CPU(struct tbf_wheel, tbf_wheels);
+
+struct tbf_wheel_entry {
+	struct list_head	list;
+	struct tbf_wheel	*wheel;	/* NULL if not queued */
+	u64			slot;
+	struct Qdisc		*sch;
+};
+
 struct tbf_sched_data {
 /* Parameters */
 	u32		limit;		/* Maximal length of backlog: bytes */
@@ -112,19 +158,144 @@ struct tbf_sched_data {
 	psched_time_t	t_c;		/* Time check-point */
 	struct Qdisc	*qdisc;		/* Inner qdisc, default - bfifo queue */
 	struct qdisc_watchdog watchdog;	/* Watchdog timer */
+
+/* EDT mode */
+	int		edt;
+	psched_time_t	t_empty;	/* E of the rate bucket */
+	psched_time_t	t_pempty;	/* E of the peak rate bucket */
+	struct tbf_wheel_entry wentry;
 };
 
 #define L2T(q, L)   qdisc_l2t((q)->R_tab, L)
 #define L2T_P(q, L) qdisc_l2t((q)->P_tab, L)
 
+static void tbf_wheel_cancel(struct tbf_wheel_entry *e)
+{
+	struct tbf_wheel *w;
+	unsigned long flags;
+
+	w = ACCESS_ONCE(e->wheel);
+	if (w == NULL)
+		return;
+
+	spin_lock_irqsave(&w->lock, flags);
+	if (e->wheel == w) {
+		list_del(&e->list);
+		e->wheel = NULL;
+		w->pending--;
+	}
+	spin_unlock_irqrestore(&w->lock, flags);
+}
+
+/* Wake sch at or shortly after expires (in ns) from this cpu's wheel */
+static void tbf_wheel_schedule(struct tbf_wheel_entry *e, u64 expires)
+{
+	struct Qdisc *sch = e->sch;
+	struct tbf_wheel *w;
+	unsigned long flags;
+	u64 slot, now;
+
+	if (test_bit(__QDISC_STATE_DEACTIVATED,
+		     &qdisc_root_sleeping(sch)->state))
+		return;
+
+	qdisc_throttled(sch);
+
+	/* Round up so that the timer never fires before expires */
+	slot = (expires + (1ULL << TBF_WHEEL_SHIFT) - 1) >> TBF_WHEEL_SHIFT;
+
+	w = this_cpu_ptr(&tbf_wheels);
+	if (e->wheel == w && e->slot == slot)
+		return;
+	tbf_wheel_cancel(e);
+
+	spin_lock_irqsave(&w->lock, flags);
+	now = ktime_to_ns(ktime_get()) >> TBF_WHEEL_SHIFT;
+	/* Too far out: wake early, dequeue puts it back */
+	if (slot >= now + TBF_WHEEL_SLOTS)
+		slot = now + TBF_WHEEL_SLOTS - 1;
+
+	list_add_tail(&e->list, &w->slots[slot & TBF_WHEEL_MASK]);
+	e->slot = slot;
+	e->wheel = w;
+	if (!w->pending++ || slot < w->next) {
+		w->next = slot;
+		hrtimer_start(&w->timer,
+			      ns_to_ktime(slot << TBF_WHEEL_SHIFT),
+			      HRTIMER_MODE_ABS_PINNED);
+	}
+	spin_unlock_irqrestore(&w->lock, flags);
+}
+
+static enum hrtimer_restart tbf_wheel_fire(struct hrtimer *timer)
+{
+	struct tbf_wheel *w = container_of(timer, struct tbf_wheel, timer);
+	struct tbf_wheel_entry *e, *n;
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	u64 now, slot, last;
+
+	now = ktime_to_ns(hrtimer_cb_get_time(timer)) >> TBF_WHEEL_SHIFT;
+
+	spin_lock(&w->lock);
+	last = min(now, w->next + TBF_WHEEL_SLOTS - 1);
+	for (slot = w->next; slot <= last && w->pending; slot++) {
+		list_for_each_entry_safe(e, n, &w->slots[slot & TBF_WHEEL_MASK],
+					 list) {
+			if (e->slot > now)
+				continue;
+			list_del(&e->list);
+			e->wheel = NULL;
+			w->pending--;
+			qdisc_unthrottled(e->sch);
+			__netif_schedule(qdisc_root(e->sch));
+		}
+	}
+
+	if (w->pending) {
+		for (slot = now + 1; slot <= now + TBF_WHEEL_SLOTS; slot++)
+			if (!list_empty(&w->slots[slot & TBF_WHEEL_MASK]))
+				break;
+		w->next = slot;
+		hrtimer_set_expires(timer, ns_to_ktime(slot << TBF_WHEEL_SHIFT));
+		ret = HRTIMER_RESTART;
+	}
+	spin_unlock(&w->lock);
+	return ret;
+}
+
+static void tbf_edt_reset(struct tbf_sched_data *q)
+{
+	psched_time_t now = psched_get_time();
+
+	q->t_empty = now > q->buffer ? now - q->buffer : 0;
+	q->t_pempty = now > q->mtu ? now - q->mtu : 0;
+}
+
 static int tbf_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 {
 	struct tbf_sched_data *q = qdisc_priv(sch);
+	psched_time_t d = 0, t_empty = 0, t_pempty = 0;
 	int ret;
 
 	if (qdisc_pkt_len(skb) > q->max_size)
 		return qdisc_reshape_fail(skb, sch);
 
+	if (q->edt) {
+		unsigned int len = qdisc_pkt_len(skb);
+		long cost = L2T(q, len), pcost = 0;
+
+		d = max_t(psched_time_t, psched_get_time(), q->t_empty + cost);
+		if (q->P_tab) {
+			pcost = L2T_P(q, len);
+			d = max_t(psched_time_t, d, q->t_pempty + pcost);
+			t_pempty = d > q->mtu ? d - q->mtu : 0;
+			t_pempty = max(t_pempty, q->t_pempty) + pcost;
+		}
+		t_empty = d > q->buffer ? d - q->buffer : 0;
+		t_empty = max(t_empty, q->t_empty) + cost;
+		skb->tstamp = ns_to_ktime(PSCHED_TICKS2NS(d));
+	}
+
 	ret = qdisc_enqueue(skb, q->qdisc);
 	if (ret != NET_XMIT_SUCCESS) {
 		if (net_xmit_drop_count(ret))
@@ -132,6 +303,10 @@ static int tbf_enqueue(struct sk_buff *skb, struct Qdisc *sch)
 		return ret;
 	}
 
+	if (q->edt) {
+		q->t_empty = t_empty;
+		q->t_pempty = t_pempty;
+	}
 	sch->q.qlen++;
 	return NET_XMIT_SUCCESS;
 }
@@ -148,11 +323,41 @@ static unsigned int tbf_drop(struct Qdisc *sch)
 	return len;
 }
 
+static struct sk_buff *tbf_edt_dequeue(struct Qdisc *sch)
+{
+	struct tbf_sched_data *q = qdisc_priv(sch);
+	struct sk_buff *skb;
+	u64 departure;
+
+	skb = q->qdisc->ops->peek(q->qdisc);
+	if (skb == NULL)
+		return NULL;
+
+	departure = ktime_to_ns(skb->tstamp);
+	if (departure > ktime_to_ns(ktime_get())) {
+		tbf_wheel_schedule(&q->wentry, departure);
+		sch->qstats.overlimits++;
+		return NULL;
+	}
+
+	skb = qdisc_dequeue_peeked(q->qdisc);
+	if (unlikely(!skb))
+		return NULL;
+
+	sch->q.qlen--;
+	qdisc_unthrottled(sch);
+	qdisc_bstats_update(sch, skb);
+	return skb;
+}
+
 static struct sk_buff *tbf_dequeue(struct Qdisc *sch)
 {
 	struct tbf_sched_data *q = qdisc_priv(sch);
 	struct sk_buff *skb;
 
+	if (q->edt)
+		return tbf_edt_dequeue(sch);
+
 	skb = q->qdisc->ops->peek(q->qdisc);
 
 	if (skb) {
@@ -218,6 +423,8 @@ static void tbf_reset(struct Qdisc *sch)
 	q->tokens = q->buffer;
 	q->ptokens = q->mtu;
 	qdisc_watchdog_cancel(&q->watchdog);
+	tbf_wheel_cancel(&q->wentry);
+	tbf_edt_reset(q);
 }
 
 static const struct nla_policy tbf_policy[TCA_TBF_MAX + 1] = {
@@ -298,6 +505,7 @@ static int tbf_change(struct Qdisc *sch, struct nlattr *opt)
 	q->buffer = qopt->buffer;
 	q->tokens = q->buffer;
 	q->ptokens = q->mtu;
+	tbf_edt_reset(q);
 
 	swap(q->R_tab, rtab);
 	swap(q->P_tab, ptab);
@@ -322,6 +530,8 @@ static int tbf_init(struct Qdisc *sch, struct nlattr *opt)
 	q->t_c = psched_get_time();
 	qdisc_watchdog_init(&q->watchdog, sch);
 	q->qdisc = &noop_qdisc;
+	q->edt = tbf_edt;
+	q->wentry.sch = sch;
 
 	return tbf_change(sch, opt);
 }
@@ -331,6 +541,7 @@ static void tbf_destroy(struct Qdisc *sch)
 	struct tbf_sched_data *q = qdisc_priv(sch);
 
 	qdisc_watchdog_cancel(&q->watchdog);
+	tbf_wheel_cancel(&q->wentry);
 
 	if (q->P_tab)
 		qdisc_put_rtab(q->P_tab);
@@ -454,12 +665,27 @@ static struct Qdisc_ops tbf_qdisc_ops __read_mostly = {
 
 static int __init tbf_module_init(void)
 {
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		struct tbf_wheel *w = per_cpu_ptr(&tbf_wheels, cpu);
+
+		spin_lock_init(&w->lock);
+		hrtimer_init(&w->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_PINNED);
+		w->timer.function = tbf_wheel_fire;
+		for (i = 0; i < TBF_WHEEL_SLOTS; i++)
+			INIT_LIST_HEAD(&w->slots[i]);
+	}
 	return register_qdisc(&tbf_qdisc_ops);
 }
 
 static void __exit tbf_module_exit(void)
 {
+	int cpu;
+
 	unregister_qdisc(&tbf_qdisc_ops);
+	for_each_possible_cpu(cpu)
+		hrtimer_cancel(&per_cpu_ptr(&tbf_wheels, cpu)->timer);
 }
 module_init(tbf_module_init)
 module_exit(tbf_module_exit)